@@ -0,0 +1,107 @@
+// account loading and login throughput, built against the server's own code
+#define main server_main
+#include "../src/server.c"
+#undef main
+
+#define BENCH_ACCOUNTS				1000000
+#define BENCH_SECONDS				5
+
+volatile u8	bench_running;
+u32			bench_accounts;
+u64			bench_logins[AUTH_THREADS_MAX];
+
+void* bench_login_handler(void* void_index)
+{
+	// random accounts, each login given straight back, as a client that logs in and out would
+	u64 index  = (u64) void_index;
+	u32 seed   = 0x9e3779b9u * (u32) (index + 1);
+	i32 owner  = 1000 + (i32) index;
+	u64 logins = 0;
+	u8  username[DEFAULT_NAME_LENGTH];
+	u8  password[DEFAULT_NAME_LENGTH];
+	while (bench_running)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		u32 account = seed % bench_accounts;
+
+		// building the names is part of the figure, a real login arrives as a frame to copy from
+		memset(username, 0, sizeof(username));
+		memset(password, 0, sizeof(password));
+		snprintf((char*) username, sizeof(username), "user%u", account);
+		snprintf((char*) password, sizeof(password), "pass%u", account);
+
+		u32 id;
+		if (auth_check(username, password, owner, &id) == AUTH_SUCC)
+		{
+			auth_release(id, owner, username);
+			logins++;
+		}
+	}
+	bench_logins[index] = logins;
+	return 0;
+}
+
+i32 main(i32 argc, u8** argv)
+{
+	// usage: auth.exe [accounts] [threads] [seconds], threads default to one per core
+	i64 cores      = sysconf(_SC_NPROCESSORS_ONLN);
+	bench_accounts = argc > 1 ? strtoul((char*) argv[1], 0, 10) : BENCH_ACCOUNTS;
+	u32 threads    = argc > 2 ? strtoul((char*) argv[2], 0, 10) : (cores < 1 ? 1 : cores);
+	u32 seconds    = argc > 3 ? strtoul((char*) argv[3], 0, 10) : BENCH_SECONDS;
+	if (!bench_accounts) { bench_accounts = 1; }
+	if (!threads) { threads = 1; }
+	if (threads > AUTH_THREADS_MAX) { threads = AUTH_THREADS_MAX; }
+
+	// the generated file goes in a scratch directory, never over a real one
+	char directory[] = "/tmp/bench-auth-XXXXXX";
+	if (!mkdtemp(directory) || chdir(directory) < 0)
+	{
+		ERROR("Unable to make a scratch directory\n");
+	}
+	FILE* file = fopen(AUTH_FILE, "w");
+	if (!file)
+	{
+		ERROR("Unable to write " AUTH_FILE "\n");
+	}
+	fprintf(file, "Username\tPassword\n");
+	for (u32 i = 0; i < bench_accounts; i++)
+	{
+		fprintf(file, "user%u\tpass%u\n", i, i);
+	}
+	fclose(file);
+
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	database = auth_load(0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unlink(AUTH_FILE);
+	rmdir(directory);
+	if (!database)
+	{
+		ERROR("Unable to load the generated accounts\n");
+	}
+	printf("load:   %u accounts in %.3fs on %ld cores\n", database->count,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, (long) cores);
+
+	pthread_t workers[AUTH_THREADS_MAX];
+	bench_running = 1;
+	for (u64 i = 0; i < threads; i++)
+	{
+		pthread_create(&workers[i], 0, bench_login_handler, (void*) i);
+	}
+	sleep(seconds);
+	bench_running = 0;
+
+	u64 logins = 0;
+	for (u32 i = 0; i < threads; i++)
+	{
+		pthread_join(workers[i], 0);
+		logins += bench_logins[i];
+	}
+	printf("login:  %u threads, %.0f logins/s in all, %.0f per thread\n", threads,
+		(f64) logins / seconds, (f64) logins / seconds / threads);
+	return 0;
+}
@@ -0,0 +1,68 @@
+// packed board round trip, built against the server's own code
+#define main server_main
+#include "../src/server.c"
+#undef main
+
+#define BENCH_TILES					480
+#define BENCH_ROUNDS				1000000
+
+f64 bench_elapsed(struct timespec* start)
+{
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+i32 main(i32 argc, u8** argv)
+{
+	// usage: board.exe [rounds], one round is an unpack and a pack, as a reveal does
+	u32 rounds = argc > 1 ? strtoul((char*) argv[1], 0, 10) : BENCH_ROUNDS;
+	if (!rounds) { rounds = 1; }
+
+	u8 tiles[BENCH_TILES];
+	u8 board[BOARD_PACKED_LEN(BENCH_TILES)] = {0};
+	u8 check[BOARD_PACKED_LEN(BENCH_TILES)];
+	for (u16 i = 0; i < BENCH_TILES; i++)
+	{
+		tiles[i] = (i * 7) % 12;
+	}
+	board_pack(board, tiles, BENCH_TILES);
+	memcpy(check, board, sizeof(board));
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (u32 r = 0; r < rounds; r++)
+	{
+		board_unpack(board, tiles, BENCH_TILES);
+		board_pack(board, tiles, BENCH_TILES);
+	}
+	f64 packed = bench_elapsed(&start);
+
+	// the same round trip a tile at a time through board_get and board_set
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (u32 r = 0; r < rounds; r++)
+	{
+		for (u16 i = 0; i < BENCH_TILES; i++)
+		{
+			tiles[i] = board_get(board, i);
+		}
+		for (u16 i = 0; i < BENCH_TILES; i++)
+		{
+			board_set(board, i, tiles[i]);
+		}
+	}
+	f64 scalar = bench_elapsed(&start);
+
+	if (memcmp(check, board, sizeof(board)))
+	{
+		ERROR("Round trip changed the board\n");
+	}
+	#ifdef __SSE2__
+	const char* path = "sse2";
+	#else
+	const char* path = "scalar";
+	#endif
+	printf("board:  %u tiles, %.0f ns per round trip (%s), %.0f ns a tile at a time\n", BENCH_TILES,
+		packed * 1e9 / rounds, path, scalar * 1e9 / rounds);
+	return 0;
+}
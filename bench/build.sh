@@ -0,0 +1,34 @@
+#!/usr/bin/env bash
+
+# built like the server, so the figures are the ones it would see, extra flags such as -O2 are passed on
+cd "$(dirname "$0")"
+rm -f *.exe
+
+_ARGS="-std=gnu99 -pthread $*"
+
+if [[ $OSTYPE == darwin* ]]; then
+    ESC="\x1B"
+else
+    ESC="\e"
+fi
+
+echo ""
+
+for bench in auth board; do
+    echo -e "$ESC[94mbuilding $bench$ESC[0m"
+    if gcc $_ARGS $bench.c -o $bench.exe -lm -lcrypt; then
+        echo -e " :::  $ESC[32m$bench success$ESC[0m"
+    else
+        echo -e "\n - $ESC[1m$ESC[91m$bench failed$ESC[0m"
+        echo ""
+        exit 1
+    fi
+done
+
+echo ""
+
+# usage: ./auth.exe [accounts] [threads] [seconds], ./board.exe [rounds]
+./auth.exe
+./board.exe
+
+echo ""
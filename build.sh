@@ -26,7 +26,7 @@ echo ""
 
 # server
 echo -e "$ESC[1m[2/2]$ESC[0m $ESC[94mbuilding server$ESC[0m"
-if gcc $_ARGS src/server.c -o server.exe; then
+if gcc $_ARGS src/server.c -o server.exe -lm -lcrypt; then
     echo -e " :::  $ESC[32mserver success$ESC[0m"
 else
     echo -e "\n - $ESC[1m$ESC[91mserver failed$ESC[0m"
@@ -13,6 +13,9 @@
 #include "sys/types.h"
 #include "sys/socket.h"
 #include "sys/select.h"
+#include "sys/un.h"
+#include "sys/mman.h"
+#include "poll.h"
 #include "pthread.h"
 
 // local
@@ -22,6 +25,7 @@
 // defined constants
 #define NUM_CONNECT_RETRIES		64
 #define DEFAULT_FPS				24.0
+#define CHANNEL_RETRIES			1000
 
 #define MENU_MAX				2
 #define MENU_PLAY				0
@@ -61,12 +65,23 @@ static const u8 TILE_ROW[] = {"ABCDEFGHI"};
 // globals
 struct termios  orig_termios;
 u32             STATE;
-i32             server_sock;
+i32             server_sock = -1;
 i32             ret_val;
 u8 				queue[QUEUE_BUFFERS][DEFAULT_MSG_LEN];
 u8 				message_idx = 0;
 pthread_t		message_manager;
 pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t send_mutex  = PTHREAD_MUTEX_INITIALIZER;
+struct sockaddr_storage server_addr;
+socklen_t       server_addr_size;
+u8              channel_wanted = 0;
+ChannelMemory*  channel        = 0;
+i32             channel_fds[CHANNEL_FDS] = { -1, -1, -1 };
+i32             channel_bells[2];
+u32             channel_up_tail;
+u32             channel_down_head;
+u8				session_token[SESSION_TOKEN_LEN];
+u8				session_held = 0;
 
 u8 exit_flag_connected        = 0;
 u8 exit_flag_thread_listening = 0;
@@ -75,10 +90,17 @@ u8 exit_flag_thread_listening = 0;
 // prototypes
 i32   keyboard_hit();
 i8    connect_to_server(i32 argc, u8** argv);
+i8    reconnect_to_server();
 void  exit_handle();
 void* message_handler(void* void_thread_idx);
 void  reset_terminal_mode();
 void  set_conio_terminal_mode();
+void  request_leaderboard_page(u8* msg, u16 page_number);
+void  subscribe_leaderboard_page(u8* msg, u16 page_number, u16 count);
+i32   client_send(u8* msg);
+i32   client_recv(u8* msg);
+void  channel_attach();
+void  channel_detach();
 
 
 // entry point
@@ -113,6 +135,8 @@ i32 main(i32 argc, u8** argv)
 	u8* target_field          = 0;
 	u8  name_index 			  = 0;
 	u16 queue_position		  = 0;
+	u32 queue_wait			  = 0;
+	u8  server_busy			  = 0;
 	u16 login_fails			  = 0;
 	f64 time_elapsed		  = 0;
 
@@ -272,7 +296,7 @@ i32 main(i32 argc, u8** argv)
 							msg_pointer += DEFAULT_NAME_LENGTH;
 							*msg_pointer = END_OF_TRANSMISSION;
 
-							ret_val = send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL); 
+							ret_val = client_send(msg);
 							if (ret_val < 0)
 							{
 								printf("\rFailed to send login information to server.\r\n");
@@ -376,18 +400,11 @@ i32 main(i32 argc, u8** argv)
 									msg[i] = MESSAGE_TYPE_START[i];
 								}
 								msg[LEN_TYPE_START] = END_OF_TRANSMISSION;
-								send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+								client_send(msg);
 								break; 
 							case MENU_LEADERBOARD: 
 								STATE = STATE_LEADERBOARD;
-								for (u16 i = 0; i < LEN_TYPE_LEAD_P; i++)
-								{
-									msg[i] = MESSAGE_TYPE_LEAD_P[i];
-								}
-								msg[LEN_TYPE_LEAD_P]   = page_number >> 8;
-								msg[LEN_TYPE_LEAD_P+1] = page_number;
-								msg[LEN_TYPE_LEAD_P+2] = END_OF_TRANSMISSION;
-								send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+								request_leaderboard_page(msg, page_number);
 								break; 
 							case MENU_QUIT:
 								exit_handle();
@@ -421,7 +438,7 @@ i32 main(i32 argc, u8** argv)
 									msg[i] = MESSAGE_TYPE_STOP[i];
 								}
 								msg[LEN_TYPE_STOP] = END_OF_TRANSMISSION;
-								send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+								client_send(msg);
 							}
 						}
 
@@ -492,7 +509,7 @@ i32 main(i32 argc, u8** argv)
 							}
 							msg[LEN_TYPE_REV]     = game_cursor;
 							msg[LEN_TYPE_REV + 1] = END_OF_TRANSMISSION;
-							send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+							client_send(msg);
 						}
 
 						// space
@@ -512,7 +529,7 @@ i32 main(i32 argc, u8** argv)
 							}
 							msg[LEN_TYPE_FLAG]      = game_cursor;
 							msg[LEN_TYPE_FLAG + 1]  = END_OF_TRANSMISSION;
-							send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+							client_send(msg);
 						}
 
 						// alternative controls -------------------------------------------------
@@ -555,7 +572,7 @@ i32 main(i32 argc, u8** argv)
 										game_map[i] = GAME_UNKNOWN;
 									}
 									msg[LEN_TYPE_FLAG] = i;
-									send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+									client_send(msg);
 								}
 							}
 						}
@@ -590,14 +607,7 @@ i32 main(i32 argc, u8** argv)
 
 						if (next_page_request)
 						{
-							for (u16 i = 0; i < LEN_TYPE_LEAD_P; i++)
-							{
-								msg[i] = MESSAGE_TYPE_LEAD_P[i];
-							}
-							msg[LEN_TYPE_LEAD_P]   = page_number >> 8;
-							msg[LEN_TYPE_LEAD_P+1] = page_number;
-							msg[LEN_TYPE_LEAD_P+2] = END_OF_TRANSMISSION;
-							send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+							request_leaderboard_page(msg, page_number);
 						}
 					}
 
@@ -605,6 +615,7 @@ i32 main(i32 argc, u8** argv)
 					else if (temp == 10 || temp == 13)
 					{
 						STATE = STATE_MENU;
+						subscribe_leaderboard_page(msg, page_number, 0);
 						page_number = 0;
 					}
 				}
@@ -633,10 +644,16 @@ i32 main(i32 argc, u8** argv)
 			// parse message
 			if(parse_header(&msg_pointer, MESSAGE_TYPE_QUEUE, LEN_TYPE_QUEUE))
 			{
-				STATE 		   |= STATE_WAITING;
+				// credentials can still be typed while queued, a login sent early lets a premium account move up
+				if (!(STATE & (STATE_USERNAME_EDIT | STATE_PASSWORD_EDIT)))
+				{
+					STATE |= STATE_WAITING;
+				}
+				server_busy     = 0;
 				queue_position  = msg[LEN_TYPE_QUEUE] << 8;
 				queue_position |= msg[LEN_TYPE_QUEUE+1];
 				queue_position++;
+				queue_wait      = read_u32(msg + LEN_TYPE_QUEUE + 3);
 			}
 			else if(parse_header(&msg_pointer, MESSAGE_TYPE_TIME, LEN_TYPE_TIME))
 			{
@@ -670,14 +687,47 @@ i32 main(i32 argc, u8** argv)
 			{
 				STATE &= ~STATE_WAITING;
 				queue_position = 0;
+				queue_wait     = 0;
+				server_busy    = 0;
+			}
+			else if(parse_header(&msg_pointer, MESSAGE_TYPE_REJECT, LEN_TYPE_REJECT))
+			{
+				// turned away, the message thread comes back after the retry so the wait starts over
+				STATE           |= STATE_WAITING;
+				queue_position   = 0;
+				server_busy      = 1;
+				animation_cycles = 1;
 			}
 			else if(parse_header(&msg_pointer, MESSAGE_TYPE_ACC, LEN_TYPE_ACC))
 			{
 				STATE = STATE_MENU;
 				login_fails = 0;
+
+				// hold on to the token in case the connection drops
+				memcpy(session_token, msg + LEN_TYPE_ACC, SESSION_TOKEN_LEN);
+				session_held = 1;
 			}
-			else if (parse_header(&msg_pointer, MESSAGE_TYPE_NOP, LEN_TYPE_NOP))
+			else if(parse_header(&msg_pointer, MESSAGE_TYPE_SNAP, LEN_TYPE_SNAP))
 			{
+				// resumed, pick up where the game was left
+				u8* snapshot = msg + LEN_TYPE_SNAP;
+				memcpy(session_token, snapshot, SESSION_TOKEN_LEN);
+				snapshot += SESSION_TOKEN_LEN + GAME_MODE_LEN;
+
+				u8 in_game    = snapshot[0];
+				mines_left    = snapshot[1];
+				time_elapsed  = (f64) read_u64(snapshot + 2);
+				time_elapsed += (f64) read_u64(snapshot + 10) / NANOSECONDS;
+				for (u8 j = 0; j < NUM_TILES; j++)
+				{
+					game_map[j] = snapshot[18 + j];
+				}
+				STATE = in_game ? STATE_GAME : STATE_MENU;
+			}
+			else if (parse_header(&msg_pointer, MESSAGE_TYPE_NOP, LEN_TYPE_NOP) || 
+					(msg[0] == MESSAGE_TYPE_THROTTLE[0] && msg[LEN_TYPE_THROTTLE] == THROTTLE_LOGIN))
+			{
+				// a throttled login was dropped, it is retried the same way as a refused one
 				// reset fields
 				u8 set 		 = 0;
 				target_field = 0;
@@ -810,6 +860,70 @@ i32 main(i32 argc, u8** argv)
 					}
 				}
 			}
+			else if (parse_header(&msg_pointer, MESSAGE_TYPE_LEAD_S, LEN_TYPE_LEAD_S))
+			{
+				// streamed leaderboard query result, rows are placed by rank
+				u32 first_rank = read_u32(msg_pointer + 9);
+				u8  count      = msg_pointer[13];
+				msg_pointer   += LEADERBOARD_FRAME_HEADER - LEN_TYPE_LEAD_S;
+
+				// first frame of a page clears the old one
+				if (first_rank == (u32) page_number * LEADERBOARD_ENTRIES)
+				{
+					for (u8 j = 0; j < LEADERBOARD_ENTRIES; j++)
+					{
+						leaderboard_seconds       [j] = 0;
+						leaderboard_nano 	      [j] = 0;
+						leaderboard_games_played  [j] = 0;
+						leaderboard_games_won 	  [j] = 0;
+						for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
+						{
+							leaderboard_usernames[j][k] = 0;
+						}
+					}
+				}
+
+				for (u8 j = 0; j < count; j++)
+				{
+					u32 row = first_rank + j - (u32) page_number * LEADERBOARD_ENTRIES;
+					if (row < LEADERBOARD_ENTRIES)
+					{
+						for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
+						{
+							leaderboard_usernames[row][k] = msg_pointer[k];
+						}
+						leaderboard_seconds     [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH);
+						leaderboard_nano        [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 4);
+						leaderboard_games_won   [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 8);
+						leaderboard_games_played[row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 12);
+					}
+					msg_pointer += LEADERBOARD_ENTRY_LEN;
+				}
+			}
+			else if (parse_header(&msg_pointer, MESSAGE_TYPE_PUSH, LEN_TYPE_PUSH))
+			{
+				// live changes to the page on screen
+				u32 first_rank = read_u32(msg_pointer + 7);
+				u8  count      = msg_pointer[11];
+				msg_pointer   += LEADERBOARD_PUSH_HEADER - LEN_TYPE_PUSH;
+
+				for (u8 j = 0; j < count; j++)
+				{
+					u32 row = first_rank + j - (u32) page_number * LEADERBOARD_ENTRIES;
+					if (STATE & STATE_LEADERBOARD && row < LEADERBOARD_ENTRIES)
+					{
+						for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
+						{
+							leaderboard_usernames[row][k] = msg_pointer[k];
+						}
+						leaderboard_seconds     [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH);
+						leaderboard_nano        [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 4);
+						leaderboard_games_won   [row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 8);
+						leaderboard_games_played[row] = read_u32(msg_pointer + DEFAULT_NAME_LENGTH + 12);
+					}
+					msg_pointer += LEADERBOARD_ENTRY_LEN;
+				}
+			}
 			else if (parse_header(&msg_pointer, MESSAGE_TYPE_LEAD_E, LEN_TYPE_LEAD_E))
 			{
 				// leaderboard empty - cant increment
@@ -901,12 +1015,28 @@ i32 main(i32 argc, u8** argv)
 					printf("          Use <TAB> To Toggle Password Show\r\n");
 					printf("\r\n\r\n\r\n\r\n");
 				}
-				else if (STATE & STATE_WAITING)
+				else if (STATE & STATE_WAITING || queue_position)
 				{
 					printf("\r\n\r\n\r\n\r\n\r\n");
-					printf("                  Waiting in Queue.\r\n\r\n");
-					printf("                Current Position: %u\r\n", queue_position);
-					printf("\r\n\r\n\r\n\r\n");
+					if (server_busy)
+					{
+						printf("                    Server Busy.\r\n\r\n");
+						printf("                  Retrying Shortly.\r\n\r\n");
+					}
+					else
+					{
+						printf("                  Waiting in Queue.\r\n\r\n");
+						printf("                Current Position: %u\r\n", queue_position);
+						if (queue_wait)
+						{
+							printf("                 Estimated Wait: %us\r\n", (queue_wait + 999) / 1000);
+						}
+						else
+						{
+							printf("\r\n");
+						}
+					}
+					printf("\r\n\r\n\r\n");
 				}
 				else if (STATE & STATE_USED)
 				{
@@ -1330,10 +1460,47 @@ void set_conio_terminal_mode()
     tcsetattr(0, TCSANOW, &new_termios);
 }
 
+void request_leaderboard_page(u8* msg, u16 page_number)
+{
+	// best times, a page at a time, streamed back as one or more frames
+	for (u16 i = 0; i < LEN_TYPE_LEAD_Q; i++)
+	{
+		msg[i] = MESSAGE_TYPE_LEAD_Q[i];
+	}
+	msg[LEN_TYPE_LEAD_Q + 0] = LEADERBOARD_QUERY_PAGE;
+	msg[LEN_TYPE_LEAD_Q + 1] = LEADERBOARD_SORT_TIME;
+	msg[LEN_TYPE_LEAD_Q + 2] = LEADERBOARD_WINDOW_ALL;
+	msg[LEN_TYPE_LEAD_Q + 3] = 0;
+	msg[LEN_TYPE_LEAD_Q + 4] = LEADERBOARD_ENTRIES;
+	write_u64(msg + LEN_TYPE_LEAD_Q + 5, GAME_MODE_DEFAULT);
+	write_u32(msg + LEADERBOARD_QUERY_HEADER, (u32) page_number * LEADERBOARD_ENTRIES);
+	msg[LEADERBOARD_QUERY_HEADER + 4] = END_OF_TRANSMISSION;
+	client_send(msg);
+
+	// and keep it live while it is on screen
+	subscribe_leaderboard_page(msg, page_number, LEADERBOARD_ENTRIES);
+}
+
+void subscribe_leaderboard_page(u8* msg, u16 page_number, u16 count)
+{
+	for (u16 i = 0; i < LEN_TYPE_SUB; i++)
+	{
+		msg[i] = MESSAGE_TYPE_SUB[i];
+	}
+	msg[LEN_TYPE_SUB + 0] = LEADERBOARD_SORT_TIME;
+	msg[LEN_TYPE_SUB + 1] = LEADERBOARD_WINDOW_ALL;
+	write_u32(msg + LEN_TYPE_SUB + 2, (u32) page_number * LEADERBOARD_ENTRIES);
+	msg[LEN_TYPE_SUB + 6] = count >> 8;
+	msg[LEN_TYPE_SUB + 7] = count;
+	write_u64(msg + LEN_TYPE_SUB + 8, GAME_MODE_DEFAULT);
+	msg[LEN_TYPE_SUB + 8 + GAME_MODE_LEN] = END_OF_TRANSMISSION;
+	client_send(msg);
+}
+
 void exit_handle() 
 {
-	// kill networking thread
-	if (exit_flag_thread_listening)
+	// kill networking thread, unless it is the one giving up
+	if (exit_flag_thread_listening && !pthread_equal(pthread_self(), message_manager))
 	{
 		pthread_cancel(message_manager);
 	}
@@ -1354,15 +1521,43 @@ void* message_handler(void* void_thread_idx)
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 	u8  msg[DEFAULT_MSG_LEN] = {0};
 	i32 ret_val = 0;
+	u32 retry   = 0;
 	while (1)
 	{
 		// skip if queue is full
 		if (message_idx >= QUEUE_BUFFERS) { continue; }
 
-		// get message
-		ret_val = recv(server_sock, msg, DEFAULT_MSG_LEN, 0);
-		if (ret_val < 0) { continue; }
+		// get message, a dropped connection is brought back with the session token
+		ret_val = client_recv(msg);
+		if (ret_val == 0 && retry)
+		{
+			// a server that turned us away said when to come back
+			const struct timespec sleep_amount = { retry / 1000, (retry % 1000) * 1000000 };
+			nanosleep(&sleep_amount, 0);
+			retry = 0;
+		}
+		if (ret_val == 0 && reconnect_to_server()) { exit_handle(); }
+		if (ret_val <= 0) { continue; }
 		if (msg[0] == 0) { continue; }
+		if (msg[0] == MESSAGE_TYPE_REJECT[0])
+		{
+			retry = read_u32(msg + LEN_TYPE_REJECT + 1);
+		}
+
+		// a granted channel takes over from the socket in both directions
+		if (msg[0] == MESSAGE_TYPE_OPENED[0])
+		{
+			if (msg[LEN_TYPE_OPENED]) { channel_attach(); }
+			continue;
+		}
+
+		// heartbeats are answered straight away, the nonce goes back as it came
+		if (msg[0] == MESSAGE_TYPE_PING[0])
+		{
+			msg[0] = MESSAGE_TYPE_PONG[0];
+			client_send(msg);
+			continue;
+		}
 
 		// store it
 		pthread_mutex_lock(&queue_mutex);
@@ -1391,34 +1586,66 @@ i8 connect_to_server(i32 argc, u8** argv)
 {
 	STATE = STATE_CONNECTING;
 
-	u32 listen_port;
-	if (argc < 2)
+	// a port goes over TCP, a path is the server's unix socket on this host
+	u32 listen_port = DEFAUL_PORT;
+	u8* local_path  = 0;
+	for (i32 i = 1; i < argc; i++)
 	{
-		listen_port = DEFAUL_PORT;
-	}
-	else
-	{
-		i32 desired_port = atoi(argv[1]);
-		if (desired_port < 0)
+		if (!strcmp((char*) argv[i], "--channel"))
+		{
+			channel_wanted = 1;
+		}
+		else if (argv[i][0] == '-' || (argv[i][0] >= '0' && argv[i][0] <= '9'))
 		{
-			listen_port = (desired_port * -1);
+			i32 desired_port = atoi(argv[i]);
+			if (desired_port < 0)
+			{
+				listen_port = (desired_port * -1);
+			}
+			else
+			{
+				listen_port = desired_port;
+			}
 		}
 		else
 		{
-			listen_port = desired_port;
+			local_path = argv[i];
 		}
 	}
 
-	struct sockaddr_in send_addr;
-	send_addr.sin_family 		= AF_INET;
-	send_addr.sin_port 			= htons(listen_port);
-	send_addr.sin_addr.s_addr	= INADDR_ANY;
-	socklen_t send_addr_size = sizeof(send_addr);
+	if (local_path)
+	{
+		struct sockaddr_un* local_addr = (struct sockaddr_un*) &server_addr;
+		local_addr->sun_family = AF_UNIX;
+		strncpy(local_addr->sun_path, (char*) local_path, sizeof(local_addr->sun_path) - 1);
+		server_addr_size = sizeof(struct sockaddr_un);
+	}
+	else
+	{
+		struct sockaddr_in* inet_addr = (struct sockaddr_in*) &server_addr;
+		inet_addr->sin_family 		= AF_INET;
+		inet_addr->sin_port 		= htons(listen_port);
+		inet_addr->sin_addr.s_addr	= INADDR_ANY;
+		server_addr_size = sizeof(struct sockaddr_in);
+	}
+
+	return reconnect_to_server();
+}
+
+i8 reconnect_to_server()
+{
+	struct sockaddr_storage send_addr = server_addr;
+	socklen_t send_addr_size = server_addr_size;
+	if (server_sock != -1)
+	{
+		close(server_sock);
+	}
+	channel_detach();
 
 	ret_val       = -1;
 	server_sock   = -1;
 
-	server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	server_sock = socket(send_addr.ss_family, SOCK_STREAM, send_addr.ss_family == AF_UNIX ? 0 : IPPROTO_TCP);
 	if (server_sock == -1)
 	{
 		printf("Failed to create socket.\r\n");
@@ -1449,5 +1676,142 @@ i8 connect_to_server(i32 argc, u8** argv)
 		}
 	}
 
+	// ask for the old session back before the queue gets a say
+	if (session_held)
+	{
+		u8 msg[DEFAULT_MSG_LEN] = {0};
+		for (u16 i = 0; i < LEN_TYPE_RESUME; i++)
+		{
+			msg[i] = MESSAGE_TYPE_RESUME[i];
+		}
+		memcpy(msg + LEN_TYPE_RESUME, session_token, SESSION_TOKEN_LEN);
+		msg[LEN_TYPE_RESUME + SESSION_TOKEN_LEN] = END_OF_TRANSMISSION;
+		client_send(msg);
+	}
+
+	// on the same host the frames can move onto shared memory, the server answers once it serves us
+	if (channel_wanted && send_addr.ss_family == AF_UNIX)
+	{
+		u8 msg[DEFAULT_MSG_LEN] = {0};
+		for (u16 i = 0; i < LEN_TYPE_CHANNEL; i++)
+		{
+			msg[i] = MESSAGE_TYPE_CHANNEL[i];
+		}
+		msg[LEN_TYPE_CHANNEL] = END_OF_TRANSMISSION;
+		client_send(msg);
+	}
+
 	return 0;
 }
+
+i32 client_send(u8* msg)
+{
+	// the main loop and the heartbeat answer both send, a ring only takes one producer at a time
+	pthread_mutex_lock(&send_mutex);
+	i32 sent = DEFAULT_MSG_LEN;
+	if (!channel)
+	{
+		sent = send(server_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+	}
+	else
+	{
+		// a full ring empties as the server catches up, one that never does means it is gone
+		for (u16 i = 0; !channel_push(&channel->up, &channel_up_tail, msg, channel_bells[0]); i++)
+		{
+			if (i == CHANNEL_RETRIES)
+			{
+				sent = -1;
+				break;
+			}
+			const struct timespec sleep_amount = {0, 1000000};
+			nanosleep(&sleep_amount, 0);
+		}
+	}
+	pthread_mutex_unlock(&send_mutex);
+	return sent;
+}
+
+i32 client_recv(u8* msg)
+{
+	// frames on the ring go first, with a channel open the socket only ever brings the hangup
+	while (channel)
+	{
+		if (channel_pop(&channel->down, &channel_down_head, msg, channel_bells[0])) { return DEFAULT_MSG_LEN; }
+		if (!channel_sleep(&channel->down, channel_down_head)) { continue; }
+
+		struct pollfd fds[2] = { { server_sock, POLLIN, 0 }, { channel_bells[1], POLLIN, 0 } };
+		poll(fds, 2, -1);
+		u64 value;
+		if (fds[1].revents & POLLIN) { read(channel_bells[1], &value, sizeof(value)); }
+		if (fds[0].revents)          { break; }
+	}
+
+	// the answer to a channel request brings the memfd and both eventfds with it
+	struct iovec  vector = { msg, DEFAULT_MSG_LEN };
+	struct msghdr header = {0};
+	union
+	{
+		struct cmsghdr align;
+		u8             buffer[CMSG_SPACE(sizeof(channel_fds))];
+	} control;
+	header.msg_iov        = &vector;
+	header.msg_iovlen     = 1;
+	header.msg_control    = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+	i32 received = recvmsg(server_sock, &header, 0);
+
+	struct cmsghdr* message = CMSG_FIRSTHDR(&header);
+	if (received > 0 && message && message->cmsg_type == SCM_RIGHTS)
+	{
+		i32  count = (message->cmsg_len - CMSG_LEN(0)) / sizeof(i32);
+		i32* fds   = (i32*) CMSG_DATA(message);
+		for (i32 i = 0; i < count; i++)
+		{
+			if (count != CHANNEL_FDS) { close(fds[i]); continue; }
+			if (channel_fds[i] >= 0)  { close(channel_fds[i]); }
+			channel_fds[i] = fds[i];
+		}
+	}
+	return received;
+}
+
+void channel_attach()
+{
+	// the rings come from the memfd that rode along with the answer
+	if (channel_fds[0] < 0) { return; }
+	ChannelMemory* memory = mmap(0, sizeof(ChannelMemory), PROT_READ | PROT_WRITE, MAP_SHARED, channel_fds[0], 0);
+	close(channel_fds[0]);
+	channel_fds[0] = -1;
+	if (memory == MAP_FAILED)
+	{
+		close(channel_fds[1]);
+		close(channel_fds[2]);
+		channel_fds[1] = -1;
+		channel_fds[2] = -1;
+		return;
+	}
+
+	pthread_mutex_lock(&send_mutex);
+	channel           = memory;
+	channel_bells[0]  = channel_fds[1];
+	channel_bells[1]  = channel_fds[2];
+	channel_up_tail   = 0;
+	channel_down_head = 0;
+	channel_fds[1]    = -1;
+	channel_fds[2]    = -1;
+	pthread_mutex_unlock(&send_mutex);
+}
+
+void channel_detach()
+{
+	// a new connection starts back on its socket
+	pthread_mutex_lock(&send_mutex);
+	if (channel)
+	{
+		munmap(channel, sizeof(ChannelMemory));
+		close(channel_bells[0]);
+		close(channel_bells[1]);
+		channel = 0;
+	}
+	pthread_mutex_unlock(&send_mutex);
+}
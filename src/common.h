@@ -37,12 +37,129 @@
 #define NUM_COLS					9
 #define NUM_MINES					10
 
+// Game Modes
+//   [rows][cols][mines u16][seed u32], sent wherever a leaderboard or game is selected
+//   each mode keeps its own leaderboards, times are never compared across modes
+//   START and LEAD_P take it optionally after their arguments, defaulting to GAME_MODE_DEFAULT
+#define GAME_MODE_LEN				8
+#define GAME_MODE_DEFAULT			(((u64) NUM_ROWS << 56) | ((u64) NUM_COLS << 48) | \
+									 ((u64) NUM_MINES << 32) | DEFAULT_RANDOM_SEED)
+
 // Leaderboard Information
 #define LEADERBOARD_ENTRIES			10
 
+// Leaderboard Queries
+//   LEAD_Q  [kind][sort key][window][count u16][mode][argument]
+//           page   - argument is the starting rank as a u32
+//           cursor - argument is the cursor from the end of a previous result
+//           rank   - optional username field, defaults to the logged in user
+//           around - optional username field, defaults to the logged in user
+//   LEAD_S  [kind][sort key][window][flags][sequence][total u32][first rank u32][count][mode]
+//           followed by count entries, the final frame also carries a cursor
+//   entry   [username][seconds u32][nano u32][won u32][played u32][rating u32]
+//   cursor  [id u32][seconds u32][nano u32][won u32][played u32][rating f64 bits u64]
+#define LEADERBOARD_SORT_TIME		0
+#define LEADERBOARD_SORT_RATE		1
+#define LEADERBOARD_SORT_WON		2
+#define LEADERBOARD_SORT_PLAYED		3
+#define LEADERBOARD_SORT_RATING		4
+#define LEADERBOARD_SORT_KEYS		5
+
+#define LEADERBOARD_QUERY_PAGE		0
+#define LEADERBOARD_QUERY_RANK		1
+#define LEADERBOARD_QUERY_AROUND	2
+#define LEADERBOARD_QUERY_CURSOR	3
+
+#define LEADERBOARD_WINDOW_ALL		0
+#define LEADERBOARD_WINDOW_DAILY	1
+#define LEADERBOARD_WINDOW_WEEKLY	2
+#define LEADERBOARD_WINDOWS			3
+
+#define LEADERBOARD_FLAG_MORE		1
+
+#define LEADERBOARD_QUERY_MAX		100
+#define LEADERBOARD_QUERY_HEADER	(6 + GAME_MODE_LEN)
+#define LEADERBOARD_FRAME_HEADER	(15 + GAME_MODE_LEN)
+#define LEADERBOARD_FRAME_ENTRIES	10
+#define LEADERBOARD_ENTRY_LEN		(DEFAULT_NAME_LENGTH + 20)
+#define LEADERBOARD_CURSOR_LEN		28
+
+// Leaderboard Subscriptions
+//   SUB     [sort key][window][first rank u32][count u16][mode], a count of zero unsubscribes
+//   PUSH    [sort key][window][sequence][total u32][first rank u32][count][mode]
+//           followed by count entries for the ranks that changed since the last tick
+#define LEADERBOARD_PUSH_HEADER		(13 + GAME_MODE_LEN)
+
+// Session Resumption
+//   ACC     [token], kept by the client so a dropped connection can come back
+//   RESUME  [token], sent straight after connecting, skips the queue and the login
+//   SNAP    [token][mode][in game][mines left][seconds u64][nano u64][map]
+//           the one frame a resumed session gets, it carries a fresh token
+#define SESSION_TOKEN_LEN			16
+#define SESSION_SNAPSHOT_LEN		(SESSION_TOKEN_LEN + GAME_MODE_LEN + 18 + NUM_TILES)
+
+// Streams
+//   STREAM   [stream u16][frame], a START, STOP, REV or FLAG for one of a logged in connection's games
+//            replies to it come back wrapped the same way, NOP when there is no such stream
+//            a START opens the stream, each one has its own board, clock and game budget
+//   no TIME is sent for streams and a SNAP covers the connection's own game, the streams come back as they were
+//   streams don't survive a live upgrade, the client finds out from the NOP on its next frame
+#define STREAM_MAX					1024
+#define STREAM_HEADER				(LEN_TYPE_STREAM + 2)
+
+// Rate Limiting
+//   THROTTLE [class][retry after ms u16], sent instead of the reply to a message over its budget
+//            the message itself is dropped, budgets are per connection and per source address
+#define THROTTLE_GAME				0
+#define THROTTLE_LEAD				1
+#define THROTTLE_LOGIN				2
+#define THROTTLE_CLASSES			3
+
+// Heartbeats
+//   PING     [nonce u32], sent to a client that has been quiet for the idle or in game timeout
+//   PONG     [nonce u32], the client's answer, a client silent through the grace period is closed
+
+// Admission
+//   REJECT   [reason][retry after ms u32], sent to a new connection the server can't take, which is then closed
+//            the retry is jittered so turned away clients don't all come back at once
+#define REJECT_DEPTH				0
+#define REJECT_WAIT					1
+#define REJECT_FULL					2
+#define REJECT_REASONS				3
+
+// Shared Memory Channel
+//   CHANNEL  [], asked for over the unix socket, the client writes nothing more to it until the answer
+//   OPENED   [granted], when granted a memfd with the rings and the server's and client's eventfds ride along
+//            from then on frames go up and down the rings, the socket is only watched for a hangup
+//   a side only rings the other's eventfd when that one said it is going to sleep or is waiting for room
+#define CHANNEL_FRAMES				64
+#define CHANNEL_FDS					3
+typedef struct
+{
+	u32 head    __attribute__((aligned(64)));
+	u32 tail    __attribute__((aligned(64)));
+	u32 waiting __attribute__((aligned(64)));
+	u32 full;
+	u8  frames[CHANNEL_FRAMES][DEFAULT_MSG_LEN] __attribute__((aligned(64)));
+} ChannelRing;
+typedef struct
+{
+	ChannelRing up;
+	ChannelRing down;
+} ChannelMemory;
+
 // Queue Information
+//   QUEUE  [position u16][class][estimated wait u32]
+//          the position counts the clients ahead within the same class
+//          the wait is in milliseconds, 0 until the server has seen enough sessions to tell
+//   returning sessions are placed by their RESUME, premium accounts by a LOGIN sent while queued
+//   classes are served in proportion to their weights, so none of them is starved
 #define QUEUE_CLIENT_BUFFER_LEN    	32
 #define QUEUE_BUFFERS				160
+#define QUEUE_CLASS_RESUME			0
+#define QUEUE_CLASS_PREMIUM			1
+#define QUEUE_CLASS_ANONYMOUS		2
+#define QUEUE_CLASSES				3
 
 // Message Headers
 #define LEN_TYPE_LOGIN              1
@@ -63,6 +180,19 @@
 #define LEN_TYPE_LEAD_P			    1
 #define LEN_TYPE_LEAD_R			    1
 #define LEN_TYPE_LEAD_E			    1
+#define LEN_TYPE_LEAD_Q			    1
+#define LEN_TYPE_LEAD_S			    1
+#define LEN_TYPE_SUB			    1
+#define LEN_TYPE_PUSH			    1
+#define LEN_TYPE_RESUME			    1
+#define LEN_TYPE_SNAP			    1
+#define LEN_TYPE_THROTTLE		    1
+#define LEN_TYPE_PING			    1
+#define LEN_TYPE_PONG			    1
+#define LEN_TYPE_CHANNEL		    1
+#define LEN_TYPE_REJECT			    1
+#define LEN_TYPE_OPENED			    1
+#define LEN_TYPE_STREAM			    1
 
 static const u8 MESSAGE_TYPE_LOGIN	[] = "a";
 static const u8 MESSAGE_TYPE_ACC	[] = "b";
@@ -82,6 +212,19 @@ static const u8 MESSAGE_TYPE_ADJ    [] = "o";
 static const u8 MESSAGE_TYPE_LEAD_P [] = "p";
 static const u8 MESSAGE_TYPE_LEAD_R [] = "q";
 static const u8 MESSAGE_TYPE_LEAD_E [] = "r";
+static const u8 MESSAGE_TYPE_LEAD_Q [] = "s";
+static const u8 MESSAGE_TYPE_LEAD_S [] = "t";
+static const u8 MESSAGE_TYPE_SUB    [] = "u";
+static const u8 MESSAGE_TYPE_PUSH   [] = "v";
+static const u8 MESSAGE_TYPE_RESUME [] = "y";
+static const u8 MESSAGE_TYPE_SNAP   [] = "z";
+static const u8 MESSAGE_TYPE_THROTTLE [] = "T";
+static const u8 MESSAGE_TYPE_PING   [] = "P";
+static const u8 MESSAGE_TYPE_PONG   [] = "Q";
+static const u8 MESSAGE_TYPE_CHANNEL[] = "M";
+static const u8 MESSAGE_TYPE_REJECT [] = "R";
+static const u8 MESSAGE_TYPE_STREAM [] = "S";
+static const u8 MESSAGE_TYPE_OPENED [] = "N";
 
 // Message Body Keys
 #define LEN_DATA_USERNAME             1
@@ -122,13 +265,13 @@ i8 parse_header(u8** iterator, const u8* target_data, u8 length)
 	return match_count == length;
 }
 
-i8 parse_data(u8** iterator, u8* data, const u8* target_data, u8 length)
+i8 parse_field(u8** iterator, u8* data, const u8* target_data, u8 length, u16 capacity)
 {
 	u8* backup_iterator = *iterator;
 
-	// go through word and count matches
-	u8 set_index   = 0;
-	u8 match_count = 0;
+	// go through word and count matches, anything past capacity is read over but not kept
+	u16 set_index   = 0;
+	u8  match_count = 0;
 	for (u16 i = 0; i < DEFAULT_MSG_LEN; i++)
 	{
 		if (*(*iterator) == '\n' || *(*iterator) == END_OF_TRANSMISSION)
@@ -141,7 +284,10 @@ i8 parse_data(u8** iterator, u8* data, const u8* target_data, u8 length)
 		}
 		if (match_count == length)
 		{
-			data[set_index] = *(*iterator);
+			if (set_index < capacity)
+			{
+				data[set_index] = *(*iterator);
+			}
 			set_index++;
 		}
 		else if (*(*iterator) == target_data[i])
@@ -160,6 +306,82 @@ i8 parse_data(u8** iterator, u8* data, const u8* target_data, u8 length)
 	return match_count == length;
 }
 
+i8 parse_data(u8** iterator, u8* data, const u8* target_data, u8 length)
+{
+	return parse_field(iterator, data, target_data, length, DEFAULT_MSG_LEN);
+}
+
+// Serialization
+void write_u32(u8* data, u32 value)
+{
+	data[0] = value >> 24;
+	data[1] = value >> 16;
+	data[2] = value >> 8;
+	data[3] = value;
+}
+
+u32 read_u32(u8* data)
+{
+	return ((u32) data[0] << 24) | ((u32) data[1] << 16) | ((u32) data[2] << 8) | (u32) data[3];
+}
+
+void write_u64(u8* data, u64 value)
+{
+	write_u32(data,     value >> 32);
+	write_u32(data + 4, value);
+}
+
+u64 read_u64(u8* data)
+{
+	return ((u64) read_u32(data) << 32) | read_u32(data + 4);
+}
+
+// Shared Memory Channel
+u8 channel_push(ChannelRing* ring, u32* tail, u8* frame, i32 bell)
+{
+	// single producer, the tail is kept privately so the other side can't move it, 0 when full
+	if (*tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= CHANNEL_FRAMES)
+	{
+		// the consumer rings the bell once it has made room
+		__atomic_store_n(&ring->full, 1, __ATOMIC_SEQ_CST);
+		if (*tail - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) >= CHANNEL_FRAMES) { return 0; }
+		__atomic_store_n(&ring->full, 0, __ATOMIC_RELAXED);
+	}
+	memcpy(ring->frames[*tail % CHANNEL_FRAMES], frame, DEFAULT_MSG_LEN);
+	(*tail)++;
+	__atomic_store_n(&ring->tail, *tail, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST))
+	{
+		u64 one = 1;
+		write(bell, &one, sizeof(one));
+	}
+	return 1;
+}
+
+u8 channel_pop(ChannelRing* ring, u32* head, u8* frame, i32 bell)
+{
+	// single consumer, 0 when empty
+	if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == *head) { return 0; }
+	memcpy(frame, ring->frames[*head % CHANNEL_FRAMES], DEFAULT_MSG_LEN);
+	(*head)++;
+	__atomic_store_n(&ring->head, *head, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->full, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&ring->full, 0, __ATOMIC_SEQ_CST))
+	{
+		u64 one = 1;
+		write(bell, &one, sizeof(one));
+	}
+	return 1;
+}
+
+u8 channel_sleep(ChannelRing* ring, u32 head)
+{
+	// the consumer asks to be woken, 0 if a frame got in first and it should not sleep at all
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) { return 1; }
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
 // Timing
 void time_diff(struct timespec start, struct timespec end, struct timespec* dt)
 {
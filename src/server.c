@@ -1,7 +1,12 @@
 // system
+#define _GNU_SOURCE
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
+#include "errno.h"
+#include "stddef.h"
 #include "time.h"
+#include "math.h"
 
 #include "unistd.h"
 #include "signal.h"
@@ -9,7 +14,26 @@
 #include "arpa/inet.h"
 #include "sys/types.h"
 #include "sys/socket.h"
+#include "sys/un.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "sys/inotify.h"
+#include "sys/eventfd.h"
+#include "sys/random.h"
+#include "sys/resource.h"
+#include "sys/prctl.h"
+#include "sys/syscall.h"
+#include "linux/io_uring.h"
+#include "fcntl.h"
+#include "poll.h"
+#include "crypt.h"
 #include "pthread.h"
+#include "sched.h"
+#include "ucontext.h"
+#include "semaphore.h"
+#ifdef __SSE2__
+#	include "emmintrin.h"
+#endif
 
 // local
 #include "types.h"
@@ -17,12 +41,16 @@
 
 
 // defined constants
-#define NUM_CONNECTIONS_PER_SOCK	1
-#define NUM_THREADS					10
+#define NUM_CONNECTIONS_PER_SOCK	SOMAXCONN
+#define NUM_THREADS					64
+#define SESSION_COROUTINES			64
+#define NUM_SLOTS					(NUM_THREADS * SESSION_COROUTINES)
 
 #define TIMER_OFF					0
 #define TIMER_ON					1
-#define TIMER_RW					2
+
+#define BOARD_PACKED_LEN(tiles)		(((tiles) + 1) / 2)
+#define BOARD_UNKNOWN_PAIR			(GAME_UNKNOWN | (GAME_UNKNOWN << 4))
 
 #define NUM_DIRECTIONS				8
 #define NORTH						0
@@ -37,11 +65,161 @@
 #define AUTH_FAIL 					0
 #define AUTH_SUCC 					1
 #define AUTH_USED 					2
+#define AUTH_PENDING				3
 
 #define SENT 						"Sent"
 #define RECV						"Received"
 
 #define AUTH_FILE					"Authentication.txt"
+#define RATING_FILE					"Rating.txt"
+#define HEARTBEAT_FILE				"Heartbeat.txt"
+#define POOL_FILE					"Pool.txt"
+#define ADMISSION_FILE				"Admission.txt"
+#define QUEUE_FILE					"Queue.txt"
+#define UPGRADE_SOCKET				"Upgrade.sock"
+#define LOCAL_SOCKET				"Local.sock"
+
+#define AUTH_THREADS_MAX			64
+#define AUTH_PARALLEL_MIN			(1 << 20)
+#define AUTH_OWNER_SHIFT			16
+#define AUTH_OWNER_MASK				((1 << AUTH_OWNER_SHIFT) - 1)
+#define AUTH_OWNER_CHUNKS			4096
+#define AUTH_GRACE_POLL				1000000
+#define AUTH_WATCH_BUFFER			4096
+#define AUTH_SECRET_MAX				128
+#define AUTH_VERIFIERS_MAX			AUTH_THREADS_MAX
+#define AUTH_QUEUE_MAX				256
+#define AUTH_SOURCE_MAX				4
+#define AUTH_HASH_PREFIX			"$y$"
+#define AUTH_HASH_COST				5
+
+#define LEADERBOARD_NIL				0xffffffff
+#define LEADERBOARD_LOOKUP_INIT		64
+#define LEADERBOARD_SMALL			16
+#define LEADERBOARD_LEGACY_LEN		(LEN_DATA_USERNAME + DEFAULT_NAME_LENGTH + 1 + 9 + 9 + 5 + 5)
+#define LEADERBOARD_LEGACY_ENTRIES	((DEFAULT_MSG_LEN - LEN_TYPE_LEAD_R - 2) / LEADERBOARD_LEGACY_LEN)
+#define LEADERBOARD_QUERY_FRAMES	((LEADERBOARD_QUERY_MAX + LEADERBOARD_FRAME_ENTRIES - 1) / LEADERBOARD_FRAME_ENTRIES)
+#define LEADERBOARD_PUSH_TICK		250000000
+#define LEADERBOARD_PUSH_FRAMES		32
+
+#define WINDOW_DAILY_BUCKETS		24
+#define WINDOW_DAILY_WIDTH			(60 * 60)
+#define WINDOW_WEEKLY_BUCKETS		28
+#define WINDOW_WEEKLY_WIDTH			(6 * 60 * 60)
+#define WINDOW_EXPIRE_BATCH			64
+
+#define REGISTRY_INIT				16
+#define REGISTRY_HOT				8
+#define REGISTRY_MAX				256
+
+#define SESSION_TTL					60
+#define SESSION_DETACHED_MAX		DEFAULT_NUM_ACCOUNTS
+#define SESSION_SLAB_CHUNK			16
+#define SESSION_ARENA_LEN			512
+#define SESSION_OWNER(slot)			(DEFAULT_SOCKET - 1 - (i32) (slot))
+
+#define OUTBOX_SOCKETS				(1 << 17)
+#define OUTBOX_FRAMES				128
+#define OUTBOX_HIGH					64
+#define OUTBOX_LOW					16
+#define OUTBOX_GRACE				5
+#define OUTBOX_DRAIN_POLL			100
+#define OUTBOX_NONE					0xffff
+#define OUTBOX_FRAME				0
+#define OUTBOX_TIME					1
+#define OUTBOX_QUEUE				2
+#define OUTBOX_CLASSES				2
+
+#define HEARTBEAT_IDLE				120
+#define HEARTBEAT_GAME				60
+#define HEARTBEAT_GRACE				10
+
+#define POOL_DEPTH					16
+#define POOL_WAIT					2000
+#define POOL_COOLDOWN				30
+#define POOL_TICK					1
+
+#define ADMISSION_DEPTH				4096
+#define ADMISSION_WAIT				30000
+#define ADMISSION_RETRY				5000
+#define ADMISSION_JITTER			50
+#define ADMISSION_RETRY_MAX			60000
+#define ADMISSION_DISCARD			4
+
+#define QUEUE_SOCKETS				OUTBOX_SOCKETS
+#define QUEUE_CAPACITY				(QUEUE_BUFFERS * QUEUE_CLIENT_BUFFER_LEN)
+#define QUEUE_WEIGHT_RESUME			8
+#define QUEUE_WEIGHT_PREMIUM		4
+#define QUEUE_WEIGHT_ANONYMOUS		1
+#define QUEUE_CHECKS				64
+
+#define RATE_SCALE					1000
+#define RATE_SOURCES				4096
+#define RATE_PROBE					8
+#define RATE_STRIPES				64
+#define RATE_SOURCE_FACTOR			4
+#define RATE_GAME_PER_SEC			40
+#define RATE_GAME_BURST				80
+#define RATE_LEAD_PER_SEC			8
+#define RATE_LEAD_BURST				16
+#define RATE_LOGIN_PER_SEC			1
+#define RATE_LOGIN_BURST			5
+
+#define RESULT_RING_LEN				256
+#define RESULT_PLAYED				0
+#define RESULT_WON					1
+#define RESULT_LOST					2
+#define RESULT_NO_WORKER			NUM_THREADS
+
+#define COROUTINE_STACK				(128 * 1024)
+#define COROUTINE_READY				0
+#define COROUTINE_WAITING			1
+#define COROUTINE_PARKED			2
+#define COROUTINE_DONE				3
+
+#define URING_ENTRIES				64
+#define URING_BUFFERS				8
+#define URING_BUFFER_GROUP			0
+#define URING_FRAMES				16
+#define URING_NO_BUFFER				0xffff
+#define URING_RECV					0
+#define URING_ACCEPT				1
+#define URING_WRITABLE				2
+#define URING_LOGIN					3
+#define URING_DOORBELL				4
+#define URING_OPS					5
+#define URING_CANCEL				URING_OPS
+#define URING_IDLE					0
+#define URING_ARMED					1
+#define URING_CANCELLING			2
+
+#define UPGRADE_VERSION				1
+#define UPGRADE_RECORD_LEN			256
+#define UPGRADE_POLL				250
+#define UPGRADE_ACK_WAIT			10
+#define UPGRADE_LISTENER			0
+#define UPGRADE_QUEUED				1
+#define UPGRADE_ACTIVE				2
+#define UPGRADE_DETACHED			3
+#define UPGRADE_DONE				4
+
+#define CLUSTER_MAX					16
+#define CLUSTER_REPORT				100
+#define CLUSTER_CLIENT				0
+#define CLUSTER_LOAD				1
+#define CLUSTER_RESULT				2
+#define CLUSTER_CLAIM				3
+#define CLUSTER_RELEASE				4
+#define CLUSTER_HELD				64
+
+#define CHANNEL_STREAK				16
+
+#define RATING_CENTRE				1500.0
+#define RATING_SCALE				173.7178
+#define RATING_EPSILON				0.000001
+#define RATING_ITERATIONS			64
+#define RATING_THREADS_MAX			64
+#define RATING_PARALLEL_MIN			4096
 
 
 // macros
@@ -70,24 +248,18 @@
 		printf("\n------------ End Message ------------\n");\
 		UNLOCK;\
 	}
-#   define DEBUG_QUEUE() \
+#   define DEBUG_QUEUE(queue) \
 	{\
 		LOCK;\
 		printf("[DEBUG]    Socket Queue\n");\
 		printf("------------ Begin ------------\n");\
-		printf("batch idx   - %u\n", queue.batch_idx);\
-		printf("idx         - %u\n", queue.idx);\
-		printf("clients:    ");\
-		for (u16 i = 0; i <= queue.batch_idx; i++)\
+		printf("length      - %u\n", queue.length);\
+		for (u8 c = 0; c < QUEUE_CLASSES; c++)\
 		{\
-			if (i != 0) { printf("            "); }\
-			printf("[%d] :: [", i);\
-			for (u16 j = 0; j < QUEUE_CLIENT_BUFFER_LEN; j++)\
+			printf("class %u     - [", c);\
+			for (i32 s = queue.classes[c].head; s != DEFAULT_SOCKET; s = queue_nodes[s].next)\
 			{\
-				if (queue.client_batch[i][j] == DEFAULT_SOCKET)\
-					printf("-,");\
-				else\
-					printf("%d,", queue.client_batch[i][j]);\
+				printf("%d,", s);\
 			}\
 			printf("]\n");\
 		}\
@@ -97,7 +269,7 @@
 #else
 #	define DEBUG(...)
 #   define DEBUG_MESSAGE(x, bytes, msg)		
-#   define DEBUG_QUEUE()
+#   define DEBUG_QUEUE(queue)
 #endif	
 
 
@@ -105,156 +277,996 @@
 // structs
 typedef struct
 {
-	u8  usernames[DEFAULT_NUM_ACCOUNTS][DEFAULT_NAME_LENGTH];
-	i64 seconds[DEFAULT_NUM_ACCOUNTS];
-	i64 nano[DEFAULT_NUM_ACCOUNTS];
-	u32 won[DEFAULT_NUM_ACCOUNTS];
-	u32 played[DEFAULT_NUM_ACCOUNTS];
-	u16 index;
+	f64 rating;
+	f64 deviation;
+	f64 volatility;
+} Rating;
+
+typedef struct
+{
+	Rating player;
+	f64    tau;
+	f64    board_base;
+	f64    board_density;
+	f64    board_size;
+	f64    board_deviation;
+} RatingParams;
+
+typedef struct
+{
+	u32 id;
+	u8  score;
+} GameRecord;
+
+typedef struct
+{
+	u8*          scores;
+	u32*         offsets;
+	Rating*      ratings;
+	u32          first;
+	u32          last;
+	Rating       board;
+	RatingParams params;
+} RatingJob;
+
+typedef struct
+{
+	u32 left;
+	u32 right;
+	u32 size;
+} RankNode;
+
+typedef struct
+{
+	u8       username[DEFAULT_NAME_LENGTH];
+	i64      seconds;
+	i64      nano;
+	u32      won;
+	u32      played;
+	u32      priority;
+	Rating   rating;
+} LeaderboardEntry;
+
+typedef struct
+{
+	LeaderboardEntry* entries;
+	RankNode*         nodes;
+	u32               count;
+	u32               capacity;
+	u32*              lookup;
+	u32               lookup_capacity;
+	u32               roots[LEADERBOARD_SORT_KEYS];
+	u32               dirty_first[LEADERBOARD_SORT_KEYS];
+	u32               dirty_last[LEADERBOARD_SORT_KEYS];
+	u32               seed;
 } Leaderboard;
 
 typedef struct
 {
-	u8 usernames[DEFAULT_NUM_ACCOUNTS][DEFAULT_NAME_LENGTH];
-	u8 passwords[DEFAULT_NUM_ACCOUNTS][DEFAULT_NAME_LENGTH];
-	u8 in_use[DEFAULT_NUM_ACCOUNTS];
+	Leaderboard  board;
+	Leaderboard* buckets;
+	u16          bucket_count;
+	i64          bucket_width;
+	i64          epoch;
+} LeaderboardWindow;
+
+typedef struct
+{
+	u64               mode;
+	pthread_mutex_t   lock;
+	u32               refs;
+	u64               last_used;
+	u8                indexed;
+	LeaderboardWindow windows[LEADERBOARD_WINDOWS];
+	GameRecord*       history;
+	u32               history_count;
+	u32               history_capacity;
+} LeaderboardSet;
+
+typedef struct
+{
+	LeaderboardSet** sets;
+	u32              count;
+	u32              capacity;
+	u64              clock;
+} LeaderboardRegistry;
+
+typedef struct
+{
+	i32 socket;
+	u8  key;
+	u8  window;
+	u64 mode;
+	u32 first;
+	u32 count;
+} Subscription;
+
+typedef struct
+{
+	Subscription* list;
+	u32           count;
+	u32           capacity;
+} SubscriptionTable;
+
+typedef struct
+{
+	u8  username[DEFAULT_NAME_LENGTH];
+	u32 secret;
+	u32 owner;
+	u32 hash;
+	u8  premium;
+} AuthAccount;
+
+typedef struct
+{
+	AuthAccount* accounts;
+	u32          count;
+	u32*         lookup;
+	u32          lookup_capacity;
+	u8*          secrets;
 } AuthDatabase;
 
 typedef struct
 {
-	u16   idx;
-	u8    batch_idx;
-	i32*  client_batch[QUEUE_BUFFERS];
+	u8*          start;
+	u8*          end;
+	AuthAccount* accounts;
+	u32          count;
+	u8*          secrets;
+	u32          secrets_length;
+} AuthChunk;
+
+typedef struct
+{
+	u8  username[DEFAULT_NAME_LENGTH];
+	u8  password[DEFAULT_NAME_LENGTH];
+	i32 owner;
+	u32 source;
+	i32 event;
+	u32 id;
+	u8  status;
+} AuthJob;
+
+typedef struct
+{
+	AuthJob* jobs[AUTH_QUEUE_MAX];
+	u32      head;
+	u32      count;
+	u32      sources[AUTH_QUEUE_MAX + AUTH_VERIFIERS_MAX];
+	u32      pending[AUTH_QUEUE_MAX + AUTH_VERIFIERS_MAX];
+} AuthQueue;
+
+typedef struct
+{
+	u32 idle;
+	u32 game;
+	u32 grace;
+} HeartbeatParams;
+
+typedef struct
+{
+	u32 min;
+	u32 max;
+	u32 depth;
+	u32 wait;
+	u32 cooldown;
+} PoolParams;
+
+typedef struct
+{
+	u32 depth;
+	u32 wait;
+	u32 retry;
+	u32 jitter;
+} AdmissionParams;
+
+typedef struct
+{
+	u32 per_second;
+	u32 burst;
+} RateLimit;
+
+typedef struct
+{
+	u64 tokens;
+	u64 stamp;
+} RateBucket;
+
+typedef struct
+{
+	u32        source;
+	u8         used;
+	RateBucket buckets[THROTTLE_CLASSES];
+} RateSource;
+
+typedef struct
+{
+	void* next;
+	u32   size;
+} ArenaBlock;
+
+typedef struct
+{
+	u8*         memory;
+	u32         used;
+	u32         capacity;
+	ArenaBlock* overflow;
+} SessionArena;
+
+typedef struct
+{
+	u64             game_mode;
+	u8              in_game;
+	u8              mines_left;
+	u8*             mine_locations;
+	u8*             game_map;
+	struct timespec started;
+	RateBucket      rate;
+	u16             id;
+	u8              mines[NUM_MINES];
+	u8              map[BOARD_PACKED_LEN(NUM_TILES)];
+} Stream;
+
+typedef struct
+{
+	i32             socket;
+	u8              username[DEFAULT_NAME_LENGTH];
+	u8              token[SESSION_TOKEN_LEN];
+	u8              auth_status;
+	u32             authentication_id;
+	u8              login_pending;
+	AuthJob         login_job;
+	u32             source;
+	RateBucket      rate[THROTTLE_CLASSES];
+	u8              msg[DEFAULT_MSG_LEN];
+	u64             game_mode;
+	u8              in_game;
+	u8              mines_left;
+	u8*             mine_locations;
+	u8*             game_map;
+	struct timespec started;
+	struct timespec expires;
+	Stream**        streams;
+	Stream*         stream;
+	void*           next;
+	SessionArena    arena;
+	u8              arena_memory[SESSION_ARENA_LEN];
+} Session;
+
+typedef struct
+{
+	Session* free;
+	u32      chunks;
+	u32      in_use;
+	u64      allocations;
+	u64      hits;
+	u64      arena_resets;
+	u64      arena_overflows;
+	u64      overflow_bytes;
+} SessionSlab;
+
+typedef struct
+{
+	ChannelMemory* memory;
+	u32            up_head;
+	u32            down_tail;
+	i32            server_bell;
+	i32            client_bell;
+	u8             streak;
+} Channel;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	Channel*        channel;
+	u8*             frames;
+	u16             head;
+	u16             count;
+	u16             sent;
+	u16             coalesce[OUTBOX_CLASSES];
+	u8              over;
+	u8              evicted;
+	struct timespec over_since;
+} Outbox;
+
+typedef struct
+{
+	u64 frames;
+	u64 queued;
+	u64 coalesced;
+	u64 flushed;
+	u64 watermarks;
+	u64 evictions;
+	u32 peak;
+} OutboxStats;
+
+typedef struct
+{
+	i32 prev;
+	i32 next;
+	u32 ticket;
+	u8  class;
+	u8  queued;
+	u8  checked;
+	u16 check;
+} QueueNode;
+
+typedef struct
+{
+	AuthJob job;
+	i32     socket;
+	u8      busy;
+} QueueCheck;
+
+typedef struct
+{
+	i32 head;
+	i32 tail;
+	u32 length;
+	u32 ticket;
+	i32 credit;
+} QueueClass;
+
+typedef struct
+{
+	QueueClass      classes[QUEUE_CLASSES];
+	u32             length;
+	u64             popped;
+	u64             drained;
+	u32             throughput;
+	u8              backlogged;
+	struct timespec ticked;
 } SocketQueue;
 
+typedef struct
+{
+	SocketQueue     queue;
+	pthread_mutex_t lock;
+	i32             core;
+	u32             workers;
+	u32             busy;
+	u64             accepted;
+} Shard;
+
+typedef struct
+{
+	u64             mode;
+	u8              username[DEFAULT_NAME_LENGTH];
+	u8              kind;
+	u8              rated;
+	struct timespec dt;
+} GameResult;
+
+typedef struct
+{
+	u32        head __attribute__((aligned(64)));
+	u32        tail __attribute__((aligned(64)));
+	GameResult results[RESULT_RING_LEN];
+} ResultRing;
+
+typedef struct
+{
+	i32 result;
+	u16 buffer;
+} UringFrame;
+
+typedef struct
+{
+	u8         armed[URING_OPS];
+	u32        ready[URING_OPS];
+	UringFrame frames[URING_FRAMES];
+	u8         frame_head;
+	u8         frame_count;
+} UringSlot;
+
+typedef struct
+{
+	i32                       fd;
+	u8*                       sq_ring;
+	u32                       sq_ring_len;
+	u8*                       cq_ring;
+	u32                       cq_ring_len;
+	u32                       sq_entries;
+	u32*                      sq_head;
+	u32*                      sq_tail;
+	u32                       sq_mask;
+	u32*                      sq_array;
+	struct io_uring_sqe*      sqes;
+	u32                       to_submit;
+	u32*                      cq_head;
+	u32*                      cq_tail;
+	u32                       cq_mask;
+	struct io_uring_cqe*      cqes;
+	UringSlot*                slots;
+	u16                       slot_count;
+	struct io_uring_buf_ring* buffers;
+	u8*                       buffer_memory;
+	u32                       buffer_count;
+	u16                       buffer_tail;
+} Uring;
+
+typedef struct
+{
+	ucontext_t      context;
+	u8*             stack;
+	u16             slot;
+	u8              state;
+	struct pollfd*  fds;
+	u8              nfds;
+	i32             ready;
+	u8              timed;
+	struct timespec deadline;
+} Coroutine;
+
+typedef struct
+{
+	ucontext_t context;
+	Coroutine* current;
+	Uring*     ring;
+	Coroutine  coroutines[SESSION_COROUTINES];
+} Scheduler;
+
+typedef struct
+{
+	i32   channel;
+	pid_t pid;
+	u32   room;
+	u64   sent;
+	u64   received;
+} Backend;
+
+typedef struct
+{
+	u8 answered;
+	u8 granted;
+} ClusterClaim;
+
+typedef struct
+{
+	i32             socket;
+	u8              timer;
+	u32             sequence;
+	struct timespec start;
+} __attribute__((aligned(64))) SlotControl;
+
 
 // function prototypes
 void  exit_handle();
-void* client_message_handler(void* void_thread_idx);
+void* worker_scheduler(void* void_thread_idx);
+void  client_message_handler(i32 slot);
 void* idle_polling_handler();
 void* time_polling_handler();
+void* leaderboard_push_handler();
+void* leaderboard_rotate_handler();
+void* rating_handler();
+void* rating_replay_handler(void* void_job);
+void  rating_signal();
+
+void* auth_watch_handler();
+void* upgrade_handler();
+void* leaderboard_merge_handler();
+void* pool_handler();
+void* auth_parse_handler(void* void_chunk);
+void* auth_verify_handler();
 
 void auth_init();
-u32  auth_check();
-
-void leaderboard_init();
-
-void queue_init();
-void queue_push(i32 socket);
-void queue_push(i32 socket);
-i32  queue_pop();
+void auth_start();
+void auth_reload();
+u32  auth_find(AuthDatabase* db, u8* username, u32 hash);
+u8   auth_compare(u8* a, u8* b, u32 length);
+u8   auth_claim(u32 id, i32 owner);
+u32  auth_lookup(u8* username);
+u8   auth_premium(u8* username);
+u8   auth_check(u8* username, u8* password, i32 owner, u32* id);
+void auth_submit(AuthJob* job);
+u32  auth_source(i32 socket);
+void auth_hash(u8* password);
+void auth_release(u32 id, i32 owner, u8* username);
+i32* auth_owner(u32 id);
+AuthDatabase* auth_load(AuthDatabase* old);
+void auth_free(AuthDatabase* db);
+
+u32  hash_name(u8* name);
+i32  name_compare(u8* a, u8* b);
+
+void leaderboard_init(Leaderboard* lb);
+void leaderboard_free(Leaderboard* lb);
+u32  leaderboard_find(Leaderboard* lb, u8* username);
+u32  leaderboard_played(Leaderboard* lb, u8* username);
+u32  leaderboard_won(Leaderboard* lb, u8* username, struct timespec dt);
+u32  leaderboard_collect(Leaderboard* lb, u8 key, u32 first, u32 count, u32* ids);
+u32  leaderboard_size(Leaderboard* lb, u8 key);
+u8   leaderboard_query(Leaderboard* lb, u8* request, u8* username, u8 frames[][DEFAULT_MSG_LEN]);
+void leaderboard_touch(Leaderboard* lb, u8 key, u32 first, u32 last);
+void leaderboard_set(Leaderboard* lb, u32 id, i64 seconds, i64 nano, u32 won, u32 played);
+u8   leaderboard_expand(Leaderboard* lb);
+void leaderboard_compact(Leaderboard* lb);
+
+void window_init(LeaderboardWindow* window, u16 bucket_count, i64 bucket_width);
+void window_played(LeaderboardWindow* window, u8* username);
+void window_won(LeaderboardWindow* window, u8* username, struct timespec dt);
+void window_free(LeaderboardWindow* window);
+void window_rotate(LeaderboardWindow* window, pthread_mutex_t* lock);
+
+void registry_init();
+LeaderboardSet*  registry_acquire(u64 mode, u8 create);
+LeaderboardSet** registry_collect(u32* count);
+void registry_release(LeaderboardSet* set);
+void registry_expand(LeaderboardSet* set);
+void registry_trim();
+Leaderboard* registry_board(LeaderboardSet* set, u8 window);
+
+void   rating_load();
+Rating rating_initial();
+void   rating_board(u64 mode, RatingParams* params, Rating* board);
+void   rating_update(Rating* player, Rating* board, f64 score, RatingParams* params);
+void   rating_result(LeaderboardSet* set, u8* username, u8 score);
+void   rating_spread(LeaderboardSet* set, u8* username);
+u64    rating_recompute(LeaderboardSet* set, RatingParams* params, u32 threads);
+void   leaderboard_rate(Leaderboard* lb, u32 id, Rating rating);
+
+Session* session_new(i32 socket);
+void     session_free(Session* session);
+void     session_game(Session* session);
+u8       session_token(u8* token);
+void     session_detach(Session* session);
+Session* session_resume(u8* token, i32 socket);
+u8       session_known(u8* token);
+u32      session_find(u8* token);
+u8       session_take(u32 id, i32 marker, i32 owner);
+void     session_expire();
+void     session_drop(Session* session);
+void     session_metrics();
+Session* session_adopt();
+u32      session_serialize(Session* session, u8* record);
+u32      session_deserialize(Session* session, u8* record);
+void     metrics_signal();
+void*    arena_alloc(SessionArena* arena, u32 size);
+void     arena_reset(SessionArena* arena);
+
+Stream*  stream_open(Session* session, u16 id);
+Stream*  stream_find(Session* session, u16 id);
+void     stream_enter(Session* session, Stream* stream);
+void     stream_leave(Session* session);
+void     stream_swap(Session* session, Stream* stream);
+i32      stream_send(i32 socket, u16 id, u8* frame);
+i32      session_send(Session* session, i32 socket, u8* frame);
+void     stream_free(Session* session);
+void     stream_metrics();
+
+void subscription_set(i32 socket, u8 key, u8 window, u64 mode, u32 first, u32 count);
+void subscription_remove(i32 socket);
+u8   subscription_find(i32 socket, Subscription* found);
+
+void heartbeat_load();
+void heartbeat_arm(struct timespec* due, u32 seconds);
+i32  heartbeat_left(struct timespec* due);
+
+void pool_load();
+u8   pool_spawn();
+void pool_retire(u16 worker);
+void pool_served(struct timespec* since);
+void pool_metrics();
+
+void control_publish(SlotControl* control, struct timespec* start, u8 timer);
+void control_read(SlotControl* control, struct timespec* start);
+void control_timer(SlotControl* control, u8 timer);
+
+u8   rate_class(u8 header);
+u16  rate_check(Session* session, u8 class);
+u16  rate_take(RateBucket* bucket, u8 class, u32 factor, u64 now);
+u64  rate_now();
+void rate_metrics();
+
+void outbox_init();
+void outbox_reset(i32 socket);
+i32  outbox_send(i32 socket, u8* frame, u8 kind);
+i32  outbox_flush(i32 socket);
+i32  outbox_write(Outbox* box, i32 socket);
+i32  outbox_transmit(Outbox* box, i32 socket, u8* data, u32 length);
+u8   outbox_level(Outbox* box, i32 socket);
+void outbox_evict(Outbox* box, i32 socket);
+u16  outbox_pending(i32 socket);
+u8   outbox_drain(i32 socket, struct timespec* deadline);
+void outbox_metrics();
+
+i32      local_listen(u8* path);
+Channel* channel_open(i32 socket);
+void     channel_close(i32 socket, Channel* channel);
+void     channel_metrics();
+
+i32  upgrade_receive();
+void upgrade_park(Session* session);
+i32  upgrade_send(i32 channel, u8* record, i32 fd);
+i32  upgrade_recv(i32 channel, u8* record, i32* fd);
+
+u8   cluster_start(u8 size);
+void cluster_gateway();
+void cluster_dispatch();
+void cluster_backend();
+void cluster_report();
+u8   cluster_claim(u32 id, i32 owner, u8* username);
+void cluster_release(u8* username);
+void cluster_pack(u8* record, GameResult* result);
+void cluster_unpack(u8* record, GameResult* result);
+void cluster_metrics();
+void cluster_exit();
+
+void queue_init(Shard* shard);
+void queue_load();
+u8   queue_push(Shard* shard, i32 socket, u8 class);
+void queue_requeue(Shard* shard, i32 socket);
+i32  queue_pop(Shard* shard);
+void queue_link(Shard* shard, i32 socket, u8 class, u8 front);
+void queue_unlink(Shard* shard, i32 socket);
+u8   queue_class(i32 socket);
+u8   queue_classify(i32 socket);
+u8   queue_check(i32 socket);
+void queue_check_sweep();
+u32  queue_position(Shard* shard, i32 socket);
+u32  queue_estimate(Shard* shard, i32 socket, u32 position);
+void queue_tick(Shard* shard);
+u64  queue_length(Shard* shard);
+void queue_metrics();
+
+void admission_load();
+u8   admission_admit(Shard* shard, i32 socket);
+u8   admission_check(u8 class);
+void admission_reject(i32 socket, u8 reason);
+void admission_metrics();
+
+void   shard_init(u8 sharded);
+Shard* shard_assign();
+void   shard_metrics();
+void   result_record(u16 worker, u8 kind, Session* session, struct timespec dt);
+void   result_apply(LeaderboardSet* set, GameResult* result);
+
+u8   uring_init(Uring* ring, u16 slot_count, u8 buffered);
+struct io_uring_sqe* uring_sqe(Uring* ring);
+void uring_arm(Uring* ring, u16 slot, u8 op, i32 fd, u32 events);
+void uring_cancel(Uring* ring, u16 slot, u8 op);
+void uring_enter(Uring* ring, i32 timeout);
+void uring_recycle(Uring* ring, u16 buffer);
+u8   uring_prepare(Uring* ring, u16 slot, struct pollfd* fds, u8 count);
+i32  uring_collect(Uring* ring, u16 slot, struct pollfd* fds, u8 count);
+i32  uring_accept(Uring* ring, i32* listeners, u8 count, i32 timeout);
+i32  uring_next(Uring* ring, u16 slot, u8* msg, u32 length);
+u8   uring_busy(Uring* ring, u16 slot);
+void uring_release(Uring* ring, u16 slot);
+void uring_metrics();
+void uring_free(Uring* ring);
+
+i32  coroutine_poll(struct pollfd* fds, u8 nfds, i32 timeout);
+void coroutine_park();
+void coroutine_exit();
+void scheduler_wait(Scheduler* self);
+
+u8   board_get(u8* board, u16 tile);
+void board_set(u8* board, u16 tile, u8 value);
+void board_pack(u8* board, u8* tiles, u16 count);
+void board_unpack(u8* board, u8* tiles, u16 count);
 
 u8 reveal_map(u8* map, u8* mine_locations, u8 game_cursor);
 
 
 // globals
-SocketQueue 	queue;
-AuthDatabase	database;
-Leaderboard		leaderboard;
+Shard			shards[NUM_THREADS];
+u8				shard_count;
+ResultRing		result_rings[NUM_THREADS];
+i32				result_event = DEFAULT_SOCKET;
+AuthDatabase*	database;
+i32*			auth_owners[AUTH_OWNER_CHUNKS];
+u32				auth_owner_count;
+u32				auth_generation;
+u32				auth_readers[2];
+LeaderboardRegistry registry;
+SubscriptionTable subscriptions;
+Session*		sessions[SESSION_DETACHED_MAX];
+SessionSlab		slab;
+HeartbeatParams	heartbeat_params;
+u64				heartbeat_pings;
+u64				heartbeat_reaps;
+PoolParams		pool_params;
+u32				pool_size;
+u32				pool_slots;
+u64				pool_spawns;
+u64				pool_retirements;
+u64				pool_service;
+u64				pool_wait;
+AdmissionParams	admission_params;
+QueueNode		queue_nodes[QUEUE_SOCKETS];
+QueueCheck		queue_checks[QUEUE_CHECKS];
+u32				queue_weights[QUEUE_CLASSES];
+u64				queue_served[QUEUE_CLASSES];
+u64				stream_opened;
+u64				stream_frames;
+u64				admission_admitted;
+u64				admission_rejects[REJECT_REASONS];
+u32				admission_seed;
+u8				pool_running[NUM_THREADS];
+u8				pool_retiring[NUM_THREADS];
+u32				pool_busy[NUM_THREADS];
+u16				pool_indices[NUM_THREADS];
+u8				uring_backend;
+u64				uring_completions;
+u64				uring_stalls;
+RateSource		rate_sources[RATE_SOURCES];
+u64				rate_throttled[THROTTLE_CLASSES];
+RateLimit		rate_limits[THROTTLE_CLASSES] =
+{
+	{ RATE_GAME_PER_SEC,  RATE_GAME_BURST  },
+	{ RATE_LEAD_PER_SEC,  RATE_LEAD_BURST  },
+	{ RATE_LOGIN_PER_SEC, RATE_LOGIN_BURST },
+};
+Outbox			outboxes[OUTBOX_SOCKETS];
+OutboxStats		outbox_stats;
+volatile u8		metrics_requested;
+volatile u8		upgrading;
+u32				upgrade_parked;
+u8				upgrade_inherited;
+u8				upgrade_bound;
+Session*		upgrade_sessions[NUM_SLOTS];
+u32				upgrade_session_count;
+Session*		adopted[NUM_SLOTS];
+u32				adopted_count;
+Backend			backends[CLUSTER_MAX];
+u8				cluster_size;
+u8				cluster_index;
+i32				cluster_channel = DEFAULT_SOCKET;
+u64				cluster_received;
+u64				cluster_ordered;
 i32 			listen_sock;
-i32 			thread_actives[NUM_THREADS];
-u8				thread_timers[NUM_THREADS];
-struct timespec t0[NUM_THREADS];
-struct timespec t1[NUM_THREADS];
+i32				local_sock = DEFAULT_SOCKET;
+u8*				local_path = (u8*) LOCAL_SOCKET;
+u32				channel_count;
+u64				channel_opens;
+u64				channel_refusals;
+SlotControl		slot_controls[NUM_SLOTS];
+u64				timer_slots[NUM_SLOTS / 64];
+u32				time_round;
+u8				time_parked;
+__thread Scheduler* scheduler;
 pthread_t		idle_manager;
+pthread_t		auth_manager;
+pthread_t		upgrade_manager;
+pthread_t		merge_manager;
+pthread_t		auth_verifiers[AUTH_VERIFIERS_MAX];
+u32				auth_verifier_count;
+AuthQueue		auth_queue;
 pthread_t		time_manager;
+pthread_t		push_manager;
+pthread_t		rotate_manager;
+pthread_t		rating_manager;
+RatingParams	rating_params;
+sem_t			rating_semaphore;
 pthread_t 		pool[NUM_THREADS];
+pthread_t		pool_manager;
 
-pthread_mutex_t queue_mutex        = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t auth_mutex         = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t print_mutex        = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t time_mutex         = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t leaderboard_mutex  = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t registry_mutex     = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t auth_queue_mutex   = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  auth_queue_cond    = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t rating_mutex       = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t random_mutex	   = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t subscription_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t session_mutex      = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t slab_mutex         = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t upgrade_mutex      = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t pool_mutex         = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cluster_mutex      = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t cluster_reply_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cluster_reply_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t rate_mutexes[RATE_STRIPES];
 
 
 i32 main(i32 argc, u8** argv)
 {
-	// handle signal and parse cli
+	// handle signal and parse cli, the semaphore is ready before a SIGHUP can post to it
+	sem_init(&rating_semaphore, 0, 0);
 	signal(SIGINT, exit_handle);
-	u32 listen_port;
-	if (argc < 2)
-	{
-		listen_port = DEFAUL_PORT;
-	}
-	else
+	signal(SIGHUP, rating_signal);
+	signal(SIGUSR1, metrics_signal);
+	u32 listen_port = DEFAUL_PORT;
+	u8  upgrade     = 0;
+	u8  sharded     = 0;
+	Uring acceptor;
+	for (i32 i = 1; i < argc; i++)
 	{
-		i32 desired_port = atoi(argv[1]);
-		if (desired_port < 0)
+		if (!strcmp((char*) argv[i], "--hash") && i + 1 < argc)
+		{
+			// print a salted hash to paste into the accounts file
+			auth_hash(argv[i + 1]);
+			return 0;
+		}
+		else if (!strcmp((char*) argv[i], "--upgrade")) { upgrade = 1; }
+		else if (!strcmp((char*) argv[i], "--shards"))  { sharded = 1; }
+		else if (!strcmp((char*) argv[i], "--uring"))   { uring_backend = 1; }
+		else if (!strcmp((char*) argv[i], "--local") && i + 1 < argc)
+		{
+			// where clients on this host find the unix socket
+			local_path = argv[++i];
+		}
+		else if (!strcmp((char*) argv[i], "--cluster") && i + 1 < argc)
 		{
-			listen_port = (desired_port * -1);
+			// a gateway in front of this many backend processes
+			i32 size = atoi((char*) argv[++i]);
+			cluster_size = size < 1 ? 1 : size > CLUSTER_MAX ? CLUSTER_MAX : size;
 		}
 		else
 		{
-			listen_port = desired_port;
+			i32 desired_port = atoi(argv[i]);
+			if (desired_port < 0)
+			{
+				listen_port = (desired_port * -1);
+			}
+			else
+			{
+				listen_port = desired_port;
+			}
 		}
 	}
 
+	// every session holds a login event besides its client, so take all the descriptors allowed
+	struct rlimit descriptors;
+	if (!getrlimit(RLIMIT_NOFILE, &descriptors))
+	{
+		descriptors.rlim_cur = descriptors.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &descriptors);
+	}
+
 	// load auth database
     auth_init();
 
-	// load leaderboard
-	leaderboard_init();
+	// load rating parameters and leaderboards, other modes are created as they are played
+	rating_load();
+	registry_init();
+	heartbeat_load();
+	pool_load();
+	admission_load();
+	queue_load();
+
+	// setup listener, an upgrade takes over the running server's along with its clients
+	shard_init(sharded);
+	outbox_init();
+	for (u8 i = 0; i < RATE_STRIPES; i++)
+	{
+		pthread_mutex_init(&rate_mutexes[i], 0);
+	}
+	if (upgrade)
+	{
+		listen_sock = upgrade_receive();
+		if (listen_sock == DEFAULT_SOCKET)
+		{
+			ERROR("Upgrade hand-off failed.\n");
+		}
+		upgrade_inherited = 1;
+	}
+	else
+	{
+		struct sockaddr_in local_addr;
+		local_addr.sin_family 			= AF_INET;
+		local_addr.sin_port 			= htons(listen_port);
+		local_addr.sin_addr.s_addr	 	= INADDR_ANY;
+
+		listen_sock = 0;
+		listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listen_sock == -1)
+		{
+			ERROR("Listener could not be created.\n");
+		}
+
+		i32 ret_val;
+		ret_val = bind(listen_sock, (struct sockaddr*)&local_addr, sizeof(local_addr));
+		if (ret_val == -1)
+		{
+			ERROR("Listener could not be bound.\n");
+		}
 
-	// setup listener
-	struct sockaddr_in local_addr;
-	local_addr.sin_family 			= AF_INET;
-	local_addr.sin_port 			= htons(listen_port);
-	local_addr.sin_addr.s_addr	 	= INADDR_ANY;
+		ret_val = listen(listen_sock, NUM_CONNECTIONS_PER_SOCK);
+		if (ret_val == -1)
+		{
+			ERROR("Listener could not start listening.\n");
+		}
 
-	listen_sock = 0;
-	listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (listen_sock == -1)
-	{
-		ERROR("Listener could not be created.\n");
+		LOG("Listening on port %u\n", listen_port);
 	}
 
-	i32 ret_val;
-	ret_val = bind(listen_sock, (struct sockaddr*)&local_addr, sizeof(local_addr));
-	if (ret_val == -1)
+	// clients on this host can skip TCP, an upgrade may already have handed this one over
+	if (local_sock == DEFAULT_SOCKET)
 	{
-		ERROR("Listener could not be bound.\n");
+		local_sock = local_listen(local_path);
 	}
 
-	ret_val = listen(listen_sock, NUM_CONNECTIONS_PER_SOCK);
-	if (ret_val == -1)
+	// a gateway forks its backends here and from then on only places connections
+	if (cluster_size && upgrade)
+	{
+		WARN("A cluster can't be upgraded in place, starting a single server\n");
+		cluster_size = 0;
+	}
+	if (cluster_size && !cluster_start(cluster_size))
 	{
-		ERROR("Listener could not start listening.\n");
+		cluster_exit();
 	}
 
-	LOG("Listening on port %u\n", listen_port);
+	// io_uring is opt in, without it or where the kernel refuses it everything goes through poll
+	if (uring_backend && !uring_init(&acceptor, 2, 0))
+	{
+		WARN("io_uring unavailable, falling back to poll\n");
+		uring_backend = 0;
+	}
 
-	// init queue and threads
-	queue_init(&queue);
+	// init threads
 	pthread_create(&idle_manager, 0, idle_polling_handler, 0);
+	pthread_create(&auth_manager, 0, auth_watch_handler, 0);
+	if (cluster_channel == DEFAULT_SOCKET)
+	{
+		pthread_create(&upgrade_manager, 0, upgrade_handler, 0);
+	}
+	if (sharded)
+	{
+		pthread_create(&merge_manager, 0, leaderboard_merge_handler, 0);
+	}
+	auth_start();
 	pthread_create(&time_manager, 0, time_polling_handler, 0);
-	u16 thread_indices[NUM_THREADS];
-	for (u8 i = 0; i < NUM_THREADS; i++)
+	pthread_create(&push_manager, 0, leaderboard_push_handler, 0);
+	pthread_create(&rotate_manager, 0, leaderboard_rotate_handler, 0);
+	pthread_create(&rating_manager, 0, rating_handler, 0);
+
+	// the pool starts at its minimum, the manager grows and shrinks it from there
+	for (u32 i = 0; i < pool_params.min; i++)
 	{
-		thread_indices[i] = i;
-		pthread_create(&pool[i], 0, client_message_handler, &thread_indices[i]);
-		LOG("Client thread created  (%u/%u)\n", i+1, NUM_THREADS);
+		pool_spawn();
 	}
+	pthread_create(&pool_manager, 0, pool_handler, 0);
 
-	// listener connection polling
+	// a backend is handed its connections by the gateway instead of accepting them
+	if (cluster_channel != DEFAULT_SOCKET)
+	{
+		cluster_backend();
+	}
+
+	// listener connection polling, TCP and the unix socket alike
 	i32 client_sock = 0;
+	i32 listeners[2] = { listen_sock, local_sock };
 	struct sockaddr_storage client_addr;
 	socklen_t client_addr_size = sizeof(client_addr);
 	while (1) 
 	{
-		client_sock = accept(listen_sock, (struct sockaddr *) &client_addr, &client_addr_size);
-		if (client_sock != -1)
+		// checked between accepts, so nothing is taken in once the hand-off starts
+		if (uring_backend)
+		{
+			// the armed accepts are withdrawn first, whatever they already took is still queued
+			if (upgrading && !uring_busy(&acceptor, 0) && !uring_busy(&acceptor, 1)) { upgrade_park(0); }
+			i32 ready = uring_accept(&acceptor, listeners, 2, UPGRADE_POLL);
+			if (ready < 0) { continue; }
+			client_sock = uring_next(&acceptor, ready, 0, 0);
+		}
+		else
+		{
+			struct pollfd listener[2] = { { listen_sock, POLLIN, 0 }, { local_sock, POLLIN, 0 } };
+			if (upgrading) { upgrade_park(0); }
+			if (poll(listener, 2, UPGRADE_POLL) <= 0 || upgrading) { continue; }
+			client_addr_size = sizeof(client_addr);
+			client_sock = accept(listener[0].revents ? listen_sock : local_sock, 
+				(struct sockaddr *) &client_addr, &client_addr_size);
+		}
+
+		if (client_sock >= 0)
 		{
 			LOG("Client connected: %d\n", client_sock);
-			queue_push(client_sock);
-			DEBUG_QUEUE();
+			outbox_reset(client_sock);
+			Shard* shard = shard_assign();
+			if (admission_admit(shard, client_sock))
+			{
+				DEBUG_QUEUE(shard->queue);
+			}
 		}
 		else
 		{
+			// out of descriptors the listener stays readable, so back off instead of spinning
 			WARN("Client connection attempted, but failed\n");
+			sleep(1);
 		}
-
-		sleep(1);
 	}
 
 	WARN("\nUNEXPECTED EXIT.\n");
@@ -262,152 +1274,448 @@ i32 main(i32 argc, u8** argv)
 }
 
 // thread handlers
-void* client_message_handler(void* void_thread_idx)
+void* worker_scheduler(void* void_thread_idx)
 {
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 	u16 thread_idx = *((u16*) void_thread_idx);
 	
-	thread_actives[thread_idx] = DEFAULT_SOCKET;
-	pthread_mutex_lock(&time_mutex);
-	thread_timers[thread_idx] = TIMER_OFF;
-	pthread_mutex_unlock(&time_mutex);
+	// a shard's workers stay on its core and only take its connections
+	Shard* shard = &shards[thread_idx % shard_count];
+	if (shard->core >= 0)
+	{
+		cpu_set_t cores;
+		CPU_ZERO(&cores);
+		CPU_SET(shard->core, &cores);
+		pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+	}
+
+	// the worker's sessions share one ring, a worker whose ring cannot be set up stays on poll
+	Uring worker_ring;
+	scheduler       = calloc(1, sizeof(Scheduler));
+	scheduler->ring = uring_backend && uring_init(&worker_ring, SESSION_COROUTINES, 1) ? &worker_ring : 0;
+
+	// every session runs on its own stack, pages are only backed once they are touched
+	for (u16 i = 0; i < SESSION_COROUTINES; i++)
+	{
+		Coroutine* co = &scheduler->coroutines[i];
+		co->slot  = thread_idx * SESSION_COROUTINES + i;
+		co->stack = mmap(0, COROUTINE_STACK, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (co->stack == MAP_FAILED)
+		{
+			ERROR("Coroutine stack could not be mapped.\n");
+		}
+
+		// an overflow faults on the guard page instead of running into the next stack
+		mprotect(co->stack, getpagesize(), PROT_NONE);
+		getcontext(&co->context);
+		co->context.uc_stack.ss_sp   = co->stack;
+		co->context.uc_stack.ss_size = COROUTINE_STACK;
+		co->context.uc_link          = 0;
+		makecontext(&co->context, (void (*)()) client_message_handler, 1, (i32) co->slot);
+		co->state = COROUTINE_READY;
+	}
+
+	while (1)
+	{
+		// each session runs until it waits again, then the worker waits for all of them at once
+		u16 done = 0;
+		for (u16 i = 0; i < SESSION_COROUTINES; i++)
+		{
+			Coroutine* co = &scheduler->coroutines[i];
+			if (co->state == COROUTINE_READY)
+			{
+				scheduler->current = co;
+				swapcontext(&scheduler->context, &co->context);
+			}
+			done += co->state == COROUTINE_DONE;
+		}
+		scheduler->current = 0;
+		if (done == SESSION_COROUTINES) { break; }
+		scheduler_wait(scheduler);
+	}
+
+	// retired, the index is free for the next worker once everything it held is given back
+	for (u16 i = 0; i < SESSION_COROUTINES; i++)
+	{
+		munmap(scheduler->coroutines[i].stack, COROUTINE_STACK);
+	}
+	if (scheduler->ring)
+	{
+		uring_free(scheduler->ring);
+	}
+	free(scheduler);
+	scheduler = 0;
+	LOG("Client thread retired  (%u)\n", thread_idx);
+	__atomic_store_n(&pool_retiring[thread_idx], 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&pool_running[thread_idx], 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void client_message_handler(i32 slot)
+{
+	// runs as one of its worker's coroutines, anything that would block yields to the others
+	u16    thread_idx = slot / SESSION_COROUTINES;
+	u16    ring_slot  = slot % SESSION_COROUTINES;
+	Uring* ring       = scheduler->ring;
+	Shard* shard      = &shards[thread_idx % shard_count];
+
+	// only this session writes its control block, the time thread just reads it
+	SlotControl* control = &slot_controls[slot];
+	__atomic_store_n(&control->socket, DEFAULT_SOCKET, __ATOMIC_RELAXED);
+	control_timer(control, TIMER_OFF);
+
+	// completions for parked logins, and when the client's heartbeat is due
+	i32 login_event = eventfd(0, EFD_NONBLOCK);
+	struct timespec heartbeat = {0};
 
 	while (1)
 	{
-		// various client state
+		// per connection scratch, everything that outlives a frame is in the session
 		i32 ret_val;
 		u8  set_index;
-		u8  auth_status						= AUTH_FAIL;
-		u16 authentication_id				= 0;
-		u8  password[DEFAULT_NAME_LENGTH] 	= {0};
-		u8  msg[DEFAULT_MSG_LEN]			= {0};
-		u8*	msg_pointer 					= msg;
-		#if DEBUG_MODE
-			u8 username[DEFAULT_NAME_LENGTH] = "default-player";
-		#else
-			u8 username[DEFAULT_NAME_LENGTH] = {0};
-		#endif
-
-		// game state
-		struct timespec dt;
+		u8  greeting[DEFAULT_MSG_LEN] = {0};
+		u8* msg_pointer;
+		u8  pinged = 0;
+		u8  reaped = 0;
+		Channel* channel = 0;
+		struct timespec dt = {0};
+		struct timespec served;
 		u8 _x, _y, _xy;
 		u8 target_cursor;
-		u8 mine_locations[NUM_MINES] = {0}; 
-		u8 mines_left                = NUM_MINES;
-		u8 game_map[NUM_TILES];
-		for(u8 i = 0; i < NUM_TILES; i++)
-		{
-			game_map[i] = GAME_UNKNOWN;
-		}
+		u8 tiles[NUM_TILES];
 
 		// default message is connected
 		for (u8 i = 0; i < LEN_TYPE_CON; i++)
 		{
-			msg[i] = MESSAGE_TYPE_CON[i];
+			greeting[i] = MESSAGE_TYPE_CON[i];
 		}
-		msg[LEN_TYPE_CON] = END_OF_TRANSMISSION;
+		greeting[LEN_TYPE_CON] = END_OF_TRANSMISSION;
 
-		// client aquisition
-		i32 client_sock = DEFAULT_SOCKET;
+		// client aquisition, sessions handed over by an upgrade go before the queue
+		i32 client_sock  = DEFAULT_SOCKET;
+		Session* session = 0;
 		while(client_sock == DEFAULT_SOCKET)
 		{
-			thread_actives[thread_idx] = queue_pop();
-			client_sock = thread_actives[thread_idx];
+			if (upgrading) { upgrade_park(0); }
+			if (__atomic_load_n(&pool_retiring[thread_idx], __ATOMIC_RELAXED))
+			{
+				// the worker is being retired, its idle sessions stop taking connections
+				close(login_event);
+				coroutine_exit();
+			}
+			session = session_adopt();
+			if (session)
+			{
+				client_sock = session->socket;
+				__atomic_store_n(&control->socket, client_sock, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&shard->busy, 1, __ATOMIC_RELAXED);
+				break;
+			}
+
+			client_sock = queue_pop(shard);
+			__atomic_store_n(&control->socket, client_sock, __ATOMIC_RELAXED);
 			if (client_sock != DEFAULT_SOCKET)
 			{
+
+				__atomic_add_fetch(&shard->busy, 1, __ATOMIC_RELAXED);
 				// tell client they are being served
-				ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+				ret_val = outbox_send(client_sock, greeting, OUTBOX_FRAME);
 				if (ret_val < 0) { break; }
 				else
 				{
-					DEBUG_MESSAGE(SENT, ret_val, msg);
-					for (u8 i = 0; i < LEN_TYPE_CON; i++) { msg[i] = 0; }
+					DEBUG_MESSAGE(SENT, ret_val, greeting);
 				}
 			}
 
-			sleep(1);
+			coroutine_poll(0, 0, 1000);
+		}
+
+		// the session belongs to the connection, not to this thread
+		if (session)
+		{
+			control_publish(control, &session->started, session->in_game ? TIMER_ON : TIMER_OFF);
+		}
+		else
+		{
+			session = session_new(client_sock);
 		}
+		msg_pointer = session->msg;
 
 		// client message handling
 		WORKER(thread_idx, "Client attached: %d\n", client_sock);
+		clock_gettime(CLOCK_MONOTONIC, &served);
+		__atomic_add_fetch(&pool_busy[thread_idx], 1, __ATOMIC_RELAXED);
+		heartbeat_arm(&heartbeat, session->in_game ? heartbeat_params.game : heartbeat_params.idle);
+		struct pollfd fds[3];
 		while (1)
 		{
-			ret_val = recv(client_sock, msg, DEFAULT_MSG_LEN, 0);
-			if (ret_val <= 0) { break; }
-			else
+			// a stream's game is only swapped in for the frame that came for it
+			stream_leave(session);
+
+			// wait on the client, any parked login and its channel, no longer than until the heartbeat is due
+			fds[0].fd      = client_sock;
+			fds[0].events  = POLLIN | (!channel && outbox_pending(client_sock) ? POLLOUT : 0);
+			fds[0].revents = 0;
+			fds[1].fd      = session->login_pending ? login_event : DEFAULT_SOCKET;
+			fds[1].events  = POLLIN;
+			fds[1].revents = 0;
+			fds[2].fd      = channel ? channel->server_bell : DEFAULT_SOCKET;
+			fds[2].events  = POLLIN;
+			fds[2].revents = 0;
+
+			// frames already on the channel are taken without a syscall, every so often the others get a turn
+			u8 queued = channel && !channel_sleep(&channel->memory->up, channel->up_head);
+			if (!queued || ++channel->streak == CHANNEL_STREAK)
 			{
-				DEBUG_MESSAGE(RECV, ret_val, msg);
+				if (channel) { channel->streak = 0; }
+				coroutine_poll(fds, channel ? 3 : session->login_pending ? 2 : 1, 
+					queued ? 0 : heartbeat_left(&heartbeat));
+			}
 
-				if (parse_header(&msg_pointer, MESSAGE_TYPE_LOGIN, LEN_TYPE_LOGIN))
+			// the rings can't be handed over, a session on a channel is detached and comes back with its token
+			if (upgrading && channel) { break; }
+
+			// an upgrade takes the session between frames, never with a login or received data in flight
+			if (upgrading && !session->login_pending && !(ring && uring_busy(ring, ring_slot)))
+			{
+				control_timer(control, TIMER_OFF);
+				upgrade_park(session);
+				control_publish(control, &session->started, session->in_game ? TIMER_ON : TIMER_OFF);
+			}
+
+			// a quiet client is asked whether it is still there, one that stays quiet is reaped
+			if (!heartbeat_left(&heartbeat))
+			{
+				if (pinged)
 				{
-					DEBUG("Login message detected.\n");
+					WORKER(thread_idx, "Reaping unresponsive client: %d\n", client_sock);
+					__atomic_add_fetch(&heartbeat_reaps, 1, __ATOMIC_RELAXED);
+					reaped = 1;
+					break;
+				}
 
-					// username
-					if(!parse_data(&msg_pointer, 
-						username, MESSAGE_DATA_USERNAME, LEN_DATA_USERNAME)) { break; }
-					DEBUG("Detected username: \"%s\"\n", username);
-					
-					// password
-					if(!parse_data(&msg_pointer, 
-						password, MESSAGE_DATA_PASSWORD, LEN_DATA_PASSWORD)) { break; }
-					DEBUG("Detected password: \"%s\"\n", password);
-
-					// check database
-					u32 auth_result    = auth_check(username, password);
-					auth_status        = (u8)  (auth_result >> 16);
-    				authentication_id  = (u16) (auth_result & 0xffff);
-					if(auth_status == AUTH_FAIL) 
-					{ 
-						// respond - denied
-						for (u16 i = 0; i < LEN_TYPE_NOP; i++)
-						{
-							msg[i] = MESSAGE_TYPE_NOP[i];
-						}
-						msg[LEN_TYPE_ACC] = END_OF_TRANSMISSION;
+				for (u16 i = 0; i < LEN_TYPE_PING; i++)
+				{
+					greeting[i] = MESSAGE_TYPE_PING[i];
+				}
+				write_u32(greeting + LEN_TYPE_PING, (u32) rate_now());
+				greeting[LEN_TYPE_PING + 4] = END_OF_TRANSMISSION;
+				ret_val = outbox_send(client_sock, greeting, OUTBOX_FRAME);
+				DEBUG_MESSAGE(SENT, ret_val, greeting);
+				__atomic_add_fetch(&heartbeat_pings, 1, __ATOMIC_RELAXED);
+				pinged = 1;
+				heartbeat_arm(&heartbeat, heartbeat_params.grace);
+			}
 
-						// reset buffers
-						for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
-						{
-							username[i] = 0;
-							password[i] = 0;
-						}
-					}
-					else if (auth_status == AUTH_SUCC)
+			// resume a parked login
+			u64 value;
+			if ((fds[1].revents & POLLIN) && read(login_event, &value, sizeof(value)) > 0)
+			{
+				session->login_pending     = 0;
+				session->auth_status       = session->login_job.status;
+				session->authentication_id = session->login_job.id;
+				if (session->auth_status == AUTH_SUCC && !session_token(session->token))
+				{
+					// no token to hand out, the login is turned down and the account given back
+					auth_release(session->authentication_id, client_sock, session->username);
+					session->auth_status = AUTH_FAIL;
+				}
+				if(session->auth_status == AUTH_FAIL) 
+				{ 
+					// respond - denied
+					for (u16 i = 0; i < LEN_TYPE_NOP; i++)
 					{
-						// respond - accepted
-						for (u16 i = 0; i < LEN_TYPE_ACC; i++)
-						{
-							msg[i] = MESSAGE_TYPE_ACC[i];
-						}
-						msg[LEN_TYPE_ACC] = END_OF_TRANSMISSION;
+						session->msg[i] = MESSAGE_TYPE_NOP[i];
+					}
+					session->msg[LEN_TYPE_ACC] = END_OF_TRANSMISSION;
+				}
+				else if (session->auth_status == AUTH_SUCC)
+				{
+					// respond - accepted, with the token that lets this session resume
+					for (u16 i = 0; i < LEN_TYPE_ACC; i++)
+					{
+						session->msg[i] = MESSAGE_TYPE_ACC[i];
+					}
+					for (u8 i = 0; i < SESSION_TOKEN_LEN; i++)
+					{
+						session->msg[LEN_TYPE_ACC + i] = session->token[i];
+					}
+					session->msg[LEN_TYPE_ACC + SESSION_TOKEN_LEN] = END_OF_TRANSMISSION;
+
+					// the session only takes the name once it is verified
+					for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+					{
+						session->username[i] = session->login_job.username[i];
+					}
+				}
+				else if (session->auth_status == AUTH_USED)
+				{
+					// respond - in use
+					for (u16 i = 0; i < LEN_TYPE_USED; i++)
+					{
+						session->msg[i] = MESSAGE_TYPE_USED[i];
 					}
-					else if (auth_status == AUTH_USED)
+					session->msg[LEN_TYPE_ACC] = END_OF_TRANSMISSION;
+				}
+
+				ret_val = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+				DEBUG_MESSAGE(SENT, ret_val, session->msg);
+			}
+			// whatever the client could not take yet goes out as soon as it can, on a channel once it rings
+			if ((fds[2].revents & POLLIN) && read(channel->server_bell, &value, sizeof(value)) > 0)
+			{
+				fds[0].revents |= outbox_pending(client_sock) ? POLLOUT : 0;
+			}
+			if (fds[0].revents & POLLOUT)
+			{
+				outbox_flush(client_sock);
+			}
+
+			// the socket goes first, whatever the client sent there came before it moved to the channel
+			if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				if (ring)
+				{
+					ret_val = uring_next(ring, ring_slot, session->msg, DEFAULT_MSG_LEN);
+				}
+				else
+				{
+					ret_val = recv(client_sock, session->msg, DEFAULT_MSG_LEN, 0);
+				}
+			}
+			else if (channel && channel_pop(&channel->memory->up, &channel->up_head, session->msg, channel->client_bell))
+			{
+				ret_val = DEFAULT_MSG_LEN;
+			}
+			else { continue; }
+			if (ret_val <= 0) { break; }
+			else
+			{
+				DEBUG_MESSAGE(RECV, ret_val, session->msg);
+
+				// anything from the client shows it is there, a PONG carries nothing else
+				pinged = 0;
+				heartbeat_arm(&heartbeat, session->in_game ? heartbeat_params.game : heartbeat_params.idle);
+				if (parse_header(&msg_pointer, MESSAGE_TYPE_PONG, LEN_TYPE_PONG))
+				{
+					msg_pointer = session->msg;
+					continue;
+				}
+
+				// a frame for one of the streams is unwrapped and handled like any other against that stream's game
+				i32 orphan = -1;
+				if (parse_header(&msg_pointer, MESSAGE_TYPE_STREAM, LEN_TYPE_STREAM))
+				{
+					u16 id     = (u16) session->msg[LEN_TYPE_STREAM] << 8 | session->msg[LEN_TYPE_STREAM + 1];
+					u8  header = session->msg[STREAM_HEADER];
+					Stream* stream = 0;
+					if (session->auth_status == AUTH_SUCC && id < STREAM_MAX)
 					{
-						// respond - in use
-						for (u16 i = 0; i < LEN_TYPE_USED; i++)
+						if (header == MESSAGE_TYPE_START[0])
 						{
-							msg[i] = MESSAGE_TYPE_USED[i];
+							stream = stream_open(session, id);
 						}
-						msg[LEN_TYPE_ACC] = END_OF_TRANSMISSION;
-
-						// reset buffers
-						for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+						else if (header == MESSAGE_TYPE_STOP[0] || header == MESSAGE_TYPE_REV[0] || header == MESSAGE_TYPE_FLAG[0])
 						{
-							username[i] = 0;
-							password[i] = 0;
+							stream = stream_find(session, id);
 						}
 					}
+					memmove(session->msg, session->msg + STREAM_HEADER, DEFAULT_MSG_LEN - STREAM_HEADER);
+					memset(session->msg + DEFAULT_MSG_LEN - STREAM_HEADER, END_OF_TRANSMISSION, STREAM_HEADER);
+					msg_pointer = session->msg;
+					if (stream)
+					{
+						stream_enter(session, stream);
+						__atomic_add_fetch(&stream_frames, 1, __ATOMIC_RELAXED);
+					}
+					else
+					{
+						orphan = id;
+					}
+				}
+
+				// a message over its budget is dropped unparsed, the client is told when to try again
+				u8  class = rate_class(session->msg[0]);
+				u16 retry = class == THROTTLE_CLASSES ? 0 : rate_check(session, class);
+				if (retry)
+				{
+					for (u16 i = 0; i < LEN_TYPE_THROTTLE; i++)
+					{
+						session->msg[i] = MESSAGE_TYPE_THROTTLE[i];
+					}
+					session->msg[LEN_TYPE_THROTTLE]     = class;
+					session->msg[LEN_TYPE_THROTTLE + 1] = retry >> 8;
+					session->msg[LEN_TYPE_THROTTLE + 2] = retry;
+					session->msg[LEN_TYPE_THROTTLE + 3] = END_OF_TRANSMISSION;
+					ret_val = session_send(session, client_sock, session->msg);
+					DEBUG_MESSAGE(SENT, ret_val, session->msg);
+					continue;
+				}
+
+				// nothing to run it against, the client is told on the stream it used
+				if (orphan >= 0)
+				{
+					for (u16 i = 0; i < LEN_TYPE_NOP; i++)
+					{
+						session->msg[i] = MESSAGE_TYPE_NOP[i];
+					}
+					session->msg[LEN_TYPE_NOP] = END_OF_TRANSMISSION;
+					ret_val = stream_send(client_sock, orphan, session->msg);
+					DEBUG_MESSAGE(SENT, ret_val, session->msg);
+					msg_pointer = session->msg;
+					continue;
+				}
+
+				if (parse_header(&msg_pointer, MESSAGE_TYPE_LOGIN, LEN_TYPE_LOGIN))
+				{
+					DEBUG("Login message detected.\n");
+					if (session->login_pending || session->auth_status == AUTH_SUCC)
+					{
+						WARN("Login ignored, one is already held or in flight: %d\n", client_sock);
+						msg_pointer = session->msg;
+						continue;
+					}
+					for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+					{
+						session->login_job.username[i] = 0;
+						session->login_job.password[i] = 0;
+					}
 
-					ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-					DEBUG_MESSAGE(SENT, ret_val, msg);
+					// username, clipped so it stays terminated
+					if(!parse_field(&msg_pointer, session->login_job.username, 
+						MESSAGE_DATA_USERNAME, LEN_DATA_USERNAME, DEFAULT_NAME_LENGTH - 1)) { break; }
+					DEBUG("Detected username: \"%s\"\n", session->login_job.username);
+					
+					// password
+					if(!parse_field(&msg_pointer, session->login_job.password, 
+						MESSAGE_DATA_PASSWORD, LEN_DATA_PASSWORD, DEFAULT_NAME_LENGTH - 1)) { break; }
+
+					// park the login, the pool signals once the account is checked and claimed
+					session->login_job.owner  = client_sock;
+					session->login_job.event  = login_event;
+					session->login_job.source = auth_source(client_sock);
+					session->login_pending    = 1;
+					auth_submit(&session->login_job);
 				}
 				else if (parse_header(&msg_pointer, MESSAGE_TYPE_START, LEN_TYPE_START))
 				{
 					WORKER(thread_idx, "New Game For Client: %d\n", client_sock);
 
-					// allocate mines
+					// a fresh board for every game
+					session_game(session);
+
+					// optional mode, the board is fixed in size so only its seed is taken
+					session->game_mode = GAME_MODE_DEFAULT;
+					if (session->msg[LEN_TYPE_START] != END_OF_TRANSMISSION)
+					{
+						session->game_mode = (GAME_MODE_DEFAULT & ~0xffffffffull) | (u32) read_u64(session->msg + LEN_TYPE_START);
+					}
+
+					// allocate mines, the scratch board is just there for lookups during allocation
+					memset(tiles, GAME_UNKNOWN, NUM_TILES);
 					pthread_mutex_lock(&random_mutex);
-					srand(DEFAULT_RANDOM_SEED);
+					srand((u32) session->game_mode);
 					for (u8 i = 0; i < NUM_MINES; i++)
 					{
 						do 
@@ -415,93 +1723,54 @@ void* client_message_handler(void* void_thread_idx)
 							_x  = rand() % NUM_COLS;
 							_y  = rand() % NUM_ROWS;
 							_xy = (_y * NUM_ROWS) + _x;
-						} while (game_map[_xy] == GAME_MINE);
-						game_map[_xy]     = GAME_MINE;
-						mine_locations[i] = _xy;
+						} while (tiles[_xy] == GAME_MINE);
+						tiles[_xy]                 = GAME_MINE;
+						session->mine_locations[i] = _xy;
 					}
 					pthread_mutex_unlock(&random_mutex);
 
-					// clear the map - it's just there for lookups during allocation
-					for (u8 i = 0; i < NUM_TILES; i++)
+					// start watch, the start is kept so a resumed session carries on the same clock
+					clock_gettime(CLOCK_MONOTONIC, &session->started);
+					if (!session->stream)
 					{
-						game_map[i] = GAME_UNKNOWN;
+						control_publish(control, &session->started, TIMER_ON);
 					}
 
-					// start watch
-					pthread_mutex_lock(&time_mutex);
-					thread_timers[thread_idx] = TIMER_ON;
-					pthread_mutex_unlock(&time_mutex);
-
 					// tell client to start
 					for (u8 i = 0; i < LEN_TYPE_GO; i++)
 					{
-						msg[i] = MESSAGE_TYPE_GO[i];
-					}
-					msg[LEN_TYPE_GO] = END_OF_TRANSMISSION;
-					ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-					DEBUG_MESSAGE(SENT, ret_val, msg);
-
-					// set leaderboard values - find user
-					pthread_mutex_lock(&leaderboard_mutex);
-
-					u8  found_user = 0;
-					for (u16 j = 0; j < leaderboard.index; j++)
-					{
-						if (found_user) { break; }
-						for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
-						{
-							if (leaderboard.usernames[j][k] != username[k]) { break; }
-							else if (username[k] == 0)
-							{
-								// found user
-								found_user = 1;
-								leaderboard.played[j]++;
-								DEBUG("Games played -> %u\n", leaderboard.played[j]);
-								break;
-							}
-						}
-					}
-
-					// set leaderboard values - create new entry
-					if(!found_user && leaderboard.index < DEFAULT_NUM_ACCOUNTS)
-					{
-						DEBUG("New leaderboard entry\n");
-						for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
-						{
-							leaderboard.usernames[leaderboard.index][j] = username[j]; 
-						}
-						leaderboard.seconds[leaderboard.index] = 0;
-						leaderboard.nano[leaderboard.index]    = 0;
-						leaderboard.won[leaderboard.index]     = 0;
-						leaderboard.played[leaderboard.index]  = 1;
-						leaderboard.index++;
+						session->msg[i] = MESSAGE_TYPE_GO[i];
 					}
+					session->msg[LEN_TYPE_GO] = END_OF_TRANSMISSION;
+					ret_val = session_send(session, client_sock, session->msg);
+					DEBUG_MESSAGE(SENT, ret_val, session->msg);
 
-					pthread_mutex_unlock(&leaderboard_mutex);
+					// set leaderboard values
+					result_record(thread_idx, RESULT_PLAYED, session, dt);
+					session->in_game = 1;
 				}
 				else if (parse_header(&msg_pointer, MESSAGE_TYPE_STOP, LEN_TYPE_STOP))
 				{
 					WORKER(thread_idx, "Abandonning Game For Client: %d\n", client_sock);
 
-					// reset game state
-					mines_left = NUM_MINES;
-					for (u8 i = 0; i < NUM_MINES; i++)
+					// walking away counts as a loss
+					if (session->in_game)
 					{
-						mine_locations[i] = 0;
+						result_record(thread_idx, RESULT_LOST, session, dt);
+						session->in_game = 0;
 					}
-					for(u8 i = 0; i < NUM_TILES; i++)
+
+					// reset game state, the arena gives the board back in one step
+					session_game(session);
+					if (!session->stream)
 					{
-						game_map[i] = GAME_UNKNOWN;
+						control_timer(control, TIMER_OFF);
 					}
-
-					pthread_mutex_lock(&time_mutex);
-					thread_timers[thread_idx] = TIMER_OFF;
-					pthread_mutex_unlock(&time_mutex);
 				}
 				else if (parse_header(&msg_pointer, MESSAGE_TYPE_REV, LEN_TYPE_REV))
 				{
-					target_cursor = msg[LEN_TYPE_REV];
-					if (game_map[target_cursor] > GAME_REVEAL_8)
+					target_cursor = session->msg[LEN_TYPE_REV];
+					if (target_cursor < NUM_TILES && board_get(session->game_map, target_cursor) > GAME_REVEAL_8)
 					{
 						u8 handled = 0;
 
@@ -509,35 +1778,35 @@ void* client_message_handler(void* void_thread_idx)
 						for (u8 i = 0; i < NUM_MINES; i++)
 						{
 							// blew yourself up on a mine
-							if (target_cursor == mine_locations[i])
+							if (target_cursor == session->mine_locations[i])
 							{
 								// transmit
 								for (u16 i = 0; i < LEN_TYPE_MINE; i++)
 								{
-									msg[i] = MESSAGE_TYPE_MINE[i];
+									session->msg[i] = MESSAGE_TYPE_MINE[i];
 								}
-								msg[LEN_TYPE_MINE] = END_OF_TRANSMISSION;
+								session->msg[LEN_TYPE_MINE] = END_OF_TRANSMISSION;
 
-								ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+								ret_val = session_send(session, client_sock, session->msg);
 								DEBUG("client blown up\n");
-								DEBUG_MESSAGE(SENT, ret_val, msg);
+								DEBUG_MESSAGE(SENT, ret_val, session->msg);
 
 								// reset timer
-								pthread_mutex_lock(&time_mutex);
-								thread_timers[thread_idx] = TIMER_OFF;
-								pthread_mutex_unlock(&time_mutex);
-
-								// reset game state
-								mines_left = NUM_MINES;
-								for (u8 i = 0; i < NUM_MINES; i++)
+								if (!session->stream)
 								{
-									mine_locations[i] = 0;
+									control_timer(control, TIMER_OFF);
 								}
-								for(u8 i = 0; i < NUM_TILES; i++)
+
+								// rate the loss
+								if (session->in_game)
 								{
-									game_map[i] = GAME_UNKNOWN;
+									result_record(thread_idx, RESULT_LOST, session, dt);
+									session->in_game = 0;
 								}
 
+								// reset game state, the arena gives the board back in one step
+								session_game(session);
+
 								handled = 1;
 								break;
 							}
@@ -546,23 +1815,25 @@ void* client_message_handler(void* void_thread_idx)
 						// if not handled the target is not a mine
 						if (!handled)
 						{
-							// run reveal algorithm
-							reveal_map(game_map, mine_locations, target_cursor);
+							// run reveal algorithm on an unpacked copy, the session only keeps nibbles
+							board_unpack(session->game_map, tiles, NUM_TILES);
+							reveal_map(tiles, session->mine_locations, target_cursor);
+							board_pack(session->game_map, tiles, NUM_TILES);
 							{ 
 								#if DEBUG_MODE
 								for (u8 ix = 0; ix < NUM_COLS; ix++)
 								{
 									for (u8 jy = 0; jy < NUM_COLS; jy++)
 									{
-										if (game_map[(ix * NUM_COLS) + jy] <= GAME_REVEAL_8)
+										if (tiles[(ix * NUM_COLS) + jy] <= GAME_REVEAL_8)
 										{
-											printf("%u  ", game_map[(ix * NUM_COLS) + jy]);
+											printf("%u  ", tiles[(ix * NUM_COLS) + jy]);
 										}
-										else if (game_map[(ix * NUM_COLS) + jy] == GAME_MINE)
+										else if (tiles[(ix * NUM_COLS) + jy] == GAME_MINE)
 										{
 											printf("*  ");
 										}
-										else if (game_map[(ix * NUM_COLS) + jy] == GAME_FLAG)
+										else if (tiles[(ix * NUM_COLS) + jy] == GAME_FLAG)
 										{
 											printf("F  ");
 										}
@@ -577,7 +1848,7 @@ void* client_message_handler(void* void_thread_idx)
 							}
 
 							// serialize and send
-							msg_pointer = msg;
+							msg_pointer = session->msg;
 							for (u8 i = 0; i < LEN_TYPE_ADJ; i++)
 							{
 								*msg_pointer = MESSAGE_TYPE_ADJ[i];
@@ -587,254 +1858,79 @@ void* client_message_handler(void* void_thread_idx)
 							msg_pointer++;
 							for (u8 i = 0; i < NUM_TILES; i++)
 							{
-								*msg_pointer = game_map[i];
+								*msg_pointer = tiles[i];
 								msg_pointer++;
 							}
 							*msg_pointer = END_OF_TRANSMISSION;
-							msg_pointer  = msg;
-							ret_val      = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+							msg_pointer  = session->msg;
+							ret_val      = session_send(session, client_sock, session->msg);
 						}
 					}
 				}
 				else if (parse_header(&msg_pointer, MESSAGE_TYPE_FLAG, LEN_TYPE_FLAG))
 				{
-					target_cursor = msg[LEN_TYPE_FLAG];
+					target_cursor = session->msg[LEN_TYPE_FLAG];
+					if (target_cursor >= NUM_TILES) { target_cursor = 0; }
+					u8 tile = board_get(session->game_map, target_cursor);
 
 					// check for mines
 					u8 handled = 0;
-					if (game_map[target_cursor] > GAME_REVEAL_8)
+					if (tile > GAME_REVEAL_8)
 					{
 						for (u8 i = 0; i < NUM_MINES; i++)
 						{
-							if (target_cursor == mine_locations[i])
+							if (target_cursor == session->mine_locations[i])
 							{
 								handled = 1;
 
 								// if you take a flag off a mine location
-								if (game_map[target_cursor] == GAME_FLAG) 
+								if (tile == GAME_FLAG) 
 								{ 
-									mines_left++; 
-									game_map[target_cursor] = GAME_UNKNOWN;
+									session->mines_left++; 
+									board_set(session->game_map, target_cursor, GAME_UNKNOWN);
 								}
 
 								// if you put a flag on a mine location
 								else
 								{ 
-									mines_left--; 
-									game_map[target_cursor] = GAME_FLAG;
+									session->mines_left--; 
+									board_set(session->game_map, target_cursor, GAME_FLAG);
 								}
 
 								// if the client won
-								if (mines_left == 0)
+								if (session->mines_left == 0)
 								{
-									// set timer to not reset or increment
-									pthread_mutex_lock(&time_mutex);
-									thread_timers[thread_idx] = TIMER_RW;
-									pthread_mutex_unlock(&time_mutex);
-									time_diff(t0[thread_idx], t1[thread_idx], &dt);
-
-									// leaderboard interaction
-									pthread_mutex_lock(&leaderboard_mutex);
-
-									// compare with previous entry
-									f64 this_time, found_time;
-									u8  found_user = 0;
-									for (u16 j = 0; j < leaderboard.index; j++)
-									{
-										if (found_user) { break; }
-										for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
-										{
-											if (leaderboard.usernames[j][k] != username[k]) { break; }
-											else if (username[k] == 0)
-											{
-												// found user
-												found_user = 1;
-												leaderboard.won[j]++;
-												DEBUG("Games won -> %u\n", leaderboard.won[j]);
-
-												// now compare results
-												this_time  = dt.tv_sec;
-        										this_time += (f64)(dt.tv_nsec / NANOSECONDS);
-
-												found_time  = leaderboard.seconds[j];
-        										found_time += (f64)(leaderboard.nano[j] / NANOSECONDS);
-
-												if (found_time == 0 || this_time < found_time)
-												{
-													DEBUG("Win time was better than leaderboard!\n");
-													leaderboard.seconds[j]	= (i64) dt.tv_sec;
-													leaderboard.nano[j]		= (i64) dt.tv_nsec;
-												}
-												else
-												{
-													DEBUG("Win time was worse than leaderboard ...\n");
-												}
-
-												break;
-											}
-										}
-									}
-
-									// if we didn't find them, something is definitely wrong
-									// but if we do, lets sort
-									if (found_user)
+									// stop the clock, the time taken is measured here rather than by the time thread
+									struct timespec now;
+									if (!session->stream)
 									{
-										// a good time to sort is now, as game wins on average are infrequent
-										u8  temp_username[DEFAULT_NAME_LENGTH];
-										i64 temp_seconds;
-										i64 temp_nano;
-										u32 temp_played;
-										u32 temp_won;
-
-										#define INCREMENT_ITERATOR() \
-										{\
-											leaderboard.seconds[iter] = leaderboard.seconds[iter - space];\
-											leaderboard.nano   [iter] = leaderboard.nano   [iter - space];\
-											leaderboard.played [iter] = leaderboard.played [iter - space];\
-											leaderboard.won	   [iter] = leaderboard.won    [iter - space];\
-											for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)\
-											{\
-												leaderboard.usernames[iter][j] = leaderboard.usernames[iter - space][j];\
-											}\
-											iter -= space;\
-										}\
-
-										//comparators
-										i32 iter;
-										f64 temp_time;
-										f64 iter_time;
-
-										for (u16 space = leaderboard.index / 2; space > 0; space /= 2) 
-										{ 
-											DEBUG("SORTING ITERATION\n");
-											for (u16 counter = space; counter < leaderboard.index; counter++) 
-											{ 
-												// store temp
-												temp_seconds = leaderboard.seconds[counter];
-												temp_nano    = leaderboard.nano[counter];
-												temp_played  = leaderboard.played[counter];
-												temp_won     = leaderboard.won[counter];
-												for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
-												{
-													temp_username[j] = leaderboard.usernames[counter][j];
-												}
-
-												// calculate time
-												temp_time	 = temp_seconds;
-												temp_time   += (f64)(temp_nano / NANOSECONDS);
-												
-												// search
-												iter = counter;
-												while (1)
-												{
-													if (iter >= leaderboard.index) { break; }
-													if (iter >= space)
-													{
-														// time comparison
-														iter_time	 = leaderboard.seconds[iter - space];
-														iter_time   += (f64)(leaderboard.nano[iter - space] / NANOSECONDS);
-														if (iter_time < temp_time)
-														{
-															INCREMENT_ITERATOR();
-														}
-														else if (iter_time >= temp_time - EPSILON && iter_time <= temp_time + EPSILON)
-														{
-															// number of games comparison
-															DEBUG("-- > RUNNING WINNINGS CHECK\n");
-															if(leaderboard.won[iter - space] > temp_won)
-															{
-																DEBUG("-- > INCREMENTING FROM WINNINGS\n");
-																INCREMENT_ITERATOR();
-															}
-															else if(leaderboard.won[iter - space] == temp_won)
-															{
-																// alphabetical name comparison
-																DEBUG("-- > RUNNING ALPHABETICAL CHECK\n");
-																u8 failed_alphabetical = 0;
-																for(u8 alpha_idx = 0; alpha_idx < DEFAULT_NAME_LENGTH; alpha_idx++)
-																{
-																	#define iter_char	leaderboard.usernames[iter-space][alpha_idx]
-																	#define temp_char	temp_username[alpha_idx]
-																	
-																	// empties
-																	if(!iter_char && !temp_char) { break; }
-
-																	// capital letter offsets
-																	u8 iter_offset = (iter_char < 91) ? 0 : 32;
-																	u8 temp_offset = (temp_char < 91) ? 0 : 32;
-																	DEBUG("%c  <  %c | %u  <  %u\n", iter_char, temp_char, (iter_char - iter_offset), (temp_char - temp_offset));
-																	if ((iter_char - iter_offset) < (temp_char - temp_offset)) 
-																	{
-																		failed_alphabetical = 1; 
-																		break; 
-																	}
-
-																	#undef iter_char
-																	#undef temp_char
-																}
-
-																if(!failed_alphabetical)
-																{
-																	DEBUG("-- > INCREMENTING FROM ALPHABETICAL\n");
-																	INCREMENT_ITERATOR();
-																}
-																else { break; }
-															}
-															else { break; }
-														}
-														else { break; }
-													}
-													else { break; }
-												} 
-
-												// restore temp
-												leaderboard.seconds[iter]   = temp_seconds;
-												leaderboard.nano[iter]      = temp_nano;
-												leaderboard.played[iter] = temp_played;
-												leaderboard.won[iter]    = temp_won;
-												for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
-												{
-													leaderboard.usernames[iter][j] = temp_username[j];
-												}
-											} 
-										} 
+										control_timer(control, TIMER_OFF);
 									}
+									clock_gettime(CLOCK_MONOTONIC, &now);
+									time_diff(session->started, now, &dt);
 
-									#undef INCREMENT_ITERATOR
-
-									pthread_mutex_unlock(&leaderboard_mutex);
-
-									// set timer to reset
-									pthread_mutex_lock(&time_mutex);
-									thread_timers[thread_idx] = TIMER_OFF;
-									pthread_mutex_unlock(&time_mutex);
+									// record the result, the indices keep themselves ordered
+									result_record(thread_idx, RESULT_WON, session, dt);
+									session->in_game = 0;
 								}
 
 								// transmit
 								for (u16 i = 0; i < LEN_TYPE_LEFT; i++)
 								{
-									msg[i] = MESSAGE_TYPE_LEFT[i];
+									session->msg[i] = MESSAGE_TYPE_LEFT[i];
 								}
-								msg[LEN_TYPE_LEFT]     = mines_left;
-								msg[LEN_TYPE_LEFT + 1] = END_OF_TRANSMISSION;
+								session->msg[LEN_TYPE_LEFT]     = session->mines_left;
+								session->msg[LEN_TYPE_LEFT + 1] = END_OF_TRANSMISSION;
 
-								ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-								WORKER(thread_idx, "Mines left: %u\n", mines_left);
-								DEBUG_MESSAGE(SENT, ret_val, msg);
+								ret_val = session_send(session, client_sock, session->msg);
+								WORKER(thread_idx, "Mines left: %u\n", session->mines_left);
+								DEBUG_MESSAGE(SENT, ret_val, session->msg);
 
 								// win - cleanup
-								if (mines_left == 0)
+								if (session->mines_left == 0)
 								{
-									// reset game state
-									mines_left = NUM_MINES;
-									for (u8 i = 0; i < NUM_MINES; i++)
-									{
-										mine_locations[i] = 0;
-									}
-									for(u8 i = 0; i < NUM_TILES; i++)
-									{
-										game_map[i] = GAME_UNKNOWN;
-									}
+									// reset game state, the arena gives the board back in one step
+									session_game(session);
 								}
 
 								break;
@@ -843,40 +1939,64 @@ void* client_message_handler(void* void_thread_idx)
 					}
 
 					// no mine -- if you take a flag off
-					if (!handled && game_map[target_cursor] == GAME_FLAG) 
+					if (!handled && tile == GAME_FLAG) 
 					{ 
-						game_map[target_cursor] = GAME_UNKNOWN;
+						board_set(session->game_map, target_cursor, GAME_UNKNOWN);
 					}
 
 					// no mine -- if you put a flag on
-					else if (!handled && game_map[target_cursor] == GAME_UNKNOWN) 
+					else if (!handled && tile == GAME_UNKNOWN) 
 					{ 
-						game_map[target_cursor] = GAME_FLAG;
+						board_set(session->game_map, target_cursor, GAME_FLAG);
 					}
 				}
 				else if (parse_header(&msg_pointer, MESSAGE_TYPE_LEAD_P, LEN_TYPE_LEAD_P))
 				{
 					u16 requested_page;
-					requested_page  = (u16) msg[LEN_TYPE_LEAD_P] << 8;
-					requested_page |= (u16) msg[LEN_TYPE_LEAD_P+1];
+					requested_page  = (u16) session->msg[LEN_TYPE_LEAD_P] << 8;
+					requested_page |= (u16) session->msg[LEN_TYPE_LEAD_P+1];
+
+					// optional mode selector
+					u64 mode = GAME_MODE_DEFAULT;
+					if (session->msg[LEN_TYPE_LEAD_P + 2] != END_OF_TRANSMISSION)
+					{
+						mode = read_u64(session->msg + LEN_TYPE_LEAD_P + 2);
+					}
+
+					// legacy pages are served from the best time index, as many as fit in one message
+					u32 page_ids[LEADERBOARD_LEGACY_ENTRIES];
+					u32 page_count = 0;
+
+					LeaderboardSet* set = registry_acquire(mode, 0);
+					Leaderboard*    lb  = registry_board(set, LEADERBOARD_WINDOW_ALL);
+					if (set)
+					{
+						pthread_mutex_lock(&set->lock);
+						registry_expand(set);
+						page_count = leaderboard_collect(lb, LEADERBOARD_SORT_TIME, 
+							(u32) requested_page * LEADERBOARD_LEGACY_ENTRIES, LEADERBOARD_LEGACY_ENTRIES, page_ids);
+						if (!page_count)
+						{
+							pthread_mutex_unlock(&set->lock);
+							registry_release(set);
+						}
+					}
 
 					// reaching outside of whats available
-					pthread_mutex_lock(&leaderboard_mutex);
-					if((i32)leaderboard.index - (requested_page * LEADERBOARD_ENTRIES) <= 0)
+					if (!page_count)
 					{
-						pthread_mutex_unlock(&leaderboard_mutex);
 						for (u8 i = 0; i < LEN_TYPE_LEAD_E; i++)
 						{
-							msg[i] = MESSAGE_TYPE_LEAD_E[i];
+							session->msg[i] = MESSAGE_TYPE_LEAD_E[i];
 						}
-						msg[LEN_TYPE_LEAD_E] = END_OF_TRANSMISSION;
-						ret_val = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-						DEBUG_MESSAGE(SENT, ret_val, msg);
+						session->msg[LEN_TYPE_LEAD_E] = END_OF_TRANSMISSION;
+						ret_val = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+						DEBUG_MESSAGE(SENT, ret_val, session->msg);
 					}
 					else
 					{
 						// put header in
-						msg_pointer = msg;
+						msg_pointer = session->msg;
 						for (u8 i = 0; i < LEN_TYPE_LEAD_R; i++)
 						{
 							*msg_pointer = MESSAGE_TYPE_LEAD_R[i];
@@ -886,14 +2006,9 @@ void* client_message_handler(void* void_thread_idx)
 						msg_pointer++;
 
 						// loop through page in leaderboard
-						i32 init = (i32)leaderboard.index - ((requested_page + 1) * LEADERBOARD_ENTRIES);
-						for (i32 i = (init < 0) ? 0 : init; i < leaderboard.index - (requested_page * LEADERBOARD_ENTRIES); i++)
+						for (u32 i = 0; i < page_count; i++)
 						{
-							// early exits
-							if ((i && i >= leaderboard.index) || (!i && !leaderboard.usernames[i][0])) { break; }
-
-							// filter to champions
-							if(!leaderboard.won[i]) { continue; }
+							LeaderboardEntry* entry = &lb->entries[page_ids[i]];
 
 							// username
 							for (u8 j = 0; j < LEN_DATA_USERNAME; j++)
@@ -903,85 +2018,265 @@ void* client_message_handler(void* void_thread_idx)
 							}
 							for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
 							{
-								*msg_pointer = leaderboard.usernames[i][j];
+								*msg_pointer = entry->username[j];
 								msg_pointer++;
 							}
 							*msg_pointer = '\n';
 							msg_pointer++;
 
 							// seconds
-							*msg_pointer = leaderboard.seconds[i] >> 56; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 48; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 40; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 32; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 24; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 16; msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i] >> 8;  msg_pointer++;
-							*msg_pointer = leaderboard.seconds[i];       msg_pointer++;
-							*msg_pointer = '\n';                         msg_pointer++;
+							*msg_pointer = entry->seconds >> 56; msg_pointer++;
+							*msg_pointer = entry->seconds >> 48; msg_pointer++;
+							*msg_pointer = entry->seconds >> 40; msg_pointer++;
+							*msg_pointer = entry->seconds >> 32; msg_pointer++;
+							*msg_pointer = entry->seconds >> 24; msg_pointer++;
+							*msg_pointer = entry->seconds >> 16; msg_pointer++;
+							*msg_pointer = entry->seconds >> 8;  msg_pointer++;
+							*msg_pointer = entry->seconds;       msg_pointer++;
+							*msg_pointer = '\n';                 msg_pointer++;
 
 							// nanoseconds
-							*msg_pointer = leaderboard.nano[i] >> 56; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 48; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 40; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 32; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 24; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 16; msg_pointer++;
-							*msg_pointer = leaderboard.nano[i] >> 8;  msg_pointer++;
-							*msg_pointer = leaderboard.nano[i];		  msg_pointer++;
-							*msg_pointer = '\n';					  msg_pointer++;
+							*msg_pointer = entry->nano >> 56; msg_pointer++;
+							*msg_pointer = entry->nano >> 48; msg_pointer++;
+							*msg_pointer = entry->nano >> 40; msg_pointer++;
+							*msg_pointer = entry->nano >> 32; msg_pointer++;
+							*msg_pointer = entry->nano >> 24; msg_pointer++;
+							*msg_pointer = entry->nano >> 16; msg_pointer++;
+							*msg_pointer = entry->nano >> 8;  msg_pointer++;
+							*msg_pointer = entry->nano;		  msg_pointer++;
+							*msg_pointer = '\n';			  msg_pointer++;
 
 							// games played
-							DEBUG("SENDING PLAYED: %u\n", leaderboard.played[i]);
-							*msg_pointer = leaderboard.played[i] >> 24; msg_pointer++;
-							*msg_pointer = leaderboard.played[i] >> 16; msg_pointer++;
-							*msg_pointer = leaderboard.played[i] >> 8;  msg_pointer++;
-							*msg_pointer = leaderboard.played[i];		msg_pointer++;
-							*msg_pointer = '\n';					    msg_pointer++;
+							DEBUG("SENDING PLAYED: %u\n", entry->played);
+							write_u32(msg_pointer, entry->played); msg_pointer += 4;
+							*msg_pointer = '\n';				   msg_pointer++;
 
 							// games won
-							DEBUG("SENDING WON:    %u\n", leaderboard.won[i]);
-							*msg_pointer = leaderboard.won[i] >> 24; msg_pointer++;
-							*msg_pointer = leaderboard.won[i] >> 16; msg_pointer++;
-							*msg_pointer = leaderboard.won[i] >> 8;  msg_pointer++;
-							*msg_pointer = leaderboard.won[i];		 msg_pointer++;
-							*msg_pointer = '\n';					 msg_pointer++;
+							DEBUG("SENDING WON:    %u\n", entry->won);
+							write_u32(msg_pointer, entry->won); msg_pointer += 4;
+							*msg_pointer = '\n';				msg_pointer++;
 						}
 
 						// transmit
-						pthread_mutex_unlock(&leaderboard_mutex);
+						pthread_mutex_unlock(&set->lock);
+						registry_release(set);
+						*msg_pointer = END_OF_TRANSMISSION;
+						msg_pointer  = session->msg;
+						ret_val      = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+						DEBUG_MESSAGE(SENT, ret_val, session->msg);
+					}
+				}
+				else if (parse_header(&msg_pointer, MESSAGE_TYPE_LEAD_Q, LEN_TYPE_LEAD_Q))
+				{
+					// results are serialized under the lock, then streamed without it
+					u8 frames[LEADERBOARD_QUERY_FRAMES][DEFAULT_MSG_LEN];
+					u8 frame_count = 0;
+
+					LeaderboardSet* set = registry_acquire(read_u64(session->msg + LEN_TYPE_LEAD_Q + 5), 0);
+					Leaderboard*    lb  = registry_board(set, session->msg[LEN_TYPE_LEAD_Q + 2]);
+					if (lb)
+					{
+						pthread_mutex_lock(&set->lock);
+						registry_expand(set);
+						frame_count = leaderboard_query(lb, session->msg, session->username, frames);
+						pthread_mutex_unlock(&set->lock);
+					}
+					if (set) { registry_release(set); }
+
+					if (!frame_count)
+					{
+						for (u8 i = 0; i < LEN_TYPE_LEAD_E; i++)
+						{
+							session->msg[i] = MESSAGE_TYPE_LEAD_E[i];
+						}
+						session->msg[LEN_TYPE_LEAD_E] = END_OF_TRANSMISSION;
+						ret_val = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+						DEBUG_MESSAGE(SENT, ret_val, session->msg);
+					}
+					for (u8 f = 0; f < frame_count; f++)
+					{
+						u8* frame = frames[f];
+						ret_val = outbox_send(client_sock, frame, OUTBOX_FRAME);
+						if (ret_val < 0) { break; }
+						DEBUG_MESSAGE(SENT, ret_val, frame);
+					}
+				}
+				else if (parse_header(&msg_pointer, MESSAGE_TYPE_SUB, LEN_TYPE_SUB))
+				{
+					u8  key    = session->msg[LEN_TYPE_SUB];
+					u8  window = session->msg[LEN_TYPE_SUB + 1];
+					u32 first  = read_u32(session->msg + LEN_TYPE_SUB + 2);
+					u32 count  = ((u32) session->msg[LEN_TYPE_SUB + 6] << 8) | session->msg[LEN_TYPE_SUB + 7];
+					u64 mode   = read_u64(session->msg + LEN_TYPE_SUB + 8);
+					if (key < LEADERBOARD_SORT_KEYS && window < LEADERBOARD_WINDOWS)
+					{
+						if (count > LEADERBOARD_QUERY_MAX) { count = LEADERBOARD_QUERY_MAX; }
+						subscription_set(client_sock, key, window, mode, first, count);
+
+						// the next tick pushes the whole range as a starting point
+						LeaderboardSet* set = count ? registry_acquire(mode, 0) : 0;
+						if (set)
+						{
+							pthread_mutex_lock(&set->lock);
+							registry_expand(set);
+							leaderboard_touch(registry_board(set, window), key, first, first + count - 1);
+							pthread_mutex_unlock(&set->lock);
+							registry_release(set);
+						}
+					}
+				}
+				else if (parse_header(&msg_pointer, MESSAGE_TYPE_RESUME, LEN_TYPE_RESUME))
+				{
+					// a valid token stands in for the login and brings the detached session back
+					Session* resumed = 0;
+					if (!session->login_pending && session->auth_status != AUTH_SUCC)
+					{
+						resumed = session_resume(session->msg + LEN_TYPE_RESUME, client_sock);
+					}
+					if (resumed)
+					{
+						WORKER(thread_idx, "Session resumed: %d\n", client_sock);
+						session_free(session);
+						session = resumed;
+
+						// the clock never stopped while the client was away
+						struct timespec now;
+						control_publish(control, &session->started, session->in_game ? TIMER_ON : TIMER_OFF);
+						clock_gettime(CLOCK_MONOTONIC, &now);
+						time_diff(session->started, now, &dt);
+
+						// one snapshot frame, tokens are single use, a blank one keeps it from being parked again
+						session_token(session->token);
+						msg_pointer = session->msg;
+						for (u8 i = 0; i < LEN_TYPE_SNAP; i++)
+						{
+							*msg_pointer = MESSAGE_TYPE_SNAP[i];
+							msg_pointer++;
+						}
+						for (u8 i = 0; i < SESSION_TOKEN_LEN; i++)
+						{
+							*msg_pointer = session->token[i];
+							msg_pointer++;
+						}
+						write_u64(msg_pointer, session->game_mode);	msg_pointer += GAME_MODE_LEN;
+						*msg_pointer = session->in_game;			msg_pointer++;
+						*msg_pointer = session->mines_left;			msg_pointer++;
+						write_u64(msg_pointer, session->in_game ? dt.tv_sec : 0);	msg_pointer += 8;
+						write_u64(msg_pointer, session->in_game ? dt.tv_nsec : 0);	msg_pointer += 8;
+						board_unpack(session->game_map, msg_pointer, NUM_TILES);
+						msg_pointer += NUM_TILES;
 						*msg_pointer = END_OF_TRANSMISSION;
-						msg_pointer  = msg;
-						ret_val      = send(client_sock, msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-						DEBUG_MESSAGE(SENT, ret_val, msg);
+					}
+					else
+					{
+						// unknown or expired, the client falls back to logging in
+						for (u16 i = 0; i < LEN_TYPE_NOP; i++)
+						{
+							session->msg[i] = MESSAGE_TYPE_NOP[i];
+						}
+						session->msg[LEN_TYPE_NOP] = END_OF_TRANSMISSION;
+					}
+					ret_val = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+					DEBUG_MESSAGE(SENT, ret_val, session->msg);
+				}
+				else if (parse_header(&msg_pointer, MESSAGE_TYPE_CHANNEL, LEN_TYPE_CHANNEL))
+				{
+					// a client on this host moves onto shared rings, once per connection
+					DEBUG("Channel requested.\n");
+					if (channel || !(channel = channel_open(client_sock)))
+					{
+						for (u16 i = 0; i < LEN_TYPE_OPENED; i++)
+						{
+							session->msg[i] = MESSAGE_TYPE_OPENED[i];
+						}
+						session->msg[LEN_TYPE_OPENED]     = 0;
+						session->msg[LEN_TYPE_OPENED + 1] = END_OF_TRANSMISSION;
+						ret_val = outbox_send(client_sock, session->msg, OUTBOX_FRAME);
+						DEBUG_MESSAGE(SENT, ret_val, session->msg);
 					}
 				}
 				else
 				{
 					WARN("Message header did not match any defined types\n");
-					WARN("Message: \"%s\"\n", msg);
+					WARN("Message: \"%s\"\n", session->msg);
 				}
 
 				// done parsing - reset pointer
-				msg_pointer = msg;
+				msg_pointer = session->msg;
+			}
+		}
+
+		// nothing is read from the client any more
+		stream_leave(session);
+		heartbeat_arm(&heartbeat, 0);
+		if (ring)
+		{
+			uring_release(ring, ring_slot);
+		}
+		if (channel)
+		{
+			channel_close(client_sock, channel);
+		}
+
+		// a login still being checked has to finish before its claim can be given back
+		fds[0].fd = DEFAULT_SOCKET;
+		fds[1].fd = login_event;
+		while (session->login_pending)
+		{
+			u64 value;
+			coroutine_poll(fds, 2, -1);
+			if (read(login_event, &value, sizeof(value)) > 0)
+			{
+				session->login_pending     = 0;
+				session->auth_status       = session->login_job.status;
+				session->authentication_id = session->login_job.id;
 			}
 		}
 
-		// client release
-		if (auth_status == AUTH_SUCC)
+		// client release, a logged in session is parked so it can be resumed
+		if (session->auth_status == AUTH_SUCC && !reaped)
 		{
-			pthread_mutex_lock(&auth_mutex);
-			database.in_use[authentication_id] = 0;
-			pthread_mutex_unlock(&auth_mutex);
+			session_detach(session);
 		}
 
-		thread_actives[thread_idx] = DEFAULT_SOCKET;
+		// an anonymous game left running is lost, a reaped client's account is free at once
+		else
+		{
+			if (session->auth_status == AUTH_SUCC)
+			{
+				auth_release(session->authentication_id, client_sock, session->username);
+			}
+			if (session->in_game)
+			{
+				result_record(thread_idx, RESULT_LOST, session, dt);
+			}
+			for (u32 i = 0; session->streams && i < STREAM_MAX; i++)
+			{
+				if (session->streams[i] && session->streams[i]->in_game)
+				{
+					stream_enter(session, session->streams[i]);
+					result_record(thread_idx, RESULT_LOST, session, dt);
+					stream_leave(session);
+				}
+			}
+			session_free(session);
+		}
 
-		pthread_mutex_lock(&time_mutex);
-		thread_timers[thread_idx] = TIMER_OFF;
-		pthread_mutex_unlock(&time_mutex);
+		subscription_remove(client_sock);
+		control_timer(control, TIMER_OFF);
+		__atomic_store_n(&control->socket, DEFAULT_SOCKET, __ATOMIC_SEQ_CST);
 
+		// the time thread may still hold this fd from the round it is in, let that round end before it can be reused
+		u32 round = __atomic_load_n(&time_round, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&time_round, __ATOMIC_SEQ_CST) == round && !__atomic_load_n(&time_parked, __ATOMIC_SEQ_CST))
+		{
+			coroutine_poll(0, 0, 1);
+		}
+		outbox_reset(client_sock);
 		close(client_sock);
+		__atomic_sub_fetch(&shard->busy, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&pool_busy[thread_idx], 1, __ATOMIC_RELAXED);
+		pool_served(&served);
 		WORKER(thread_idx, "Client disconnected\n");
 	}
 }
@@ -991,7 +2286,8 @@ void* idle_polling_handler()
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 	
 	i32 ret_val;
-	u16 position;
+	u32 position;
+	u32 wait;
 
 	// message statics
 	u8  msg[DEFAULT_MSG_LEN] = {0};
@@ -999,63 +2295,132 @@ void* idle_polling_handler()
 	{
 		msg[i] = MESSAGE_TYPE_QUEUE[i];
 	}
-	msg[LEN_TYPE_QUEUE+2] = END_OF_TRANSMISSION;
+	msg[LEN_TYPE_QUEUE+7] = END_OF_TRANSMISSION;
 	
 	while (1)
 	{
-		for (u8 i = 0; i <= queue.batch_idx; i++)
+		// detached sessions nobody came back for
+		session_expire();
+		queue_check_sweep();
+		if (metrics_requested)
+		{
+			metrics_requested = 0;
+			session_metrics();
+		}
+
+		// positions are within the connection's own shard and class
+		for (u8 s = 0; s < shard_count; s++)
 		{
-			pthread_mutex_lock(&queue_mutex);
-			for (u16 j = 0; j < (QUEUE_CLIENT_BUFFER_LEN - 1); j++)
+			Shard* shard = &shards[s];
+			pthread_mutex_lock(&shard->lock);
+			queue_tick(shard);
+			for (u8 c = 0; c < QUEUE_CLASSES; c++)
 			{
-				if (queue.client_batch[i][j] == DEFAULT_SOCKET) 
-				{ 
-					i = 0;
-					break; 
-				}
-				else 
+				i32 next;
+				for (i32 socket = shard->queue.classes[c].head; socket != DEFAULT_SOCKET; socket = next)
 				{
-					position = (i * QUEUE_CLIENT_BUFFER_LEN) + j;
+					next = queue_nodes[socket].next;
+
+					// clients coming back with a live token or logging into a premium account move up,
+					// to the back of their new class so they don't cut ahead of its earlier arrivals
+					if (c == QUEUE_CLASS_ANONYMOUS)
+					{
+						u8 class = queue_classify(socket);
+						if (class == c) { class = queue_check(socket); }
+						if (class != c)
+						{
+							queue_unlink(shard, socket);
+							queue_link(shard, socket, class, 0);
+						}
+					}
+
+					position = queue_position(shard, socket);
+					wait     = queue_estimate(shard, socket, position);
+					position = position > UINT16_MAX ? UINT16_MAX : position;
 					msg[LEN_TYPE_QUEUE]      = position >> 8;    // high
 					msg[LEN_TYPE_QUEUE + 1]  = position;         // low
-					ret_val = send(queue.client_batch[i][j], msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+					msg[LEN_TYPE_QUEUE + 2]  = queue_nodes[socket].class;
+					write_u32(msg + LEN_TYPE_QUEUE + 3, wait);
+					ret_val = outbox_send(socket, msg, OUTBOX_QUEUE);
 					if (ret_val < 0)
 					{
-						#define q	queue
-
 						// drop dead connection
-						DEBUG("FOUND DEAD IDLE CONNECTION:  %d\n", q.client_batch[i][j]);
-						DEBUG_QUEUE();
-						for (u8 x = i; x <= q.batch_idx; x++)
-						{
-							for (u16 y = j; y < (QUEUE_CLIENT_BUFFER_LEN - 1); y++)
-							{
-								if (q.client_batch[x][y] == DEFAULT_SOCKET) { break; }
-								q.client_batch[x][y] = q.client_batch[x][y+1];
-							}
-							if (x != q.batch_idx)
-							{
-								q.client_batch[x][(QUEUE_CLIENT_BUFFER_LEN - 1)] = q.client_batch[x+1][0];
-							}
-						}
-						if (q.idx == 0)
-						{
-							free(q.client_batch[q.batch_idx]);
-							q.batch_idx--;
-							q.idx = QUEUE_CLIENT_BUFFER_LEN - 1;
-						}
-						else 
-						{
-							q.idx--;
-						}
-						DEBUG_QUEUE();
-
-						#undef q
+						DEBUG("FOUND DEAD IDLE CONNECTION:  %d\n", socket);
+						queue_unlink(shard, socket);
+						DEBUG_QUEUE(shard->queue);
 					}
 				}
 			}
-			pthread_mutex_unlock(&queue_mutex);
-			sleep(1);
+			pthread_mutex_unlock(&shard->lock);
+		}
+		sleep(1);
+	}
+}
+
+void* pool_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	u64 idle_since[NUM_THREADS] = {0};
+	while (1)
+	{
+		sleep(POOL_TICK);
+		if (upgrading) { continue; }
+
+		// connections no free session is left for, sessions handed over by an upgrade included
+		u64 waiting = 0;
+		u64 busy    = 0;
+		for (u8 s = 0; s < shard_count; s++)
+		{
+			waiting += queue_length(&shards[s]);
+			busy    += __atomic_load_n(&shards[s].busy, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_lock(&upgrade_mutex);
+		waiting += adopted_count;
+		pthread_mutex_unlock(&upgrade_mutex);
+		u64 slots   = (u64) __atomic_load_n(&pool_size, __ATOMIC_RELAXED) * SESSION_COROUTINES;
+		u64 idle    = slots > busy ? slots - busy : 0;
+		u64 backlog = waiting > idle ? waiting - idle : 0;
+
+		// each slot frees up once per session on average, so that is how long the backlog takes
+		u64 service = __atomic_load_n(&pool_service, __ATOMIC_RELAXED);
+		u64 wait    = slots ? backlog * service / slots / 1000 : 0;
+		__atomic_store_n(&pool_wait, wait, __ATOMIC_RELAXED);
+		if (backlog && (backlog >= pool_params.depth || wait >= pool_params.wait))
+		{
+			// enough workers for the whole backlog at once, as far as the maximum allows
+			u64 wanted = (backlog + SESSION_COROUTINES - 1) / SESSION_COROUTINES;
+			while (wanted-- && __atomic_load_n(&pool_size, __ATOMIC_RELAXED) < pool_params.max)
+			{
+				if (!pool_spawn()) { break; }
+			}
+			continue;
+		}
+
+		// a worker that served nobody for the whole cooldown goes, one per tick and never a shard's last
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (u16 w = 0; w < NUM_THREADS; w++)
+		{
+			if (waiting || !__atomic_load_n(&pool_running[w], __ATOMIC_ACQUIRE) || 
+				__atomic_load_n(&pool_retiring[w], __ATOMIC_RELAXED) || __atomic_load_n(&pool_busy[w], __ATOMIC_RELAXED))
+			{
+				idle_since[w] = 0;
+				continue;
+			}
+			if (!idle_since[w])
+			{
+				idle_since[w] = now.tv_sec;
+				continue;
+			}
+			if (now.tv_sec - idle_since[w] >= pool_params.cooldown && 
+				__atomic_load_n(&pool_size, __ATOMIC_RELAXED) > pool_params.min &&
+				__atomic_load_n(&shards[w % shard_count].workers, __ATOMIC_RELAXED) > 1)
+			{
+				pool_retire(w);
+				idle_since[w] = 0;
+				break;
+			}
 		}
 	}
 }
@@ -1068,7 +2433,8 @@ void* time_polling_handler()
 	const struct timespec sleep_amount = {0, 133333};
 	
 	struct timespec dt;
-	u8  set[NUM_THREADS]     = {0};
+	struct timespec start;
+	struct timespec now;
 	u8  msg[DEFAULT_MSG_LEN] = {0};
 	
 	// default message header
@@ -1079,107 +2445,322 @@ void* time_polling_handler()
 
 	while (1)
 	{
-		for (u8 i = 0; i < NUM_THREADS; i++)
+		// an upgrade stops it between rounds, nothing is written to a client after that
+		if (upgrading)
 		{
-			pthread_mutex_lock(&time_mutex);
-			if (thread_timers[i] == TIMER_ON)
+			__atomic_store_n(&time_parked, 1, __ATOMIC_SEQ_CST);
+			upgrade_park(0);
+			__atomic_store_n(&time_parked, 0, __ATOMIC_SEQ_CST);
+		}
+		for (u16 word = 0; word < NUM_SLOTS / 64; word++)
+		{
+			// only slots with a game on, a whole word of idle slots is one load
+			u64 bits = __atomic_load_n(&timer_slots[word], __ATOMIC_ACQUIRE);
+			for (; bits; bits &= bits - 1)
 			{
-				pthread_mutex_unlock(&time_mutex);
-
-				if (!set[i])
+				SlotControl* control = &slot_controls[word * 64 + __builtin_ctzll(bits)];
+				if (__atomic_load_n(&control->timer, __ATOMIC_ACQUIRE) == TIMER_ON)
 				{
-					clock_gettime(CLOCK_MONOTONIC, &t0[i]);
-					set[i] = 1;
-				}
+					// the worker sets the start, a resumed game brings its own
+					control_read(control, &start);
+					clock_gettime(CLOCK_MONOTONIC, &now);
+	        		time_diff(start, now, &dt);
 
-				clock_gettime(CLOCK_MONOTONIC, &t1[i]);
-        		time_diff(t0[i], t1[i], &dt);
+					// extract and cast
+					i64 dt_sec_signed    = (i64) dt.tv_sec;
+					i64 dt_nano_signed   = (i64) dt.tv_nsec;
 
-				// extract and cast
-				i64 dt_sec_signed    = (i64) dt.tv_sec;
-				i64 dt_nano_signed   = (i64) dt.tv_nsec;
-
-				u64 dt_sec   = (u64) dt_sec_signed; 
-				u64 dt_nano  = (u64) dt_nano_signed; 
+					u64 dt_sec   = (u64) dt_sec_signed; 
+					u64 dt_nano  = (u64) dt_nano_signed; 
 				
-				// seconds
-				msg[LEN_TYPE_TIME + 0] = dt_sec >> 56;
-				msg[LEN_TYPE_TIME + 1] = dt_sec >> 48;
-				msg[LEN_TYPE_TIME + 2] = dt_sec >> 40;
-				msg[LEN_TYPE_TIME + 3] = dt_sec >> 32;
-				msg[LEN_TYPE_TIME + 4] = dt_sec >> 24;
-				msg[LEN_TYPE_TIME + 5] = dt_sec >> 16;
-				msg[LEN_TYPE_TIME + 6] = dt_sec >> 8;
-				msg[LEN_TYPE_TIME + 7] = dt_sec;
-
-				// nanoseconds
-				msg[LEN_TYPE_TIME + 8 ] = dt_nano >> 56; 
-				msg[LEN_TYPE_TIME + 9 ] = dt_nano >> 48; 
-				msg[LEN_TYPE_TIME + 10] = dt_nano >> 40;
-				msg[LEN_TYPE_TIME + 11] = dt_nano >> 32;
-				msg[LEN_TYPE_TIME + 12] = dt_nano >> 24;
-				msg[LEN_TYPE_TIME + 13] = dt_nano >> 16;
-				msg[LEN_TYPE_TIME + 14] = dt_nano >> 8;
-				msg[LEN_TYPE_TIME + 15] = dt_nano;
-
-				// finalize
-				msg[LEN_TYPE_TIME + 16] = END_OF_TRANSMISSION;
-				send(thread_actives[i], msg, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
-			}
-			else if (thread_timers[i] == TIMER_OFF)
-			{
-				pthread_mutex_unlock(&time_mutex);
-				set[i] = 0;
-			}
-			else
-			{
-				pthread_mutex_unlock(&time_mutex);
+					// seconds
+					msg[LEN_TYPE_TIME + 0] = dt_sec >> 56;
+					msg[LEN_TYPE_TIME + 1] = dt_sec >> 48;
+					msg[LEN_TYPE_TIME + 2] = dt_sec >> 40;
+					msg[LEN_TYPE_TIME + 3] = dt_sec >> 32;
+					msg[LEN_TYPE_TIME + 4] = dt_sec >> 24;
+					msg[LEN_TYPE_TIME + 5] = dt_sec >> 16;
+					msg[LEN_TYPE_TIME + 6] = dt_sec >> 8;
+					msg[LEN_TYPE_TIME + 7] = dt_sec;
+
+					// nanoseconds
+					msg[LEN_TYPE_TIME + 8 ] = dt_nano >> 56; 
+					msg[LEN_TYPE_TIME + 9 ] = dt_nano >> 48; 
+					msg[LEN_TYPE_TIME + 10] = dt_nano >> 40;
+					msg[LEN_TYPE_TIME + 11] = dt_nano >> 32;
+					msg[LEN_TYPE_TIME + 12] = dt_nano >> 24;
+					msg[LEN_TYPE_TIME + 13] = dt_nano >> 16;
+					msg[LEN_TYPE_TIME + 14] = dt_nano >> 8;
+					msg[LEN_TYPE_TIME + 15] = dt_nano;
+
+					// finalize
+					msg[LEN_TYPE_TIME + 16] = END_OF_TRANSMISSION;
+					outbox_send(__atomic_load_n(&control->socket, __ATOMIC_RELAXED), msg, OUTBOX_TIME);
+				}
 			}
 		}
+		// a finished round means no frame is still headed for a socket that was switched off before it
+		__atomic_add_fetch(&time_round, 1, __ATOMIC_SEQ_CST);
 		nanosleep(&sleep_amount, 0);
 	}
 }
 
-// interupt handler
-void exit_handle() 
+void* leaderboard_push_handler()
 {
-	printf("\n");
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
 
-	DEBUG("Killing time polling manager\n");
-	pthread_cancel(time_manager);
+	// at most one push per tick, however many wins land within it
+	const struct timespec sleep_amount = {0, LEADERBOARD_PUSH_TICK};
 
-	DEBUG("Killing workers\n");
-	for (u16 i = 0; i < NUM_THREADS; i++)
-	{
-		pthread_cancel(pool[i]);
-	}
+	static u8  frames[LEADERBOARD_PUSH_FRAMES][DEFAULT_MSG_LEN];
+	static u32 frame_first[LEADERBOARD_PUSH_FRAMES];
+	static u32 frame_last[LEADERBOARD_PUSH_FRAMES];
+	u32*       ranges   = 0;
+	u32        capacity = 0;
 
-	DEBUG("Closing active connections\n");
+	while (1)
+	{
+		nanosleep(&sleep_amount, 0);
+
+		// cold sets lose their indices between ticks, never while being read
+		registry_trim();
+
+		u32 set_count;
+		LeaderboardSet** sets = registry_collect(&set_count);
+		for (u32 board = 0; board < set_count * LEADERBOARD_WINDOWS * LEADERBOARD_SORT_KEYS; board++)
+		{
+			LeaderboardSet* set = sets[board / (LEADERBOARD_WINDOWS * LEADERBOARD_SORT_KEYS)];
+			u8 window = (board / LEADERBOARD_SORT_KEYS) % LEADERBOARD_WINDOWS;
+			u8 key    = board % LEADERBOARD_SORT_KEYS;
+			pthread_mutex_lock(&subscription_mutex);
+
+			// gather the subscribed ranges for this key
+			u32 range_count = 0;
+			if (capacity < subscriptions.count)
+			{
+				capacity = subscriptions.count;
+				ranges   = realloc(ranges, sizeof(u32) * 2 * capacity);
+			}
+			for (u32 i = 0; i < subscriptions.count; i++)
+			{
+				Subscription* sub = &subscriptions.list[i];
+				if (sub->key != key || sub->window != window || sub->mode != set->mode) { continue; }
+
+				// insertion sort by first rank, lists are short
+				u32 j = range_count;
+				while (j > 0 && ranges[(j - 1) * 2] > sub->first)
+				{
+					ranges[j * 2]     = ranges[(j - 1) * 2];
+					ranges[j * 2 + 1] = ranges[(j - 1) * 2 + 1];
+					j--;
+				}
+				ranges[j * 2]     = sub->first;
+				ranges[j * 2 + 1] = sub->first + sub->count - 1;
+				range_count++;
+			}
+
+			if (!range_count)
+			{
+				pthread_mutex_unlock(&subscription_mutex);
+				continue;
+			}
+
+			// watched sets stay indexed
+			pthread_mutex_lock(&set->lock);
+			registry_expand(set);
+			Leaderboard* lb = registry_board(set, window);
+
+			u32 dirty_first = lb->dirty_first[key];
+			u32 dirty_last  = lb->dirty_last[key];
+			lb->dirty_first[key] = LEADERBOARD_NIL;
+			lb->dirty_last[key]  = 0;
+
+			u32 total = leaderboard_size(lb, key);
+			if (dirty_last >= total) { dirty_last = total - 1; }
+			if (!total || dirty_first > dirty_last)
+			{
+				pthread_mutex_unlock(&set->lock);
+				pthread_mutex_unlock(&subscription_mutex);
+				continue;
+			}
+
+			// serialize each changed rank once, walking the merged ranges
+			u8  frame_count = 0;
+			u32 covered     = 0;
+			for (u32 i = 0; i < range_count; i++)
+			{
+				u32 first = ranges[i * 2];
+				u32 last  = ranges[i * 2 + 1];
+				if (first < covered)     { first = covered; }
+				if (first < dirty_first) { first = dirty_first; }
+				if (last  > dirty_last)  { last  = dirty_last; }
+				if (last + 1 > covered)  { covered = last + 1; }
+
+				while (first <= last)
+				{
+					if (frame_count == LEADERBOARD_PUSH_FRAMES)
+					{
+						// out of room, the rest goes out next tick
+						leaderboard_touch(lb, key, first, dirty_last);
+						break;
+					}
+
+					u32 ids[LEADERBOARD_FRAME_ENTRIES];
+					u32 in_frame = last - first + 1;
+					if (in_frame > LEADERBOARD_FRAME_ENTRIES) { in_frame = LEADERBOARD_FRAME_ENTRIES; }
+					in_frame = leaderboard_collect(lb, key, first, in_frame, ids);
+
+					u8* frame = frames[frame_count];
+					for (u8 j = 0; j < LEN_TYPE_PUSH; j++)
+					{
+						frame[j] = MESSAGE_TYPE_PUSH[j];
+					}
+					frame[LEN_TYPE_PUSH + 0] = key;
+					frame[LEN_TYPE_PUSH + 1] = window;
+					frame[LEN_TYPE_PUSH + 2] = frame_count;
+					write_u32(frame + LEN_TYPE_PUSH + 3, total);
+					write_u32(frame + LEN_TYPE_PUSH + 7, first);
+					frame[LEN_TYPE_PUSH + 11] = in_frame;
+					write_u64(frame + LEN_TYPE_PUSH + 12, set->mode);
+
+					u8* frame_pointer = frame + LEADERBOARD_PUSH_HEADER;
+					for (u32 j = 0; j < in_frame; j++)
+					{
+						LeaderboardEntry* entry = &lb->entries[ids[j]];
+						for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
+						{
+							frame_pointer[k] = entry->username[k];
+						}
+						frame_pointer += DEFAULT_NAME_LENGTH;
+						write_u32(frame_pointer + 0,  (u32) entry->seconds);
+						write_u32(frame_pointer + 4,  (u32) entry->nano);
+						write_u32(frame_pointer + 8,  entry->won);
+						write_u32(frame_pointer + 12, entry->played);
+						write_u32(frame_pointer + 16, (u32) lround(fmax(entry->rating.rating, 0)));
+						frame_pointer += 20;
+					}
+					*frame_pointer = END_OF_TRANSMISSION;
+
+					frame_first[frame_count] = first;
+					frame_last[frame_count]  = first + in_frame - 1;
+					frame_count++;
+					first += in_frame;
+				}
+			}
+
+			pthread_mutex_unlock(&set->lock);
+
+			// fan out the same frames to everyone watching an overlapping range
+			for (u32 i = 0; i < subscriptions.count; i++)
+			{
+				Subscription* sub = &subscriptions.list[i];
+				if (sub->key != key || sub->window != window || sub->mode != set->mode) { continue; }
+
+				for (u8 f = 0; f < frame_count; f++)
+				{
+					if (frame_last[f] < sub->first || frame_first[f] >= sub->first + sub->count) { continue; }
+
+					// never wait on a subscriber, one over its watermark drops the subscription
+					i32 ret_val = outbox_send(sub->socket, frames[f], OUTBOX_FRAME);
+					if (ret_val != DEFAULT_MSG_LEN || outbox_pending(sub->socket) >= OUTBOX_HIGH)
+					{
+						DEBUG("Dropping stalled subscriber: %d\n", sub->socket);
+						subscriptions.list[i] = subscriptions.list[subscriptions.count - 1];
+						subscriptions.count--;
+						i--;
+						break;
+					}
+				}
+			}
+
+			pthread_mutex_unlock(&subscription_mutex);
+		}
+
+		for (u32 i = 0; i < set_count; i++)
+		{
+			registry_release(sets[i]);
+		}
+		free(sets);
+	}
+}
+
+// interupt handler
+void exit_handle() 
+{
+	printf("\n");
+
+	DEBUG("Killing time polling manager\n");
+	pthread_cancel(time_manager);
+
+	DEBUG("Killing leaderboard push manager\n");
+	pthread_cancel(push_manager);
+
+	DEBUG("Killing leaderboard rotation manager\n");
+	pthread_cancel(rotate_manager);
+
+	DEBUG("Killing rating manager\n");
+	pthread_cancel(rating_manager);
+
+	if (result_event != DEFAULT_SOCKET)
+	{
+		DEBUG("Killing leaderboard merge manager\n");
+		pthread_cancel(merge_manager);
+	}
+
+	if (cluster_channel == DEFAULT_SOCKET)
+	{
+		DEBUG("Killing upgrade listener\n");
+		pthread_cancel(upgrade_manager);
+		if (upgrade_bound) { unlink(UPGRADE_SOCKET); }
+	}
+
+	DEBUG("Killing account watcher and verifiers\n");
+	pthread_cancel(auth_manager);
+	for (u8 i = 0; i < auth_verifier_count; i++)
+	{
+		pthread_cancel(auth_verifiers[i]);
+	}
+
+	DEBUG("Killing pool manager and workers\n");
+	pthread_cancel(pool_manager);
 	for (u16 i = 0; i < NUM_THREADS; i++)
 	{
-		shutdown(thread_actives[i], SHUT_RDWR);
-		close(thread_actives[i]);
+		if (!__atomic_load_n(&pool_running[i], __ATOMIC_ACQUIRE)) { continue; }
+		pthread_cancel(pool[i]);
+	}
+
+	DEBUG("Closing active connections\n");
+	for (u16 i = 0; i < NUM_SLOTS; i++)
+	{
+		i32 socket = __atomic_load_n(&slot_controls[i].socket, __ATOMIC_RELAXED);
+		if (socket == DEFAULT_SOCKET) { continue; }
+		shutdown(socket, SHUT_RDWR);
+		close(socket);
 	}
 	
-	DEBUG("Closing listener socket\n");
+	DEBUG("Closing listener sockets\n");
 	shutdown(listen_sock, SHUT_RDWR);
 	close(listen_sock);
+	if (local_sock != DEFAULT_SOCKET)
+	{
+		close(local_sock);
+		unlink((char*) local_path);
+	}
 
 	DEBUG("Killing idle polling manager\n");
 	pthread_cancel(idle_manager);
 
 	DEBUG("Closing idle connections\n");
-	for (u16 i = 0; i <= queue.batch_idx; i++)
+	for (u8 s = 0; s < shard_count; s++)
 	{
-		for (u16 j = 0; j < QUEUE_CLIENT_BUFFER_LEN; j++)
+		for (u8 c = 0; c < QUEUE_CLASSES; c++)
 		{
-			if (queue.client_batch[i][j] != DEFAULT_SOCKET)
+			for (i32 socket = shards[s].queue.classes[c].head; socket != DEFAULT_SOCKET; socket = queue_nodes[socket].next)
 			{
-				shutdown(queue.client_batch[i][j], SHUT_RDWR);
-				close(queue.client_batch[i][j]);
+				shutdown(socket, SHUT_RDWR);
+				close(socket);
 			}
 		}
-		free(queue.client_batch[i]);
 	}
 
 	// exit
@@ -1188,229 +2769,5188 @@ void exit_handle()
 }
 
 // queue handling
-void queue_init()
+void queue_init(Shard* shard)
 {
-	#define q queue
+	#define q shard->queue
 
-	q.idx = 0;
-	q.batch_idx = 0;
-	q.client_batch[q.batch_idx] = malloc(sizeof(i32) * QUEUE_CLIENT_BUFFER_LEN);
-	for (u16 i = 0; i < QUEUE_CLIENT_BUFFER_LEN; i++)
+	for (u8 c = 0; c < QUEUE_CLASSES; c++)
 	{
-		q.client_batch[q.batch_idx][i] = DEFAULT_SOCKET;
+		q.classes[c].head   = DEFAULT_SOCKET;
+		q.classes[c].tail   = DEFAULT_SOCKET;
+		q.classes[c].length = 0;
+		q.classes[c].ticket = 0;
+		q.classes[c].credit = 0;
 	}
+	q.length     = 0;
+	q.popped     = 0;
+	q.drained    = 0;
+	q.throughput = 0;
+	q.backlogged = 0;
+	clock_gettime(CLOCK_MONOTONIC, &q.ticked);
 
 	#undef q
 }
 
-void queue_push(i32 socket)
+void queue_load()
 {
-	#define q queue
-
-	pthread_mutex_lock(&queue_mutex);
+	queue_weights[QUEUE_CLASS_RESUME]    = QUEUE_WEIGHT_RESUME;
+	queue_weights[QUEUE_CLASS_PREMIUM]   = QUEUE_WEIGHT_PREMIUM;
+	queue_weights[QUEUE_CLASS_ANONYMOUS] = QUEUE_WEIGHT_ANONYMOUS;
 
-	// if queue is full, nop
-	if (q.batch_idx == (QUEUE_BUFFERS - 1) && q.idx == (QUEUE_CLIENT_BUFFER_LEN))
+	// optional overrides, one "class weight" pair per line
+	FILE* file = fopen(QUEUE_FILE, "r");
+	if (file)
 	{
-		pthread_mutex_unlock(&queue_mutex);
-		return;
+		char name[32];
+		u32  value;
+		while (fscanf(file, "%31s %u", name, &value) == 2)
+		{
+			if      (!strcmp(name, "resume"))    { queue_weights[QUEUE_CLASS_RESUME]    = value; }
+			else if (!strcmp(name, "premium"))   { queue_weights[QUEUE_CLASS_PREMIUM]   = value; }
+			else if (!strcmp(name, "anonymous")) { queue_weights[QUEUE_CLASS_ANONYMOUS] = value; }
+			else { WARN("Unknown queue parameter: %s\n", name); }
+		}
+		fclose(file);
 	}
-
-	// push
-	q.client_batch[q.batch_idx][q.idx] = socket;
-	q.idx++;
-	if (q.idx == QUEUE_CLIENT_BUFFER_LEN && q.batch_idx + 1 < QUEUE_BUFFERS)
+	for (u8 c = 0; c < QUEUE_CLASSES; c++)
 	{
-		q.idx = 0;
-		q.batch_idx++;
-		q.client_batch[q.batch_idx] = malloc(sizeof(i32) * QUEUE_CLIENT_BUFFER_LEN);
-		for (u16 i = 0; i < QUEUE_CLIENT_BUFFER_LEN; i++)
+		if (queue_weights[c] == 0 || queue_weights[c] > 1000)
 		{
-			q.client_batch[q.batch_idx][i] = DEFAULT_SOCKET;
+			// a class that is never served would hold its clients forever
+			WARN("Queue weights have to be between 1 and 1000\n");
+			queue_weights[c] = 1;
 		}
-	} 
+	}
+}
 
-	pthread_mutex_unlock(&queue_mutex);
+u8 queue_push(Shard* shard, i32 socket, u8 class)
+{
+	pthread_mutex_lock(&shard->lock);
 
-	#undef q
+	// if queue is full, the caller turns the connection away
+	if (shard->queue.length >= QUEUE_CAPACITY || socket < 0 || socket >= QUEUE_SOCKETS)
+	{
+		pthread_mutex_unlock(&shard->lock);
+		return 0;
+	}
+
+	queue_nodes[socket].checked = 0;
+	queue_nodes[socket].check   = 0;
+	queue_link(shard, socket, class, 0);
+	shard->accepted++;
+
+	pthread_mutex_unlock(&shard->lock);
+	return 1;
+}
+
+void queue_requeue(Shard* shard, i32 socket)
+{
+	// straight back to the head of its class, it keeps the ticket it was popped with
+	pthread_mutex_lock(&shard->lock);
+	queue_link(shard, socket, queue_nodes[socket].class, 1);
+	shard->queue.popped--;
+	queue_served[queue_nodes[socket].class]--;
+	pthread_mutex_unlock(&shard->lock);
 }
 
-i32 queue_pop()
+i32 queue_pop(Shard* shard)
 {
-	#define q queue
+	#define q shard->queue
 
-	pthread_mutex_lock(&queue_mutex);
+	pthread_mutex_lock(&shard->lock);
 
 	// if queue is empty, return default
-	if (q.batch_idx == 0 && q.idx == 0)
+	if (q.length == 0)
 	{
-		pthread_mutex_unlock(&queue_mutex);
+		pthread_mutex_unlock(&shard->lock);
 		return DEFAULT_SOCKET;
 	}
 
-	// pop
-	i32 ret_val = q.client_batch[0][0]; 
-	for (u8 i = 0; i <= q.batch_idx; i++)
+	// smooth weighted round robin, every class with clients earns its weight and the richest is served
+	i32 total = 0;
+	u8  best  = QUEUE_CLASSES;
+	for (u8 c = 0; c < QUEUE_CLASSES; c++)
 	{
-		for (u16 j = 0; j < (QUEUE_CLIENT_BUFFER_LEN - 1); j++)
-		{
-			if (q.client_batch[i][j] == DEFAULT_SOCKET) { break; }
-			q.client_batch[i][j] = q.client_batch[i][j+1];
-		}
-		if (i != q.batch_idx)
-		{
-			q.client_batch[i][(QUEUE_CLIENT_BUFFER_LEN - 1)] = q.client_batch[i+1][0];
-		}
+		if (q.classes[c].length == 0) { continue; }
+		q.classes[c].credit += queue_weights[c];
+		total               += queue_weights[c];
+		if (best == QUEUE_CLASSES || q.classes[c].credit > q.classes[best].credit) { best = c; }
 	}
+	q.classes[best].credit -= total;
+
+	i32 ret_val = q.classes[best].head;
+	queue_unlink(shard, ret_val);
+	q.popped++;
+	queue_served[best]++;
+
+	pthread_mutex_unlock(&shard->lock);
+	return ret_val;
 
-	q.client_batch[q.batch_idx][q.idx] = DEFAULT_SOCKET;
+	#undef q
+}
+
+void queue_link(Shard* shard, i32 socket, u8 class, u8 front)
+{
+	// the caller holds the shard lock
+	QueueClass* list = &shard->queue.classes[class];
+	QueueNode*  node = &queue_nodes[socket];
+	node->class  = class;
+	node->queued = 1;
+	if (front)
+	{
+		node->prev = DEFAULT_SOCKET;
+		node->next = list->head;
+		if (list->head != DEFAULT_SOCKET) { queue_nodes[list->head].prev = socket; }
+		else                              { list->tail = socket; }
+		list->head = socket;
+	}
+	else
+	{
+		node->ticket = list->ticket++;
+		node->prev   = list->tail;
+		node->next   = DEFAULT_SOCKET;
+		if (list->tail != DEFAULT_SOCKET) { queue_nodes[list->tail].next = socket; }
+		else                              { list->head = socket; }
+		list->tail = socket;
+	}
+	list->length++;
+	shard->queue.length++;
+}
 
-	// decrement + deallocate batch if needed 
-	if (q.idx == 0)
+void queue_unlink(Shard* shard, i32 socket)
+{
+	// the caller holds the shard lock
+	QueueNode*  node = &queue_nodes[socket];
+	QueueClass* list = &shard->queue.classes[node->class];
+	if (!node->queued) { return; }
+	if (node->prev != DEFAULT_SOCKET) { queue_nodes[node->prev].next = node->next; }
+	else                              { list->head = node->next; }
+	if (node->next != DEFAULT_SOCKET) { queue_nodes[node->next].prev = node->prev; }
+	else                              { list->tail = node->prev; }
+	if (--list->length == 0)
 	{
-		free(q.client_batch[q.batch_idx]);
-		q.batch_idx--;
-		q.idx = QUEUE_CLIENT_BUFFER_LEN - 1;
+		// an empty class doesn't bank credit for when it comes back
+		list->credit = 0;
 	}
-	else 
+	shard->queue.length--;
+	node->queued = 0;
+}
+
+u8 queue_class(i32 socket)
+{
+	return socket >= 0 && socket < QUEUE_SOCKETS ? queue_nodes[socket].class : QUEUE_CLASS_ANONYMOUS;
+}
+
+u8 queue_classify(i32 socket)
+{
+	// only peeked, the session reads the frame as usual once it is served
+	u8 frame[DEFAULT_MSG_LEN];
+	i64 length = recv(socket, frame, DEFAULT_MSG_LEN, MSG_PEEK | MSG_DONTWAIT);
+	if (length < 1) { return QUEUE_CLASS_ANONYMOUS; }
+
+	// a token only counts once it matches a detached session, a made up one waits like anyone else
+	if (length >= LEN_TYPE_RESUME + SESSION_TOKEN_LEN && !memcmp(frame, MESSAGE_TYPE_RESUME, LEN_TYPE_RESUME) &&
+		session_known(frame + LEN_TYPE_RESUME))
 	{
-		q.idx--;
+		return QUEUE_CLASS_RESUME;
 	}
-	
-	pthread_mutex_unlock(&queue_mutex);
-	return ret_val;
+	return QUEUE_CLASS_ANONYMOUS;
+}
+
+u8 queue_check(i32 socket)
+{
+	// premium takes the password, the verifiers check it without claiming the account and a later tick
+	// promotes the client, a wrong one or a full table leaves it where it is
+	QueueNode* node = &queue_nodes[socket];
+	if (node->check)
+	{
+		QueueCheck* check = &queue_checks[node->check - 1];
+		u8 status = __atomic_load_n(&check->job.status, __ATOMIC_ACQUIRE);
+		if (status == AUTH_PENDING) { return QUEUE_CLASS_ANONYMOUS; }
+		node->check = 0;
+		check->busy = 0;
+		return status == AUTH_SUCC ? QUEUE_CLASS_PREMIUM : QUEUE_CLASS_ANONYMOUS;
+	}
+	if (node->checked) { return QUEUE_CLASS_ANONYMOUS; }
+
+	// only peeked, the session reads the frame as usual once it is served
+	u8  frame[DEFAULT_MSG_LEN];
+	u8  username[DEFAULT_NAME_LENGTH] = {0};
+	u8  password[DEFAULT_NAME_LENGTH] = {0};
+	u8* cursor = frame;
+	i64 length = recv(socket, frame, DEFAULT_MSG_LEN, MSG_PEEK | MSG_DONTWAIT);
+	if (length < DEFAULT_MSG_LEN) { return QUEUE_CLASS_ANONYMOUS; }
+	frame[DEFAULT_MSG_LEN - 1] = END_OF_TRANSMISSION;
+	node->checked = 1;
+	if (!parse_header(&cursor, MESSAGE_TYPE_LOGIN, LEN_TYPE_LOGIN) ||
+		!parse_field(&cursor, username, MESSAGE_DATA_USERNAME, LEN_DATA_USERNAME, DEFAULT_NAME_LENGTH - 1) ||
+		!parse_field(&cursor, password, MESSAGE_DATA_PASSWORD, LEN_DATA_PASSWORD, DEFAULT_NAME_LENGTH - 1) ||
+		!auth_premium(username))
+	{
+		return QUEUE_CLASS_ANONYMOUS;
+	}
+
+	u16 slot = 0;
+	for (; slot < QUEUE_CHECKS && queue_checks[slot].busy; slot++);
+	if (slot == QUEUE_CHECKS)
+	{
+		// tried again next tick
+		node->checked = 0;
+		return QUEUE_CLASS_ANONYMOUS;
+	}
+	QueueCheck* check = &queue_checks[slot];
+	memcpy(check->job.username, username, DEFAULT_NAME_LENGTH);
+	memcpy(check->job.password, password, DEFAULT_NAME_LENGTH);
+	check->job.owner  = DEFAULT_SOCKET;
+	check->job.event  = DEFAULT_SOCKET;
+	check->job.source = auth_source(socket);
+	check->job.status = AUTH_PENDING;
+	check->socket     = socket;
+	check->busy       = 1;
+	node->check       = slot + 1;
+	auth_submit(&check->job);
+	return QUEUE_CLASS_ANONYMOUS;
+}
+
+void queue_check_sweep()
+{
+	// checks whose client was served or dropped before the answer came, only the idle thread touches the table
+	for (u16 slot = 0; slot < QUEUE_CHECKS; slot++)
+	{
+		QueueCheck* check = &queue_checks[slot];
+		QueueNode*  node  = &queue_nodes[check->socket];
+		if (!check->busy || __atomic_load_n(&check->job.status, __ATOMIC_ACQUIRE) == AUTH_PENDING) { continue; }
+		if (node->check == slot + 1 && node->queued) { continue; }
+		if (node->check == slot + 1) { node->check = 0; }
+		check->busy = 0;
+	}
+}
+
+u32 queue_position(Shard* shard, i32 socket)
+{
+	// the caller holds the shard lock, tickets only go up within a class so the distance to the head is the count,
+	// anyone who left from the middle is still in it until the head passes them
+	QueueNode* node = &queue_nodes[socket];
+	return node->ticket - queue_nodes[shard->queue.classes[node->class].head].ticket;
+}
+
+u32 queue_estimate(Shard* shard, i32 socket, u32 position)
+{
+	// the caller holds the shard lock, the class gets its weighted share of however fast the shard drains
+	#define q shard->queue
+
+	QueueNode* node  = &queue_nodes[socket];
+	u64 total = 0;
+	for (u8 c = 0; c < QUEUE_CLASSES; c++)
+	{
+		if (q.classes[c].length) { total += queue_weights[c]; }
+	}
+
+	// measured while there was a backlog, or else what the slots turn over at the average session length
+	u64 rate    = q.throughput;
+	u64 service = __atomic_load_n(&pool_service, __ATOMIC_RELAXED);
+	if (!rate && service)
+	{
+		rate = (u64) shard->workers * SESSION_COROUTINES * 1000000000ull / service;
+	}
+	if (!rate || !total) { return 0; }
+
+	u64 wait = ((u64) position + 1) * 1000000 * total / (rate * queue_weights[node->class]);
+	return wait > UINT32_MAX ? UINT32_MAX : wait;
 
 	#undef q
 }
 
-// authentication
-void auth_init()
+void queue_tick(Shard* shard)
 {
-	// zero out object
-	for(u16 i = 0; i < DEFAULT_NUM_ACCOUNTS; i++)
+	// the caller holds the shard lock, a second with clients waiting throughout says how fast they go
+	#define q shard->queue
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	u64 millis = (now.tv_sec - q.ticked.tv_sec) * 1000 + (now.tv_nsec - q.ticked.tv_nsec) / 1000000;
+	if (millis == 0) { return; }
+	if (q.backlogged && q.length)
 	{
-		for(u16 j = 0; j < DEFAULT_NAME_LENGTH; j++)
-		{
-			database.usernames[i][j] = 0;
-			database.passwords[i][j] = 0;
-		}
-		database.in_use[i] = 0;
+		u64 rate = (q.popped - q.drained) * 1000000 / millis;
+		q.throughput = q.throughput ? q.throughput - (q.throughput + 7) / 8 + rate / 8 : rate;
 	}
+	q.drained    = q.popped;
+	q.backlogged = q.length != 0;
+	q.ticked     = now;
 
-	// read file
-	u8* line;
-    size_t len = 0;
-    ssize_t read;
+	#undef q
+}
 
-    FILE* auth_file = fopen(AUTH_FILE, "r");
-    if (!auth_file) { WARN("Unable to open " AUTH_FILE "\n"); return; }
+u64 queue_length(Shard* shard)
+{
+	pthread_mutex_lock(&shard->lock);
+	u64 length = shard->queue.length;
+	pthread_mutex_unlock(&shard->lock);
+	return length;
+}
 
-	// skip first line (header names)
-	getline((char**) &line, &len, auth_file);
+void queue_metrics()
+{
+	u64 throughput = 0;
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		pthread_mutex_lock(&shards[s].lock);
+		throughput += shards[s].queue.throughput;
+		pthread_mutex_unlock(&shards[s].lock);
+	}
+	LOG("Queue:    %llu returning, %llu premium and %llu anonymous served, %.2f sessions per second\n",
+		(unsigned long long) __atomic_load_n(&queue_served[QUEUE_CLASS_RESUME], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&queue_served[QUEUE_CLASS_PREMIUM], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&queue_served[QUEUE_CLASS_ANONYMOUS], __ATOMIC_RELAXED),
+		throughput / 1000.0);
+}
 
-	// parse remaining lines
-	u16 username_end = 0;
-	u16 counter      = 0;
-    while ((read = getline((char**) &line, &len, auth_file)) != -1) 
+// admission
+void admission_load()
+{
+	admission_params.depth  = ADMISSION_DEPTH;
+	admission_params.wait   = ADMISSION_WAIT;
+	admission_params.retry  = ADMISSION_RETRY;
+	admission_params.jitter = ADMISSION_JITTER;
+
+	// optional overrides, one "name value" pair per line, times in milliseconds and the jitter in percent
+	FILE* file = fopen(ADMISSION_FILE, "r");
+	if (file)
 	{
-		for(u16 i = 0; i < len; i++)
+		char name[32];
+		u32  value;
+		while (fscanf(file, "%31s %u", name, &value) == 2)
 		{
-			// username
-			if(line[i] == ' ' || line[i] == '\t')
-			{
-				username_end = i + 1;
-				if(i != 0 && line[i - 1] != ' ' && line[i - 1] != '\t')
-				{
-					for (u16 j = 0; j < i; j++)
-					{
-						database.usernames[counter][j] = line[j];
-					}
-				}
-			}
-
-			// password
-			if (line[i] == '\n' || line[i] == '\r' || i == len - 1)
-			{
-				for (u16 j = username_end; j < i; j++)
-				{
-					database.passwords[counter][j - username_end] = line[j];
-				}
-				username_end = 0;
-				counter++;
-				break;
-			}
+			if      (!strcmp(name, "depth"))  { admission_params.depth  = value; }
+			else if (!strcmp(name, "wait"))   { admission_params.wait   = value; }
+			else if (!strcmp(name, "retry"))  { admission_params.retry  = value; }
+			else if (!strcmp(name, "jitter")) { admission_params.jitter = value; }
+			else { WARN("Unknown admission parameter: %s\n", name); }
 		}
-    }
+		fclose(file);
+	}
+	if (admission_params.jitter > 100)
+	{
+		WARN("Admission jitter has to be at most 100 percent\n");
+		admission_params.jitter = ADMISSION_JITTER;
+	}
+	if (getrandom(&admission_seed, sizeof(admission_seed), 0) != sizeof(admission_seed) || !admission_seed)
+	{
+		admission_seed = (u32) time(0) | 1;
+	}
+}
+
+u8 admission_admit(Shard* shard, i32 socket)
+{
+	u8 class  = queue_classify(socket);
+	u8 reason = admission_check(class);
+	if (reason == REJECT_REASONS && queue_push(shard, socket, class))
+	{
+		__atomic_add_fetch(&admission_admitted, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+	admission_reject(socket, reason == REJECT_REASONS ? REJECT_FULL : reason);
+	return 0;
+}
 
-	free(line);
+u8 admission_check(u8 class)
+{
+	// the queue bounds descriptors and the idle thread's work, the wait only counts once the pool can't grow,
+	// a live resume is served first so the wait doesn't apply to it, the depth does to everyone
+	u64 waiting = 0;
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		waiting += queue_length(&shards[s]);
+	}
+	if (waiting >= admission_params.depth)
+	{
+		return REJECT_DEPTH;
+	}
+	if (class != QUEUE_CLASS_RESUME && __atomic_load_n(&pool_size, __ATOMIC_RELAXED) >= pool_params.max && 
+		__atomic_load_n(&pool_wait, __ATOMIC_RELAXED) >= admission_params.wait)
+	{
+		return REJECT_WAIT;
+	}
+	return REJECT_REASONS;
+}
+
+void admission_reject(i32 socket, u8 reason)
+{
+	// at least as long as the queue is expected to take, spread so the clients don't all come back together
+	u64 retry = admission_params.retry;
+	u64 wait  = __atomic_load_n(&pool_wait, __ATOMIC_RELAXED);
+	if (reason == REJECT_WAIT && wait > retry)
+	{
+		retry = wait;
+	}
+	retry = retry > ADMISSION_RETRY_MAX ? ADMISSION_RETRY_MAX : retry;
+	u64 spread = retry * admission_params.jitter / 100;
+	admission_seed ^= admission_seed << 13;
+	admission_seed ^= admission_seed >> 17;
+	admission_seed ^= admission_seed << 5;
+	retry = retry - spread + admission_seed % (2 * spread + 1);
+
+	u8 frame[DEFAULT_MSG_LEN] = {0};
+	for (u16 i = 0; i < LEN_TYPE_REJECT; i++)
+	{
+		frame[i] = MESSAGE_TYPE_REJECT[i];
+	}
+	frame[LEN_TYPE_REJECT] = reason;
+	write_u32(frame + LEN_TYPE_REJECT + 1, retry);
+	frame[LEN_TYPE_REJECT + 5] = END_OF_TRANSMISSION;
+	send(socket, frame, DEFAULT_MSG_LEN, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+	// closing over unread data would reset the connection and could take the frame with it
+	u8 discard[DEFAULT_MSG_LEN];
+	for (u8 i = 0; i < ADMISSION_DISCARD && recv(socket, discard, DEFAULT_MSG_LEN, MSG_DONTWAIT) > 0; i++);
+	DEBUG("Rejected %d, retry after %llu ms\n", socket, (unsigned long long) retry);
+	__atomic_add_fetch(&admission_rejects[reason], 1, __ATOMIC_RELAXED);
+	close(socket);
+}
+
+void admission_metrics()
+{
+	LOG("Admission: %llu admitted, %llu turned away for depth, %llu for wait, %llu with the queue full\n",
+		(unsigned long long) __atomic_load_n(&admission_admitted, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&admission_rejects[REJECT_DEPTH], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&admission_rejects[REJECT_WAIT], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&admission_rejects[REJECT_FULL], __ATOMIC_RELAXED));
 }
 
-u32 auth_check(u8* username, u8* password)
+// shards
+void shard_init(u8 sharded)
 {
-	u32 ret = 0; 
-	for (u16 i = 0; i < DEFAULT_NUM_ACCOUNTS; i++)
+	// one shard per core in sharded mode, otherwise a single one holds every worker
+	i64 cores   = sharded ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	shard_count = cores < 1 ? 1 : cores > pool_params.max ? pool_params.max : cores;
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		queue_init(&shards[s]);
+		pthread_mutex_init(&shards[s].lock, 0);
+		shards[s].core    = sharded ? s : -1;
+		shards[s].workers = 0;
+	}
+
+	// workers are handed out round robin, so every shard needs one from the start
+	if (pool_params.min < shard_count)
 	{
-		// skip empty accounts
-		if (database.usernames[i][0] == 0) { break; } 
+		pool_params.min = shard_count;
+	}
+	if (sharded)
+	{
+		result_event = eventfd(0, 0);
+		LOG("Sharded across %u cores\n", shard_count);
+	}
+}
 
-		for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
+Shard* shard_assign()
+{
+	// the shard with the least waiting or being served for each of its workers
+	Shard* best      = &shards[0];
+	u64    best_load = ~0ull;
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		Shard* shard   = &shards[s];
+		u32    workers = __atomic_load_n(&shard->workers, __ATOMIC_RELAXED);
+		u64    load    = queue_length(shard) + __atomic_load_n(&shard->busy, __ATOMIC_RELAXED);
+		load = load * NUM_THREADS / (workers ? workers : 1);
+		if (load < best_load)
 		{
-			// check username
-			if (database.usernames[i][j] != username[j]) { break; }
-			else if (database.usernames[i][j] == 0) 
-			{
-				// check password
-				for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
-				{
-					if (database.passwords[i][k] != password[k]) 
-					{ 
-						// a cheap way to double break here is to just
-						// manually set the iterators 
-						j = 0;
-						i++;
-						break; 
-					}
-					else if (database.passwords[i][k] == 0) 
-					{
-						pthread_mutex_lock(&auth_mutex);
-						if (!database.in_use[i])
-						{
-							database.in_use[i] = 1;
-							pthread_mutex_unlock(&auth_mutex);
-							ret  = i;
-    						ret |= ((u8) AUTH_SUCC) << 16;
-							return ret;
-						} 
-						else 
-						{
-							pthread_mutex_unlock(&auth_mutex);
-    						ret = ((u8) AUTH_USED) << 16;
-							return ret;
-						}
-					}
-				}
-			}
+			best      = shard;
+			best_load = load;
 		}
 	}
-	ret = ((u8) AUTH_FAIL) << 16;
-	return ret;
+	return best;
 }
 
-// leaderboard
-void leaderboard_init()
+void shard_metrics()
+{
+	if (shard_count == 1) { return; }
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		LOG("Shard %u:  core %d, %u workers, %u busy, %llu connections taken\n", s, shards[s].core, 
+			shards[s].workers, __atomic_load_n(&shards[s].busy, __ATOMIC_RELAXED), 
+			(unsigned long long) shards[s].accepted);
+	}
+}
+
+void result_record(u16 worker, u8 kind, Session* session, struct timespec dt)
+{
+	GameResult result;
+	result.mode  = session->game_mode;
+	result.kind  = kind;
+	result.rated = kind != RESULT_WON || session->in_game;
+	result.dt    = dt;
+	memcpy(result.username, session->username, DEFAULT_NAME_LENGTH);
+
+	// in a cluster the gateway puts every backend's results in one order and hands them to all of them
+	if (cluster_channel != DEFAULT_SOCKET)
+	{
+		u8 record[UPGRADE_RECORD_LEN] = {0};
+		cluster_pack(record, &result);
+		upgrade_send(cluster_channel, record, DEFAULT_SOCKET);
+		return;
+	}
+
+	// sharded workers hand results to the merge thread, their only producer is this worker
+	ResultRing* ring = &result_rings[worker % NUM_THREADS];
+	u32 tail = ring->tail;
+	if (result_event != DEFAULT_SOCKET && worker != RESULT_NO_WORKER && tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < RESULT_RING_LEN)
+	{
+		ring->results[tail % RESULT_RING_LEN] = result;
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		u64 value = 1;
+		write(result_event, &value, sizeof(value));
+		return;
+	}
+
+	// unsharded, not a worker, or the ring is full, the set is updated in place
+	LeaderboardSet* set = registry_acquire(result.mode, 1);
+	pthread_mutex_lock(&set->lock);
+	result_apply(set, &result);
+	pthread_mutex_unlock(&set->lock);
+	registry_release(set);
+}
+
+void result_apply(LeaderboardSet* set, GameResult* result)
 {
-	// zero everything out
-	leaderboard.index = 0;
-	for (u16 i = 0; i < DEFAULT_NUM_ACCOUNTS; i++)
+	// called under the set lock
+	if (result->kind == RESULT_PLAYED)
+	{
+		for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+		{
+			window_played(&set->windows[i], result->username);
+		}
+		rating_spread(set, result->username);
+	}
+	else if (result->kind == RESULT_WON)
 	{
-		leaderboard.seconds	  [i] = 0;
-		leaderboard.nano	  [i] = 0;
-		leaderboard.played	  [i] = 0;
-		leaderboard.won	      [i] = 0;
-		for (u8 j = 0; j < DEFAULT_NAME_LENGTH; j++)
+		if (leaderboard_find(&set->windows[LEADERBOARD_WINDOW_ALL].board, result->username) == LEADERBOARD_NIL)
+		{
+			WARN("Win recorded for a user with no leaderboard entry\n");
+		}
+		for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
 		{
-			leaderboard.usernames[i][j] = 0; 
+			window_won(&set->windows[i], result->username, result->dt);
 		}
+		if (result->rated)
+		{
+			rating_result(set, result->username, 1);
+		}
+	}
+	else
+	{
+		rating_result(set, result->username, 0);
+	}
+}
+
+void* leaderboard_merge_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	while (1)
+	{
+		u64 value;
+		read(result_event, &value, sizeof(value));
+
+		// the only consumer, a run of results for one mode shares a lock
+		for (u16 w = 0; w < NUM_THREADS; w++)
+		{
+			ResultRing*     ring = &result_rings[w];
+			LeaderboardSet* set  = 0;
+			u32 head = ring->head;
+			u32 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++)
+			{
+				GameResult* result = &ring->results[head % RESULT_RING_LEN];
+				if (set && set->mode != result->mode)
+				{
+					pthread_mutex_unlock(&set->lock);
+					registry_release(set);
+					set = 0;
+				}
+				if (!set)
+				{
+					set = registry_acquire(result->mode, 1);
+					pthread_mutex_lock(&set->lock);
+				}
+				result_apply(set, result);
+			}
+			if (set)
+			{
+				pthread_mutex_unlock(&set->lock);
+				registry_release(set);
+			}
+			__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// subscriptions
+void subscription_set(i32 socket, u8 key, u8 window, u64 mode, u32 first, u32 count)
+{
+	#define subs subscriptions
+
+	pthread_mutex_lock(&subscription_mutex);
+
+	// one subscription per client, replaced on each request
+	u32 i = 0;
+	for (; i < subs.count; i++)
+	{
+		if (subs.list[i].socket == socket) { break; }
+	}
+
+	if (!count)
+	{
+		if (i < subs.count)
+		{
+			subs.list[i] = subs.list[subs.count - 1];
+			subs.count--;
+		}
+		pthread_mutex_unlock(&subscription_mutex);
+		return;
+	}
+
+	if (i == subs.count)
+	{
+		if (subs.count == subs.capacity)
+		{
+			subs.capacity = subs.capacity ? subs.capacity * 2 : NUM_THREADS;
+			subs.list     = realloc(subs.list, sizeof(Subscription) * subs.capacity);
+		}
+		subs.count++;
+	}
+
+	subs.list[i].socket = socket;
+	subs.list[i].key    = key;
+	subs.list[i].window = window;
+	subs.list[i].mode   = mode;
+	subs.list[i].first  = first;
+	subs.list[i].count  = count;
+
+	pthread_mutex_unlock(&subscription_mutex);
+
+	#undef subs
+}
+
+void subscription_remove(i32 socket)
+{
+	subscription_set(socket, 0, 0, 0, 0, 0);
+}
+
+u8 subscription_find(i32 socket, Subscription* found)
+{
+	// callers hold the subscription lock
+	for (u32 i = 0; i < subscriptions.count; i++)
+	{
+		if (subscriptions.list[i].socket == socket)
+		{
+			*found = subscriptions.list[i];
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// sessions
+Session* session_new(i32 socket)
+{
+	pthread_mutex_lock(&slab_mutex);
+
+	// sessions come off a free list, the slab only grows a chunk at a time
+	slab.allocations++;
+	if (slab.free)
+	{
+		slab.hits++;
+	}
+	else
+	{
+		Session* chunk = malloc(sizeof(Session) * SESSION_SLAB_CHUNK);
+		for (u32 i = 0; i < SESSION_SLAB_CHUNK; i++)
+		{
+			chunk[i].next = slab.free;
+			slab.free     = &chunk[i];
+		}
+		slab.chunks++;
+	}
+	Session* session = slab.free;
+	slab.free = session->next;
+	slab.in_use++;
+
+	pthread_mutex_unlock(&slab_mutex);
+
+	// everything but the arena block starts zeroed
+	memset(session, 0, offsetof(Session, arena_memory));
+	session->socket         = socket;
+	session->auth_status    = AUTH_FAIL;
+	session->game_mode      = GAME_MODE_DEFAULT;
+	session->arena.memory   = session->arena_memory;
+	session->arena.capacity = SESSION_ARENA_LEN;
+	session->source         = socket == DEFAULT_SOCKET ? 0 : auth_source(socket);
+	for (u8 i = 0; i < THROTTLE_CLASSES; i++)
+	{
+		session->rate[i].tokens = (u64) rate_limits[i].burst * RATE_SCALE;
+		session->rate[i].stamp  = rate_now();
+	}
+	#if DEBUG_MODE
+		strcpy((char*) session->username, "default-player");
+	#endif
+	session_game(session);
+	return session;
+}
+
+void session_free(Session* session)
+{
+	arena_reset(&session->arena);
+	stream_free(session);
+
+	pthread_mutex_lock(&slab_mutex);
+	session->next = slab.free;
+	slab.free     = session;
+	slab.in_use--;
+	pthread_mutex_unlock(&slab_mutex);
+}
+
+void session_game(Session* session)
+{
+	// a stream keeps its board with it, the arena is only for the connection's own game
+	if (session->stream)
+	{
+		session->mines_left = NUM_MINES;
+		memset(session->mine_locations, 0, NUM_MINES);
+		memset(session->game_map, BOARD_UNKNOWN_PAIR, BOARD_PACKED_LEN(NUM_TILES));
+		return;
+	}
+
+	// whatever the last game left in the arena goes in one step
+	arena_reset(&session->arena);
+	session->mines_left     = NUM_MINES;
+	session->mine_locations = arena_alloc(&session->arena, NUM_MINES);
+	session->game_map       = arena_alloc(&session->arena, BOARD_PACKED_LEN(NUM_TILES));
+	memset(session->mine_locations, 0, NUM_MINES);
+	memset(session->game_map, BOARD_UNKNOWN_PAIR, BOARD_PACKED_LEN(NUM_TILES));
+}
+
+void* arena_alloc(SessionArena* arena, u32 size)
+{
+	// bump allocation, anything past the block is chained on and freed at the next reset
+	size = (size + 7) & ~7;
+	if (arena->used + size <= arena->capacity)
+	{
+		void* memory = arena->memory + arena->used;
+		arena->used += size;
+		return memory;
+	}
+
+	ArenaBlock* block = malloc(sizeof(ArenaBlock) + size);
+	block->next     = arena->overflow;
+	block->size     = size;
+	arena->overflow = block;
+	__atomic_add_fetch(&slab.arena_overflows, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&slab.overflow_bytes, size, __ATOMIC_RELAXED);
+	return block + 1;
+}
+
+void arena_reset(SessionArena* arena)
+{
+	while (arena->overflow)
+	{
+		ArenaBlock* block = arena->overflow;
+		arena->overflow   = block->next;
+		__atomic_sub_fetch(&slab.overflow_bytes, block->size, __ATOMIC_RELAXED);
+		free(block);
+	}
+	arena->used = 0;
+	__atomic_add_fetch(&slab.arena_resets, 1, __ATOMIC_RELAXED);
+}
+
+void metrics_signal()
+{
+	metrics_requested = 1;
+}
+
+void session_metrics()
+{
+	pthread_mutex_lock(&slab_mutex);
+	u32 in_use      = slab.in_use;
+	u32 chunks      = slab.chunks;
+	u64 allocations = slab.allocations;
+	u64 hits        = slab.hits;
+	pthread_mutex_unlock(&slab_mutex);
+
+	u64 overflow_bytes = __atomic_load_n(&slab.overflow_bytes, __ATOMIC_RELAXED);
+	LOG("Sessions: %u live, %llu bytes in use, %llu bytes reserved\n", in_use, 
+		(unsigned long long) (in_use * sizeof(Session) + overflow_bytes),
+		(unsigned long long) (chunks * SESSION_SLAB_CHUNK * sizeof(Session)));
+	LOG("Slab:     %llu allocations, %.1f%% from the free list\n", (unsigned long long) allocations, 
+		allocations ? 100.0 * hits / allocations : 0.0);
+	LOG("Arena:    %llu resets, %llu overflows, %llu overflow bytes\n",
+		(unsigned long long) __atomic_load_n(&slab.arena_resets, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&slab.arena_overflows, __ATOMIC_RELAXED),
+		(unsigned long long) overflow_bytes);
+	outbox_metrics();
+	admission_metrics();
+	queue_metrics();
+	stream_metrics();
+	channel_metrics();
+	rate_metrics();
+	shard_metrics();
+	uring_metrics();
+	pool_metrics();
+	cluster_metrics();
+	LOG("Heartbeat: %llu pings sent, %llu unresponsive clients reaped\n",
+		(unsigned long long) __atomic_load_n(&heartbeat_pings, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&heartbeat_reaps, __ATOMIC_RELAXED));
+}
+
+Session* session_adopt()
+{
+	Session* session = 0;
+	pthread_mutex_lock(&upgrade_mutex);
+	if (adopted_count)
+	{
+		session = adopted[--adopted_count];
+	}
+	pthread_mutex_unlock(&upgrade_mutex);
+	return session;
+}
+
+u32 session_serialize(Session* session, u8* record)
+{
+	// everything a session needs in another process, the claim is taken again on arrival
+	u8* cursor = record;
+	memcpy(cursor, session->username, DEFAULT_NAME_LENGTH);				cursor += DEFAULT_NAME_LENGTH;
+	memcpy(cursor, session->token, SESSION_TOKEN_LEN);					cursor += SESSION_TOKEN_LEN;
+	*cursor = session->auth_status;										cursor++;
+	write_u64(cursor, session->game_mode);								cursor += GAME_MODE_LEN;
+	*cursor = session->in_game;											cursor++;
+	*cursor = session->mines_left;										cursor++;
+	*cursor = session->game_map != 0;									cursor++;
+	if (session->game_map)
+	{
+		memcpy(cursor, session->mine_locations, NUM_MINES);
+		memcpy(cursor + NUM_MINES, session->game_map, BOARD_PACKED_LEN(NUM_TILES));
+	}
+	cursor += NUM_MINES + BOARD_PACKED_LEN(NUM_TILES);
+	write_u64(cursor, session->started.tv_sec);							cursor += 8;
+	write_u64(cursor, session->started.tv_nsec);						cursor += 8;
+	return cursor - record;
+}
+
+u32 session_deserialize(Session* session, u8* record)
+{
+	u8* cursor = record;
+	memcpy(session->username, cursor, DEFAULT_NAME_LENGTH);				cursor += DEFAULT_NAME_LENGTH;
+	memcpy(session->token, cursor, SESSION_TOKEN_LEN);					cursor += SESSION_TOKEN_LEN;
+	session->auth_status = *cursor;										cursor++;
+	session->game_mode   = read_u64(cursor);							cursor += GAME_MODE_LEN;
+	if (cursor[2])
+	{
+		session_game(session);
+		memcpy(session->mine_locations, cursor + 3, NUM_MINES);
+		memcpy(session->game_map, cursor + 3 + NUM_MINES, BOARD_PACKED_LEN(NUM_TILES));
+	}
+	session->in_game     = cursor[0];
+	session->mines_left  = cursor[1];
+	cursor += 3 + NUM_MINES + BOARD_PACKED_LEN(NUM_TILES);
+	session->started.tv_sec  = read_u64(cursor);						cursor += 8;
+	session->started.tv_nsec = read_u64(cursor);						cursor += 8;
+	return cursor - record;
+}
+
+// session resumption
+u8 session_token(u8* token)
+{
+	// tokens are the only thing standing in for a password, so they come from the kernel,
+	// without one the token is left blank and the session is never parked
+	if (getrandom(token, SESSION_TOKEN_LEN, 0) != SESSION_TOKEN_LEN)
+	{
+		WARN("Unable to draw a session token\n");
+		memset(token, 0, SESSION_TOKEN_LEN);
+		return 0;
+	}
+
+	// a backend's tokens lead with its index, so the gateway can send a resume back to it
+	if (cluster_channel != DEFAULT_SOCKET)
+	{
+		token[0] = cluster_index;
+	}
+	return 1;
+}
+
+void session_detach(Session* session)
+{
+	// a blank token would let anyone resume it, so the account goes back instead
+	u8 drawn = 0;
+	for (u8 i = 0; i < SESSION_TOKEN_LEN; i++)
+	{
+		drawn |= session->token[i];
+	}
+	if (!drawn)
+	{
+		auth_release(session->authentication_id, session->socket, session->username);
+		session_drop(session);
+		return;
+	}
+
+	Session* evicted = 0;
+
+	pthread_mutex_lock(&session_mutex);
+
+	// take a free slot, or the one closest to expiring when the table is full
+	u32 slot = 0;
+	for (u32 i = 0; i < SESSION_DETACHED_MAX; i++)
+	{
+		if (!sessions[i]) { slot = i; break; }
+		if (sessions[i]->expires.tv_sec < sessions[slot]->expires.tv_sec) { slot = i; }
+	}
+	if (sessions[slot])
+	{
+		evicted = sessions[slot];
+		auth_release(evicted->authentication_id, SESSION_OWNER(slot), evicted->username);
+		sessions[slot] = 0;
+	}
+
+	// the account claim moves from the socket to the slot
+	i32 expected = session->socket;
+	if (__atomic_compare_exchange_n(auth_owner(session->authentication_id), &expected, SESSION_OWNER(slot), 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &session->expires);
+		session->expires.tv_sec += SESSION_TTL;
+		session->socket = DEFAULT_SOCKET;
+		sessions[slot]  = session;
+		session         = 0;
+	}
+
+	pthread_mutex_unlock(&session_mutex);
+
+	if (evicted)
+	{
+		WARN("Detached session table full, dropping the oldest\n");
+		session_drop(evicted);
+	}
+	if (session) { session_drop(session); }
+}
+
+Session* session_resume(u8* token, i32 socket)
+{
+	pthread_mutex_lock(&session_mutex);
+
+	u32 slot = session_find(token);
+	if (slot == SESSION_DETACHED_MAX)
+	{
+		pthread_mutex_unlock(&session_mutex);
+		return 0;
+	}
+
+	// hand the claim to the new socket, the slot is free again
+	Session* session = sessions[slot];
+	i32 expected     = SESSION_OWNER(slot);
+	__atomic_compare_exchange_n(auth_owner(session->authentication_id), &expected, socket, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	session->socket = socket;
+	session->source = auth_source(socket);
+	sessions[slot]  = 0;
+
+	pthread_mutex_unlock(&session_mutex);
+	return session;
+}
+
+u8 session_known(u8* token)
+{
+	// the queue only looks, the session is still taken by the worker that serves the resume
+	pthread_mutex_lock(&session_mutex);
+	u8 known = session_find(token) != SESSION_DETACHED_MAX;
+	pthread_mutex_unlock(&session_mutex);
+	return known;
+}
+
+u32 session_find(u8* token)
+{
+	// the caller holds the session mutex
+	u32 slot = 0;
+	for (; slot < SESSION_DETACHED_MAX; slot++)
+	{
+		if (sessions[slot] && auth_compare(sessions[slot]->token, token, SESSION_TOKEN_LEN)) { break; }
+	}
+	return slot;
+}
+
+u8 session_take(u32 id, i32 marker, i32 owner)
+{
+	// a fresh login with the password wins over a detached session of the same account
+	u32 slot = DEFAULT_SOCKET - 1 - marker;
+	if (slot >= SESSION_DETACHED_MAX) { return 0; }
+
+	Session* taken = 0;
+	pthread_mutex_lock(&session_mutex);
+	i32 expected = marker;
+	if (sessions[slot] && sessions[slot]->authentication_id == id &&
+		__atomic_compare_exchange_n(auth_owner(id), &expected, owner, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		taken          = sessions[slot];
+		sessions[slot] = 0;
+	}
+	pthread_mutex_unlock(&session_mutex);
+
+	if (taken) { session_drop(taken); }
+	return taken != 0;
+}
+
+void session_expire()
+{
+	Session* expired[SESSION_DETACHED_MAX];
+	u32 expired_count = 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&session_mutex);
+	for (u32 slot = 0; slot < SESSION_DETACHED_MAX; slot++)
+	{
+		if (sessions[slot] && sessions[slot]->expires.tv_sec <= now.tv_sec)
+		{
+			auth_release(sessions[slot]->authentication_id, SESSION_OWNER(slot), sessions[slot]->username);
+			expired[expired_count++] = sessions[slot];
+			sessions[slot] = 0;
+		}
+	}
+	pthread_mutex_unlock(&session_mutex);
+
+	// ratings take their own locks, so losses are recorded outside the table
+	for (u32 i = 0; i < expired_count; i++)
+	{
+		session_drop(expired[i]);
+	}
+}
+
+void session_drop(Session* session)
+{
+	// a game nobody came back to counts as a loss, recorded like any other so the cluster and the merge thread see it
+	struct timespec dt = {0};
+	if (session->in_game)
+	{
+		result_record(RESULT_NO_WORKER, RESULT_LOST, session, dt);
+	}
+	for (u32 i = 0; session->streams && i < STREAM_MAX; i++)
+	{
+		if (session->streams[i] && session->streams[i]->in_game)
+		{
+			stream_enter(session, session->streams[i]);
+			result_record(RESULT_NO_WORKER, RESULT_LOST, session, dt);
+			stream_leave(session);
+		}
+	}
+	LOG("Detached session dropped: %s\n", session->username);
+	session_free(session);
+}
+
+// streams
+Stream* stream_open(Session* session, u16 id)
+{
+	// the table only exists once a connection uses streams, each game is allocated the first time it starts
+	if (!session->streams)
+	{
+		session->streams = calloc(STREAM_MAX, sizeof(Stream*));
+	}
+	if (!session->streams[id])
+	{
+		Stream* stream = calloc(1, sizeof(Stream));
+		stream->id             = id;
+		stream->game_mode      = GAME_MODE_DEFAULT;
+		stream->mines_left     = NUM_MINES;
+		stream->mine_locations = stream->mines;
+		stream->game_map       = stream->map;
+		stream->rate.tokens    = (u64) rate_limits[THROTTLE_GAME].burst * RATE_SCALE;
+		stream->rate.stamp     = rate_now();
+		memset(stream->map, BOARD_UNKNOWN_PAIR, BOARD_PACKED_LEN(NUM_TILES));
+		session->streams[id] = stream;
+		__atomic_add_fetch(&stream_opened, 1, __ATOMIC_RELAXED);
+	}
+	return session->streams[id];
+}
+
+Stream* stream_find(Session* session, u16 id)
+{
+	return session->streams ? session->streams[id] : 0;
+}
+
+void stream_enter(Session* session, Stream* stream)
+{
+	// the game handlers work on the session's fields, so the stream's game takes their place for one frame
+	stream_swap(session, stream);
+	session->stream = stream;
+}
+
+void stream_leave(Session* session)
+{
+	if (session->stream)
+	{
+		stream_swap(session, session->stream);
+		session->stream = 0;
+	}
+}
+
+void stream_swap(Session* session, Stream* stream)
+{
+	#define swap(a, b) { __typeof__(a) t = a; a = b; b = t; }
+
+	swap(session->game_mode,           stream->game_mode);
+	swap(session->in_game,             stream->in_game);
+	swap(session->mines_left,          stream->mines_left);
+	swap(session->mine_locations,      stream->mine_locations);
+	swap(session->game_map,            stream->game_map);
+	swap(session->started,             stream->started);
+	swap(session->rate[THROTTLE_GAME], stream->rate);
+
+	#undef swap
+}
+
+i32 stream_send(i32 socket, u16 id, u8* frame)
+{
+	// the reply goes back behind the same header, frames are short enough that nothing is cut off
+	u8 wrapped[DEFAULT_MSG_LEN];
+	for (u16 i = 0; i < LEN_TYPE_STREAM; i++)
+	{
+		wrapped[i] = MESSAGE_TYPE_STREAM[i];
+	}
+	wrapped[LEN_TYPE_STREAM]     = id >> 8;
+	wrapped[LEN_TYPE_STREAM + 1] = id;
+	memcpy(wrapped + STREAM_HEADER, frame, DEFAULT_MSG_LEN - STREAM_HEADER);
+	return outbox_send(socket, wrapped, OUTBOX_FRAME);
+}
+
+i32 session_send(Session* session, i32 socket, u8* frame)
+{
+	// a game reply goes back on the stream its frame came in on
+	if (session->stream)
+	{
+		return stream_send(socket, session->stream->id, frame);
+	}
+	return outbox_send(socket, frame, OUTBOX_FRAME);
+}
+
+void stream_free(Session* session)
+{
+	if (!session->streams) { return; }
+	for (u32 i = 0; i < STREAM_MAX; i++)
+	{
+		free(session->streams[i]);
+	}
+	free(session->streams);
+	session->streams = 0;
+}
+
+void stream_metrics()
+{
+	LOG("Streams:  %llu opened, %llu frames\n",
+		(unsigned long long) __atomic_load_n(&stream_opened, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&stream_frames, __ATOMIC_RELAXED));
+}
+
+// heartbeats
+void heartbeat_load()
+{
+	heartbeat_params.idle  = HEARTBEAT_IDLE;
+	heartbeat_params.game  = HEARTBEAT_GAME;
+	heartbeat_params.grace = HEARTBEAT_GRACE;
+
+	// optional overrides in seconds, one "name value" pair per line
+	FILE* file = fopen(HEARTBEAT_FILE, "r");
+	if (file)
+	{
+		char name[32];
+		u32  value;
+		while (fscanf(file, "%31s %u", name, &value) == 2)
+		{
+			if (!value) { WARN("Heartbeat timeouts can't be zero: %s\n", name); }
+			else if (!strcmp(name, "idle"))  { heartbeat_params.idle  = value; }
+			else if (!strcmp(name, "game"))  { heartbeat_params.game  = value; }
+			else if (!strcmp(name, "grace")) { heartbeat_params.grace = value; }
+			else { WARN("Unknown heartbeat parameter: %s\n", name); }
+		}
+		fclose(file);
+	}
+}
+
+void heartbeat_arm(struct timespec* due, u32 seconds)
+{
+	// one shot, zero disarms it
+	due->tv_sec  = 0;
+	due->tv_nsec = 0;
+	if (seconds)
+	{
+		clock_gettime(CLOCK_MONOTONIC, due);
+		due->tv_sec += seconds;
+	}
+}
+
+i32 heartbeat_left(struct timespec* due)
+{
+	// milliseconds until it is due, zero once it is and -1 while disarmed
+	if (!due->tv_sec) { return -1; }
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	i64 left = (due->tv_sec - now.tv_sec) * 1000 + (due->tv_nsec - now.tv_nsec) / 1000000;
+	return left < 0 ? 0 : left;
+}
+
+// rate limiting
+u8 rate_class(u8 header)
+{
+	if (header == MESSAGE_TYPE_START[0] || header == MESSAGE_TYPE_STOP[0] ||
+		header == MESSAGE_TYPE_REV[0]   || header == MESSAGE_TYPE_FLAG[0])
+	{
+		return THROTTLE_GAME;
+	}
+	if (header == MESSAGE_TYPE_LEAD_P[0] || header == MESSAGE_TYPE_LEAD_Q[0] || header == MESSAGE_TYPE_SUB[0])
+	{
+		return THROTTLE_LEAD;
+	}
+	if (header == MESSAGE_TYPE_LOGIN[0] || header == MESSAGE_TYPE_RESUME[0])
+	{
+		return THROTTLE_LOGIN;
+	}
+	return THROTTLE_CLASSES;
+}
+
+u16 rate_check(Session* session, u8 class)
+{
+	// the connection's own bucket needs no lock, only its worker touches it
+	u64 now   = rate_now();
+	u16 retry = rate_take(&session->rate[class], class, 1, now);
+	if (!retry)
+	{
+		// sources share a table, each group of slots sits under one stripe
+		u32 group = (session->source * 2654435761u) % (RATE_SOURCES / RATE_PROBE);
+		pthread_mutex_t* lock = &rate_mutexes[group % RATE_STRIPES];
+		pthread_mutex_lock(lock);
+
+		RateSource* entry = 0;
+		RateSource* stale = &rate_sources[group * RATE_PROBE];
+		for (u32 i = group * RATE_PROBE; i < (group + 1) * RATE_PROBE; i++)
+		{
+			RateSource* candidate = &rate_sources[i];
+			if (candidate->used && candidate->source == session->source)
+			{
+				entry = candidate;
+				break;
+			}
+			if (!candidate->used || (stale->used && candidate->buckets[class].stamp < stale->buckets[class].stamp))
+			{
+				stale = candidate;
+			}
+		}
+
+		// the least recently seen source gives up its slot, it comes back with full buckets
+		if (!entry)
+		{
+			entry         = stale;
+			entry->used   = 1;
+			entry->source = session->source;
+			for (u8 i = 0; i < THROTTLE_CLASSES; i++)
+			{
+				entry->buckets[i].tokens = (u64) rate_limits[i].burst * RATE_SOURCE_FACTOR * RATE_SCALE;
+				entry->buckets[i].stamp  = now;
+			}
+		}
+		retry = rate_take(&entry->buckets[class], class, RATE_SOURCE_FACTOR, now);
+		pthread_mutex_unlock(lock);
+
+		// the connection keeps its token when the source is the one out of budget
+		if (retry)
+		{
+			session->rate[class].tokens += RATE_SCALE;
+		}
+	}
+
+	if (retry)
+	{
+		__atomic_add_fetch(&rate_throttled[class], 1, __ATOMIC_RELAXED);
+	}
+	return retry;
+}
+
+u16 rate_take(RateBucket* bucket, u8 class, u32 factor, u64 now)
+{
+	// refilled lazily from the time since the last take, a token is RATE_SCALE units
+	u64 per_ms   = (u64) rate_limits[class].per_second * factor;
+	u64 capacity = (u64) rate_limits[class].burst * factor * RATE_SCALE;
+	u64 tokens   = bucket->tokens + (now - bucket->stamp) * per_ms;
+	if (tokens > capacity) { tokens = capacity; }
+	bucket->stamp = now;
+
+	if (tokens >= RATE_SCALE)
+	{
+		bucket->tokens = tokens - RATE_SCALE;
+		return 0;
+	}
+
+	// milliseconds until the next whole token
+	bucket->tokens = tokens;
+	return (RATE_SCALE - tokens + per_ms - 1) / per_ms;
+}
+
+u64 rate_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (u64) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void rate_metrics()
+{
+	LOG("Throttle: %llu game, %llu leaderboard, %llu login messages dropped\n",
+		(unsigned long long) __atomic_load_n(&rate_throttled[THROTTLE_GAME], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&rate_throttled[THROTTLE_LEAD], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&rate_throttled[THROTTLE_LOGIN], __ATOMIC_RELAXED));
+}
+
+// outboxes
+void outbox_init()
+{
+	for (u32 i = 0; i < OUTBOX_SOCKETS; i++)
+	{
+		pthread_mutex_init(&outboxes[i].lock, 0);
+		outboxes[i].coalesce[0] = OUTBOX_NONE;
+		outboxes[i].coalesce[1] = OUTBOX_NONE;
+	}
+}
+
+void outbox_reset(i32 socket)
+{
+	if (socket < 0 || socket >= OUTBOX_SOCKETS) { return; }
+
+	// descriptors are reused, nothing of the last connection may leak into the next
+	Outbox* box = &outboxes[socket];
+	pthread_mutex_lock(&box->lock);
+	free(box->frames);
+	box->channel     = 0;
+	box->frames      = 0;
+	box->head        = 0;
+	box->count       = 0;
+	box->sent        = 0;
+	box->over        = 0;
+	box->evicted     = 0;
+	box->coalesce[0] = OUTBOX_NONE;
+	box->coalesce[1] = OUTBOX_NONE;
+	pthread_mutex_unlock(&box->lock);
+}
+
+i32 outbox_send(i32 socket, u8* frame, u8 kind)
+{
+	if (socket < 0 || socket >= OUTBOX_SOCKETS)
+	{
+		return send(socket, frame, DEFAULT_MSG_LEN, MSG_NOSIGNAL);
+	}
+
+	Outbox* box = &outboxes[socket];
+	__atomic_add_fetch(&outbox_stats.frames, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&box->lock);
+	if (box->evicted || (box->count && outbox_write(box, socket) < 0))
+	{
+		pthread_mutex_unlock(&box->lock);
+		return -1;
+	}
+
+	// nothing waiting, so the frame can go straight out
+	u16 sent = 0;
+	if (!box->count)
+	{
+		i32 ret_val = outbox_transmit(box, socket, frame, DEFAULT_MSG_LEN);
+		if (ret_val == DEFAULT_MSG_LEN)
+		{
+			pthread_mutex_unlock(&box->lock);
+			return ret_val;
+		}
+		if (ret_val < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			box->evicted = 1;
+			pthread_mutex_unlock(&box->lock);
+			return -1;
+		}
+		sent = ret_val < 0 ? 0 : ret_val;
+	}
+
+	// a stale clock or queue position is overwritten rather than queued behind itself
+	else if (kind != OUTBOX_FRAME && box->coalesce[kind - 1] != OUTBOX_NONE)
+	{
+		memcpy(box->frames + box->coalesce[kind - 1] * DEFAULT_MSG_LEN, frame, DEFAULT_MSG_LEN);
+		__atomic_add_fetch(&outbox_stats.coalesced, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&box->lock);
+		return DEFAULT_MSG_LEN;
+	}
+
+	if (box->count == OUTBOX_FRAMES)
+	{
+		outbox_evict(box, socket);
+		pthread_mutex_unlock(&box->lock);
+		return -1;
+	}
+	if (!box->frames)
+	{
+		box->frames = malloc(OUTBOX_FRAMES * DEFAULT_MSG_LEN);
+	}
+
+	// queue it, a partly written frame keeps its place at the head
+	u16 tail = (box->head + box->count) % OUTBOX_FRAMES;
+	memcpy(box->frames + tail * DEFAULT_MSG_LEN, frame, DEFAULT_MSG_LEN);
+	if (!box->count)
+	{
+		box->sent = sent;
+	}
+	if (kind != OUTBOX_FRAME && !sent)
+	{
+		box->coalesce[kind - 1] = tail;
+	}
+	box->count++;
+	__atomic_add_fetch(&outbox_stats.queued, 1, __ATOMIC_RELAXED);
+
+	i32 ret_val = outbox_level(box, socket) ? -1 : DEFAULT_MSG_LEN;
+	pthread_mutex_unlock(&box->lock);
+	return ret_val;
+}
+
+i32 outbox_flush(i32 socket)
+{
+	if (socket < 0 || socket >= OUTBOX_SOCKETS) { return 0; }
+
+	Outbox* box = &outboxes[socket];
+	pthread_mutex_lock(&box->lock);
+	i32 pending = -1;
+	if (!box->evicted && outbox_write(box, socket) == 0 && !outbox_level(box, socket))
+	{
+		pending = box->count;
+	}
+	pthread_mutex_unlock(&box->lock);
+	return pending;
+}
+
+i32 outbox_write(Outbox* box, i32 socket)
+{
+	// the caller holds the lock
+	while (box->count)
+	{
+		u8* frame   = box->frames + box->head * DEFAULT_MSG_LEN;
+		i32 ret_val = outbox_transmit(box, socket, frame + box->sent, DEFAULT_MSG_LEN - box->sent);
+		if (ret_val < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK) { return 0; }
+			box->evicted = 1;
+			return -1;
+		}
+
+		// a frame on the wire can no longer be replaced
+		for (u8 c = 0; c < OUTBOX_CLASSES; c++)
+		{
+			if (box->coalesce[c] == box->head) { box->coalesce[c] = OUTBOX_NONE; }
+		}
+
+		box->sent += ret_val;
+		if (box->sent < DEFAULT_MSG_LEN) { return 0; }
+		box->sent  = 0;
+		box->head  = (box->head + 1) % OUTBOX_FRAMES;
+		box->count--;
+		__atomic_add_fetch(&outbox_stats.flushed, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+i32 outbox_transmit(Outbox* box, i32 socket, u8* data, u32 length)
+{
+	// the caller holds the lock, a client on a channel only ever gets whole frames so nothing is left half sent
+	Channel* channel = box->channel;
+	if (!channel)
+	{
+		return send(socket, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+	if (channel_push(&channel->memory->down, &channel->down_tail, data, channel->client_bell))
+	{
+		return length;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+u8 outbox_level(Outbox* box, i32 socket)
+{
+	// the caller holds the lock, returns whether the connection was evicted
+	u32 peak = __atomic_load_n(&outbox_stats.peak, __ATOMIC_RELAXED);
+	while (box->count > peak && !__atomic_compare_exchange_n(&outbox_stats.peak, &peak, box->count, 
+		0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!box->over && box->count >= OUTBOX_HIGH)
+	{
+		box->over       = 1;
+		box->over_since = now;
+		__atomic_add_fetch(&outbox_stats.watermarks, 1, __ATOMIC_RELAXED);
+	}
+	else if (box->over && box->count <= OUTBOX_LOW)
+	{
+		box->over = 0;
+	}
+
+	// a client allowed to stay behind would hold its frames forever
+	if (box->over && now.tv_sec - box->over_since.tv_sec >= OUTBOX_GRACE)
+	{
+		outbox_evict(box, socket);
+		return 1;
+	}
+	return 0;
+}
+
+void outbox_evict(Outbox* box, i32 socket)
+{
+	// the caller holds the lock, the owner of the socket sees it close and cleans up
+	WARN("Evicting slow client %d with %u frames pending\n", socket, box->count);
+	__atomic_add_fetch(&outbox_stats.evictions, 1, __ATOMIC_RELAXED);
+	box->evicted = 1;
+	box->count   = 0;
+	free(box->frames);
+	box->frames  = 0;
+	shutdown(socket, SHUT_RDWR);
+}
+
+u16 outbox_pending(i32 socket)
+{
+	if (socket < 0 || socket >= OUTBOX_SOCKETS) { return 0; }
+	return __atomic_load_n(&outboxes[socket].count, __ATOMIC_RELAXED);
+}
+
+u8 outbox_drain(i32 socket, struct timespec* deadline)
+{
+	// only used while nothing else writes, returns whether everything got out by the deadline
+	struct pollfd   out = { socket, POLLOUT, 0 };
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (outbox_pending(socket) && now.tv_sec < deadline->tv_sec)
+	{
+		if (poll(&out, 1, OUTBOX_DRAIN_POLL) > 0 && outbox_flush(socket) < 0) { break; }
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	// a frame left half written would desync the stream, so the connection goes with it
+	u16 pending = outbox_pending(socket);
+	if (pending)
+	{
+		WARN("Could not drain %u frames for %d\n", pending, socket);
+	}
+	outbox_reset(socket);
+	return !pending;
+}
+
+void outbox_metrics()
+{
+	u64 frames = __atomic_load_n(&outbox_stats.frames, __ATOMIC_RELAXED);
+	u64 queued = __atomic_load_n(&outbox_stats.queued, __ATOMIC_RELAXED);
+	LOG("Outbox:   %llu frames, %llu queued (%.1f%%), %llu coalesced, %llu flushed later\n",
+		(unsigned long long) frames, (unsigned long long) queued, frames ? 100.0 * queued / frames : 0.0,
+		(unsigned long long) __atomic_load_n(&outbox_stats.coalesced, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&outbox_stats.flushed, __ATOMIC_RELAXED));
+	LOG("Backlog:  %llu over the watermark, %llu evicted, deepest %u of %u frames\n",
+		(unsigned long long) __atomic_load_n(&outbox_stats.watermarks, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&outbox_stats.evictions, __ATOMIC_RELAXED),
+		__atomic_load_n(&outbox_stats.peak, __ATOMIC_RELAXED), OUTBOX_FRAMES);
+}
+
+// local transport
+i32 local_listen(u8* path)
+{
+	// a socket file left by an earlier run would keep the bind from succeeding
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, (char*) path, sizeof(address.sun_path) - 1);
+	unlink((char*) path);
+	i32 listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0 || 
+		listen(listener, NUM_CONNECTIONS_PER_SOCK) < 0)
+	{
+		WARN("Local socket %s unavailable, clients on this host go through TCP\n", path);
+		if (listener >= 0) { close(listener); }
+		return DEFAULT_SOCKET;
+	}
+	LOG("Listening on %s\n", path);
+	return listener;
+}
+
+Channel* channel_open(i32 socket)
+{
+	// descriptors can only be handed to a peer on the unix socket
+	struct sockaddr_storage address;
+	socklen_t address_size = sizeof(address);
+	if (socket < 0 || socket >= OUTBOX_SOCKETS || getsockname(socket, (struct sockaddr*) &address, &address_size) < 0 ||
+		address.ss_family != AF_UNIX)
+	{
+		__atomic_add_fetch(&channel_refusals, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	// both rings live in one memfd, each side sleeps on its own eventfd
+	Channel* channel = calloc(1, sizeof(Channel));
+	i32 memory = memfd_create("channel", MFD_CLOEXEC);
+	channel->server_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	channel->client_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	channel->memory      = MAP_FAILED;
+	if (memory >= 0 && !ftruncate(memory, sizeof(ChannelMemory)))
+	{
+		channel->memory = mmap(0, sizeof(ChannelMemory), PROT_READ | PROT_WRITE, MAP_SHARED, memory, 0);
+	}
+
+	// the answer is the last frame on the socket, so it only goes out with nothing queued ahead of it
+	u8 frame[DEFAULT_MSG_LEN] = {0};
+	for (u16 i = 0; i < LEN_TYPE_OPENED; i++)
+	{
+		frame[i] = MESSAGE_TYPE_OPENED[i];
+	}
+	frame[LEN_TYPE_OPENED]     = 1;
+	frame[LEN_TYPE_OPENED + 1] = END_OF_TRANSMISSION;
+	i32 fds[CHANNEL_FDS] = { memory, channel->server_bell, channel->client_bell };
+	struct iovec  vector = { frame, DEFAULT_MSG_LEN };
+	struct msghdr header = {0};
+	union
+	{
+		struct cmsghdr align;
+		u8             buffer[CMSG_SPACE(sizeof(fds))];
+	} control;
+	header.msg_iov        = &vector;
+	header.msg_iovlen     = 1;
+	header.msg_control    = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+	struct cmsghdr* message = CMSG_FIRSTHDR(&header);
+	message->cmsg_level = SOL_SOCKET;
+	message->cmsg_type  = SCM_RIGHTS;
+	message->cmsg_len   = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(message), fds, sizeof(fds));
+
+	i32 sent = -1;
+	Outbox* box = &outboxes[socket];
+	pthread_mutex_lock(&box->lock);
+	if (channel->memory != MAP_FAILED && channel->server_bell >= 0 && channel->client_bell >= 0 && 
+		!box->evicted && !box->count)
+	{
+		sent = sendmsg(socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+	if (sent == DEFAULT_MSG_LEN)
+	{
+		box->channel = channel;
+	}
+	else if (sent > 0)
+	{
+		// a frame left half written would desync the stream
+		outbox_evict(box, socket);
+	}
+	pthread_mutex_unlock(&box->lock);
+
+	// the client holds its own copy of the memfd, the mapping is all this side needs
+	if (memory >= 0) { close(memory); }
+	if (sent != DEFAULT_MSG_LEN)
+	{
+		channel_close(DEFAULT_SOCKET, channel);
+		__atomic_add_fetch(&channel_refusals, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	__atomic_add_fetch(&channel_opens, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel_count, 1, __ATOMIC_RELAXED);
+	return channel;
+}
+
+void channel_close(i32 socket, Channel* channel)
+{
+	// frames still waiting for the ring are dropped along with the connection
+	if (socket != DEFAULT_SOCKET)
+	{
+		Outbox* box = &outboxes[socket];
+		pthread_mutex_lock(&box->lock);
+		box->channel = 0;
+		pthread_mutex_unlock(&box->lock);
+		__atomic_sub_fetch(&channel_count, 1, __ATOMIC_RELAXED);
+	}
+	if (channel->memory != MAP_FAILED)  { munmap(channel->memory, sizeof(ChannelMemory)); }
+	if (channel->server_bell >= 0)      { close(channel->server_bell); }
+	if (channel->client_bell >= 0)      { close(channel->client_bell); }
+	free(channel);
+}
+
+void channel_metrics()
+{
+	LOG("Channel:  %u open, %llu opened, %llu refused\n", __atomic_load_n(&channel_count, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&channel_opens, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&channel_refusals, __ATOMIC_RELAXED));
+}
+
+// worker pool
+void pool_load()
+{
+	// a worker per core to start with, growing up to the compiled limit
+	i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+	pool_params.min      = cores < 1 ? 1 : cores > NUM_THREADS ? NUM_THREADS : cores;
+	pool_params.max      = NUM_THREADS;
+	pool_params.depth    = POOL_DEPTH;
+	pool_params.wait     = POOL_WAIT;
+	pool_params.cooldown = POOL_COOLDOWN;
+
+	// optional overrides, one "name value" pair per line, the wait in milliseconds and the cooldown in seconds
+	FILE* file = fopen(POOL_FILE, "r");
+	if (file)
+	{
+		char name[32];
+		u32  value;
+		while (fscanf(file, "%31s %u", name, &value) == 2)
+		{
+			if      (!strcmp(name, "min"))      { pool_params.min      = value; }
+			else if (!strcmp(name, "max"))      { pool_params.max      = value; }
+			else if (!strcmp(name, "depth"))    { pool_params.depth    = value; }
+			else if (!strcmp(name, "wait"))     { pool_params.wait     = value; }
+			else if (!strcmp(name, "cooldown")) { pool_params.cooldown = value; }
+			else { WARN("Unknown pool parameter: %s\n", name); }
+		}
+		fclose(file);
+	}
+	if (pool_params.max < 1 || pool_params.max > NUM_THREADS)
+	{
+		WARN("Pool maximum has to be between 1 and %u\n", NUM_THREADS);
+		pool_params.max = NUM_THREADS;
+	}
+	if (pool_params.min < 1 || pool_params.min > pool_params.max)
+	{
+		WARN("Pool minimum has to be between 1 and the maximum\n");
+		pool_params.min = pool_params.min < 1 ? 1 : pool_params.max;
+	}
+}
+
+u8 pool_spawn()
+{
+	// indices map onto shards round robin, a free one on the shard with the most waiting is taken
+	i32 best      = -1;
+	u64 best_load = 0;
+	for (u16 w = 0; w < NUM_THREADS; w++)
+	{
+		if (__atomic_load_n(&pool_running[w], __ATOMIC_ACQUIRE)) { continue; }
+		u64 load = queue_length(&shards[w % shard_count]);
+		if (best < 0 || load > best_load)
+		{
+			best      = w;
+			best_load = load;
+		}
+	}
+	if (best < 0) { return 0; }
+
+	// counted before it starts, so an upgrade beginning meanwhile waits for its sessions as well
+	pool_indices[best] = best;
+	__atomic_store_n(&pool_running[best], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool_slots, SESSION_COROUTINES, __ATOMIC_RELEASE);
+	if (pthread_create(&pool[best], 0, worker_scheduler, &pool_indices[best]))
+	{
+		WARN("Client thread could not be created\n");
+		__atomic_sub_fetch(&pool_slots, SESSION_COROUTINES, __ATOMIC_RELEASE);
+		__atomic_store_n(&pool_running[best], 0, __ATOMIC_RELEASE);
+		return 0;
+	}
+	pthread_detach(pool[best]);
+	__atomic_add_fetch(&shards[best % shard_count].workers, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool_spawns, 1, __ATOMIC_RELAXED);
+	u32 size = __atomic_add_fetch(&pool_size, 1, __ATOMIC_RELAXED);
+	LOG("Client thread created  (%u/%u)\n", size, pool_params.max);
+	return 1;
+}
+
+void pool_retire(u16 worker)
+{
+	// the worker stops taking connections at once, the thread exits after its last session
+	__atomic_store_n(&pool_retiring[worker], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&shards[worker % shard_count].workers, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool_size, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool_retirements, 1, __ATOMIC_RELAXED);
+}
+
+void pool_served(struct timespec* since)
+{
+	// a moving average, so one burst of short visits doesn't swing it on its own
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	u64 micros = (now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+	pthread_mutex_lock(&pool_mutex);
+	pool_service = pool_service ? pool_service - pool_service / 8 + micros / 8 : micros;
+	pthread_mutex_unlock(&pool_mutex);
+}
+
+void pool_metrics()
+{
+	LOG("Pool:     %u workers (%u to %u), %llu spawned, %llu retired, %.2f s per session, %llu ms estimated wait\n",
+		__atomic_load_n(&pool_size, __ATOMIC_RELAXED), pool_params.min, pool_params.max,
+		(unsigned long long) __atomic_load_n(&pool_spawns, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&pool_retirements, __ATOMIC_RELAXED),
+		__atomic_load_n(&pool_service, __ATOMIC_RELAXED) / 1000000.0,
+		(unsigned long long) __atomic_load_n(&pool_wait, __ATOMIC_RELAXED));
+}
+
+// slot control
+void control_publish(SlotControl* control, struct timespec* start, u8 timer)
+{
+	// seqlock, the sequence is odd while the start is half written and readers go round again
+	u32 sequence = control->sequence;
+	__atomic_store_n(&control->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&control->start.tv_sec, start->tv_sec, __ATOMIC_RELAXED);
+	__atomic_store_n(&control->start.tv_nsec, start->tv_nsec, __ATOMIC_RELAXED);
+	__atomic_store_n(&control->sequence, sequence + 2, __ATOMIC_RELEASE);
+	control_timer(control, timer);
+}
+
+void control_timer(SlotControl* control, u8 timer)
+{
+	// the time thread only visits slots with their bit set, the flag itself stays the final word
+	u32 slot = control - slot_controls;
+	u64 bit  = 1ull << (slot % 64);
+	__atomic_store_n(&control->timer, timer, __ATOMIC_RELEASE);
+	if (timer == TIMER_ON) { __atomic_or_fetch(&timer_slots[slot / 64], bit, __ATOMIC_RELEASE); }
+	else                   { __atomic_and_fetch(&timer_slots[slot / 64], ~bit, __ATOMIC_RELEASE); }
+}
+
+void control_read(SlotControl* control, struct timespec* start)
+{
+	// never waits on the writer, a read that overlapped a write is simply repeated
+	u32 before;
+	u32 after;
+	do
+	{
+		before = __atomic_load_n(&control->sequence, __ATOMIC_ACQUIRE);
+		start->tv_sec  = __atomic_load_n(&control->start.tv_sec, __ATOMIC_RELAXED);
+		start->tv_nsec = __atomic_load_n(&control->start.tv_nsec, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&control->sequence, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after);
+}
+
+// coroutines
+i32 coroutine_poll(struct pollfd* fds, u8 nfds, i32 timeout)
+{
+	// the session sleeps until a descriptor is ready or the timeout passes, its worker runs the others
+	Coroutine* co = scheduler->current;
+	co->fds   = fds;
+	co->nfds  = nfds;
+	co->ready = 0;
+	co->timed = timeout >= 0;
+	if (co->timed)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &co->deadline);
+		co->deadline.tv_sec  += timeout / 1000;
+		co->deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (co->deadline.tv_nsec >= 1000000000)
+		{
+			co->deadline.tv_sec++;
+			co->deadline.tv_nsec -= 1000000000;
+		}
+	}
+	co->state = COROUTINE_WAITING;
+	swapcontext(&co->context, &scheduler->context);
+	return co->ready;
+}
+
+void coroutine_exit()
+{
+	// never resumed either, its worker unmaps the stack once every session on it has exited
+	Coroutine* co = scheduler->current;
+	co->state = COROUTINE_DONE;
+	__atomic_sub_fetch(&pool_slots, 1, __ATOMIC_RELEASE);
+	swapcontext(&co->context, &scheduler->context);
+}
+
+void coroutine_park()
+{
+	// only resumed if the hand-off is called off, the worker keeps running its other sessions until they park as well
+	Coroutine* co = scheduler->current;
+	co->state = COROUTINE_PARKED;
+	swapcontext(&co->context, &scheduler->context);
+}
+
+void scheduler_wait(Scheduler* self)
+{
+	// one wait for all of a worker's sessions, bounded by the nearest deadline and the upgrade check
+	struct pollfd   all[SESSION_COROUTINES * 3];
+	u16             count   = 0;
+	i32             timeout = -1;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (u16 i = 0; i < SESSION_COROUTINES; i++)
+	{
+		Coroutine* co = &self->coroutines[i];
+		if (co->state == COROUTINE_PARKED)
+		{
+			// looked at again in case the hand-off is called off
+			timeout = timeout < 0 || UPGRADE_POLL < timeout ? UPGRADE_POLL : timeout;
+			continue;
+		}
+		if (co->state != COROUTINE_WAITING) { continue; }
+		i32 left = UPGRADE_POLL;
+		if (co->timed)
+		{
+			i64 until = (co->deadline.tv_sec - now.tv_sec) * 1000 + 
+				(co->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+			left = until < 0 ? 0 : until < left ? until : left;
+		}
+		if (self->ring)
+		{
+			if (uring_prepare(self->ring, i, co->fds, co->nfds)) { left = 0; }
+		}
+		else
+		{
+			memcpy(all + count, co->fds, co->nfds * sizeof(struct pollfd));
+			count += co->nfds;
+		}
+		timeout = timeout < 0 || left < timeout ? left : timeout;
+	}
+	if (self->ring)
+	{
+		uring_enter(self->ring, timeout);
+	}
+	else
+	{
+		poll(all, count, timeout);
+	}
+
+	// sessions with something ready or past their deadline run next, all of them once a hand-off starts
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	count = 0;
+	for (u16 i = 0; i < SESSION_COROUTINES; i++)
+	{
+		Coroutine* co = &self->coroutines[i];
+		if (co->state == COROUTINE_PARKED && !upgrading)
+		{
+			co->state = COROUTINE_READY;
+			continue;
+		}
+		if (co->state != COROUTINE_WAITING) { continue; }
+		if (self->ring)
+		{
+			co->ready = uring_collect(self->ring, i, co->fds, co->nfds);
+		}
+		else
+		{
+			for (u8 j = 0; j < co->nfds; j++)
+			{
+				co->fds[j].revents = all[count++].revents;
+				co->ready += co->fds[j].revents != 0;
+			}
+		}
+		if (co->ready || upgrading || (co->timed && (now.tv_sec > co->deadline.tv_sec || 
+			(now.tv_sec == co->deadline.tv_sec && now.tv_nsec >= co->deadline.tv_nsec))))
+		{
+			co->state = COROUTINE_READY;
+		}
+	}
+}
+
+// io_uring
+u8 uring_init(Uring* ring, u16 slot_count, u8 buffered)
+{
+	// both rings are shared with the kernel, each side moves its own end
+	memset(ring, 0, sizeof(Uring));
+	u32 entries = URING_ENTRIES;
+	while (entries < URING_OPS * 2 * slot_count) { entries <<= 1; }
+	struct io_uring_params params = {0};
+	params.flags = IORING_SETUP_SINGLE_ISSUER;
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+	{
+		memset(&params, 0, sizeof(params));
+		ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	}
+	if (ring->fd < 0) { return 0; }
+
+	// waits are bounded like poll's, which needs the extended enter argument
+	if (!(params.features & IORING_FEAT_EXT_ARG))
+	{
+		close(ring->fd);
+		return 0;
+	}
+	u32 sq_len = params.sq_off.array + params.sq_entries * sizeof(u32);
+	u32 cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+	}
+	u8* sq = mmap(0, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	u8* cq = sq;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cq = mmap(0, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes = mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->slots = calloc(slot_count, sizeof(UringSlot));
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED || !ring->slots)
+	{
+		free(ring->slots);
+		close(ring->fd);
+		return 0;
+	}
+	ring->sq_entries = params.sq_entries;
+	ring->sq_head    = (u32*) (sq + params.sq_off.head);
+	ring->sq_tail    = (u32*) (sq + params.sq_off.tail);
+	ring->sq_mask    = *(u32*) (sq + params.sq_off.ring_mask);
+	ring->sq_array   = (u32*) (sq + params.sq_off.array);
+	ring->cq_head    = (u32*) (cq + params.cq_off.head);
+	ring->cq_tail    = (u32*) (cq + params.cq_off.tail);
+	ring->cq_mask    = *(u32*) (cq + params.cq_off.ring_mask);
+	ring->cqes       = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+	ring->slot_count = slot_count;
+	ring->sq_ring     = sq;
+	ring->sq_ring_len = sq_len;
+	ring->cq_ring     = cq;
+	ring->cq_ring_len = cq_len;
+	if (!buffered) { return 1; }
+
+	// receives take a frame sized buffer from a registered ring rather than naming one per call
+	ring->buffer_count = 1;
+	while (ring->buffer_count < URING_BUFFERS * slot_count) { ring->buffer_count <<= 1; }
+	ring->buffers       = mmap(0, ring->buffer_count * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buffer_memory = malloc(ring->buffer_count * DEFAULT_MSG_LEN);
+	struct io_uring_buf_reg reg = {0};
+	reg.ring_addr    = (u64) ring->buffers;
+	reg.ring_entries = ring->buffer_count;
+	reg.bgid         = URING_BUFFER_GROUP;
+	if (ring->buffers == MAP_FAILED || !ring->buffer_memory ||
+		syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		free(ring->buffer_memory);
+		free(ring->slots);
+		close(ring->fd);
+		return 0;
+	}
+	for (u32 i = 0; i < ring->buffer_count; i++)
+	{
+		uring_recycle(ring, i);
+	}
+	return 1;
+}
+
+struct io_uring_sqe* uring_sqe(Uring* ring)
+{
+	// a full queue is handed to the kernel before anything more is added
+	u32 tail = *ring->sq_tail;
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+	{
+		uring_enter(ring, 0);
+	}
+	u32 index = tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return sqe;
+}
+
+void uring_arm(Uring* ring, u16 slot, u8 op, i32 fd, u32 events)
+{
+	// receives and accepts stay armed across completions, polls fire once
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+	sqe->fd        = fd;
+	sqe->user_data = ((u64) slot << 8) | op;
+	if (op == URING_RECV)
+	{
+		sqe->opcode    = IORING_OP_RECV;
+		sqe->ioprio    = IORING_RECV_MULTISHOT;
+		sqe->flags     = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BUFFER_GROUP;
+	}
+	else if (op == URING_ACCEPT)
+	{
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}
+	else
+	{
+		sqe->opcode        = IORING_OP_POLL_ADD;
+		sqe->poll32_events = events;
+	}
+	ring->slots[slot].armed[op] = URING_ARMED;
+}
+
+void uring_cancel(Uring* ring, u16 slot, u8 op)
+{
+	// the operation's last completion still arrives, it is only gone once that is reaped
+	if (ring->slots[slot].armed[op] != URING_ARMED) { return; }
+	struct io_uring_sqe* sqe = uring_sqe(ring);
+	sqe->opcode                 = IORING_OP_ASYNC_CANCEL;
+	sqe->addr                   = ((u64) slot << 8) | op;
+	sqe->user_data              = ((u64) slot << 8) | URING_CANCEL;
+	ring->slots[slot].armed[op] = URING_CANCELLING;
+}
+
+void uring_enter(Uring* ring, i32 timeout)
+{
+	// submit whatever was armed and wait up to the timeout for a completion, none if zero, forever if negative
+	struct __kernel_timespec wait = { timeout / 1000, (timeout % 1000) * 1000000 };
+	struct io_uring_getevents_arg arg = {0};
+	arg.ts = timeout < 0 ? 0 : (u64) &wait;
+	i32 submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, timeout ? 1 : 0,
+		IORING_ENTER_EXT_ARG | (timeout ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+	if (submitted > 0)
+	{
+		ring->to_submit -= submitted;
+	}
+
+	// received data and accepted sockets queue up in order, polls only leave their events
+	u32 head = *ring->cq_head;
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+		UringSlot* slot = &ring->slots[cqe->user_data >> 8];
+		u8 op = cqe->user_data;
+		if (slot->frame_count == URING_FRAMES) { break; }
+		head++;
+		__atomic_add_fetch(&uring_completions, 1, __ATOMIC_RELAXED);
+		if (op == URING_CANCEL) { continue; }
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+		{
+			slot->armed[op] = URING_IDLE;
+		}
+		if (op != URING_RECV && op != URING_ACCEPT)
+		{
+			slot->ready[op] |= cqe->res > 0 ? cqe->res : 0;
+			continue;
+		}
+
+		// out of buffers ends the receive, it is armed again once frames are handed back
+		if (cqe->res == -ENOBUFS)
+		{
+			__atomic_add_fetch(&uring_stalls, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (cqe->res == -ECANCELED) { continue; }
+		UringFrame* frame = &slot->frames[(slot->frame_head + slot->frame_count) % URING_FRAMES];
+		frame->result = cqe->res;
+		frame->buffer = (cqe->flags & IORING_CQE_F_BUFFER) ? cqe->flags >> IORING_CQE_BUFFER_SHIFT : URING_NO_BUFFER;
+		slot->frame_count++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_recycle(Uring* ring, u16 buffer)
+{
+	struct io_uring_buf* entry = &ring->buffers->bufs[ring->buffer_tail & (ring->buffer_count - 1)];
+	entry->addr = (u64) (ring->buffer_memory + buffer * DEFAULT_MSG_LEN);
+	entry->len  = DEFAULT_MSG_LEN;
+	entry->bid  = buffer;
+	ring->buffer_tail++;
+	__atomic_store_n(&ring->buffers->tail, ring->buffer_tail, __ATOMIC_RELEASE);
+}
+
+u8 uring_prepare(Uring* ring, u16 slot, struct pollfd* fds, u8 count)
+{
+	// arms what a session waits on, its client, a parked login and its channel, returns whether data is already here
+	UringSlot* state = &ring->slots[slot];
+	if (!count) { return 0; }
+	if (upgrading || fds[0].fd < 0)
+	{
+		uring_cancel(ring, slot, URING_RECV);
+	}
+	else if (!state->armed[URING_RECV])
+	{
+		uring_arm(ring, slot, URING_RECV, fds[0].fd, 0);
+	}
+	if (fds[0].fd >= 0 && !state->armed[URING_WRITABLE] && (fds[0].events & POLLOUT))
+	{
+		uring_arm(ring, slot, URING_WRITABLE, fds[0].fd, POLLOUT);
+	}
+	if (count > 1 && fds[1].fd >= 0 && !state->armed[URING_LOGIN])
+	{
+		uring_arm(ring, slot, URING_LOGIN, fds[1].fd, POLLIN);
+	}
+	if (count > 2 && fds[2].fd >= 0 && !state->armed[URING_DOORBELL])
+	{
+		uring_arm(ring, slot, URING_DOORBELL, fds[2].fd, POLLIN);
+	}
+	return state->frame_count != 0;
+}
+
+i32 uring_collect(Uring* ring, u16 slot, struct pollfd* fds, u8 count)
+{
+	// what a poll over the same descriptors would have reported
+	UringSlot* state = &ring->slots[slot];
+	if (!count) { return 0; }
+	fds[0].revents = (state->frame_count ? POLLIN : 0) | state->ready[URING_WRITABLE];
+	if (count > 1)
+	{
+		fds[1].revents = state->ready[URING_LOGIN];
+	}
+	if (count > 2)
+	{
+		fds[2].revents = state->ready[URING_DOORBELL];
+	}
+	memset(state->ready, 0, sizeof(state->ready));
+
+	i32 ready = 0;
+	for (u8 i = 0; i < count; i++)
+	{
+		ready += fds[i].revents != 0;
+	}
+	return ready;
+}
+
+i32 uring_accept(Uring* ring, i32* listeners, u8 count, i32 timeout)
+{
+	// one accept per listener serves every connection until a hand-off withdraws it, returns the slot with one ready
+	u8 ready = 0;
+	for (u8 i = 0; i < count; i++)
+	{
+		if (listeners[i] < 0) { continue; }
+		if (upgrading)
+		{
+			uring_cancel(ring, i, URING_ACCEPT);
+		}
+		else if (!ring->slots[i].armed[URING_ACCEPT])
+		{
+			uring_arm(ring, i, URING_ACCEPT, listeners[i], 0);
+		}
+		ready |= ring->slots[i].frame_count != 0;
+	}
+	uring_enter(ring, ready ? 0 : timeout);
+	for (u8 i = 0; i < count; i++)
+	{
+		if (ring->slots[i].frame_count) { return i; }
+	}
+	return -1;
+}
+
+i32 uring_next(Uring* ring, u16 slot, u8* msg, u32 length)
+{
+	// the result of the slot's oldest completion, received data is copied out and its buffer handed back
+	UringSlot* state = &ring->slots[slot];
+	UringFrame frame = state->frames[state->frame_head];
+	state->frame_head = (state->frame_head + 1) % URING_FRAMES;
+	state->frame_count--;
+	if (frame.buffer != URING_NO_BUFFER)
+	{
+		if (msg)
+		{
+			memcpy(msg, ring->buffer_memory + frame.buffer * DEFAULT_MSG_LEN, 
+				(u32) frame.result < length ? (u32) frame.result : length);
+		}
+		uring_recycle(ring, frame.buffer);
+	}
+	return frame.result;
+}
+
+u8 uring_busy(Uring* ring, u16 slot)
+{
+	// a hand-off waits until nothing more can arrive and nothing received is left unhandled
+	UringSlot* state = &ring->slots[slot];
+	return state->armed[URING_RECV] || state->armed[URING_ACCEPT] || state->frame_count;
+}
+
+void uring_release(Uring* ring, u16 slot)
+{
+	// nothing may still refer to the socket once it is closed
+	UringSlot* state = &ring->slots[slot];
+	for (u8 op = 0; op < URING_OPS; op++)
+	{
+		uring_cancel(ring, slot, op);
+	}
+	while (1)
+	{
+		while (state->frame_count)
+		{
+			uring_next(ring, slot, 0, 0);
+		}
+		u8 armed = 0;
+		for (u8 op = 0; op < URING_OPS; op++)
+		{
+			armed |= state->armed[op];
+		}
+		if (!armed) { break; }
+		uring_enter(ring, UPGRADE_POLL);
+	}
+	memset(state->ready, 0, sizeof(state->ready));
+}
+
+void uring_free(Uring* ring)
+{
+	// only once nothing is armed, closing the ring drops the registered buffers along with it
+	close(ring->fd);
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring != ring->sq_ring)
+	{
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	if (ring->buffers)
+	{
+		munmap(ring->buffers, ring->buffer_count * sizeof(struct io_uring_buf));
+		free(ring->buffer_memory);
+	}
+	free(ring->slots);
+}
+
+void uring_metrics()
+{
+	if (!uring_backend) { return; }
+	LOG("io_uring: %llu completions, %llu receives out of buffers\n",
+		(unsigned long long) __atomic_load_n(&uring_completions, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&uring_stalls, __ATOMIC_RELAXED));
+}
+
+// upgrades
+void* upgrade_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	// a newer binary started with --upgrade connects here, a socket left by a crash is replaced
+	// but one a running server still answers on is not
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, UPGRADE_SOCKET, sizeof(address.sun_path) - 1);
+	i32 probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (!upgrade_inherited && probe >= 0 && connect(probe, (struct sockaddr*) &address, sizeof(address)) == 0)
+	{
+		WARN("Another server holds the upgrade socket, hand-offs are disabled\n");
+		close(probe);
+		return 0;
+	}
+	close(probe);
+	unlink(UPGRADE_SOCKET);
+	i32 server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (server < 0 || bind(server, (struct sockaddr*) &address, sizeof(address)) < 0 || 
+		chmod(UPGRADE_SOCKET, S_IRUSR | S_IWUSR) < 0 || listen(server, 1) < 0)
+	{
+		WARN("Upgrade socket unavailable, hand-offs are disabled\n");
+		return 0;
+	}
+	upgrade_bound = 1;
+
+	u8 record[UPGRADE_RECORD_LEN];
+	while (1)
+	{
+		i32 channel = accept(server, 0, 0);
+		if (channel < 0) { continue; }
+
+		// only the user the server runs as gets its descriptors, and a peer that goes quiet can't hold it up
+		struct ucred credentials;
+		socklen_t credentials_size = sizeof(credentials);
+		struct timeval patience = { UPGRADE_ACK_WAIT, 0 };
+		setsockopt(channel, SOL_SOCKET, SO_RCVTIMEO, &patience, sizeof(patience));
+		setsockopt(channel, SOL_SOCKET, SO_SNDTIMEO, &patience, sizeof(patience));
+		if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) < 0 ||
+			credentials.uid != geteuid())
+		{
+			WARN("Upgrade refused, the new binary runs as another user\n");
+			close(channel);
+			continue;
+		}
+
+		// both binaries have to agree on the record layout before anything is stopped, a probe sends nothing
+		i64 received = recv(channel, record, UPGRADE_RECORD_LEN, 0);
+		if (received <= 0)
+		{
+			close(channel);
+			continue;
+		}
+		if (received != 4 || read_u32(record) != UPGRADE_VERSION)
+		{
+			WARN("Upgrade refused, the new binary speaks a different version\n");
+			close(channel);
+			continue;
+		}
+		i32 peer = syscall(__NR_pidfd_open, credentials.pid, 0);
+		LOG("Upgrade requested, handing over\n");
+
+		// the listener, the time thread and every session stop at a frame boundary
+		upgrading = 1;
+		while (__atomic_load_n(&upgrade_parked, __ATOMIC_ACQUIRE) < __atomic_load_n(&pool_slots, __ATOMIC_ACQUIRE) + 2)
+		{
+			const struct timespec sleep_amount = {0, 1000000};
+			nanosleep(&sleep_amount, 0);
+		}
+
+		// nothing else writes to a client from here on
+		pthread_mutex_lock(&subscription_mutex);
+
+		// clients get until the deadline to take what is still queued for them
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += OUTBOX_GRACE;
+
+		// listener, then the queue in order, then the sessions, nothing leaves this process
+		// until the new one has acknowledged, so a hand-off that fails can be called off
+		u32 queued = 0;
+		record[0] = UPGRADE_LISTENER;
+		record[1] = 0;
+		upgrade_send(channel, record, listen_sock);
+		if (local_sock != DEFAULT_SOCKET)
+		{
+			// the unix one is marked so an older binary can still take the TCP listener alone
+			record[1] = 1;
+			upgrade_send(channel, record, local_sock);
+		}
+		for (u8 s = 0; s < shard_count; s++)
+		{
+			pthread_mutex_lock(&shards[s].lock);
+			for (u8 c = 0; c < QUEUE_CLASSES; c++)
+			{
+				i32 next;
+				for (i32 socket = shards[s].queue.classes[c].head; socket != DEFAULT_SOCKET; socket = next)
+				{
+					next = queue_nodes[socket].next;
+					if (!outbox_drain(socket, &deadline))
+					{
+						queue_unlink(&shards[s], socket);
+						close(socket);
+						continue;
+					}
+					record[0] = UPGRADE_QUEUED;
+					record[1] = c;
+					upgrade_send(channel, record, socket);
+					queued++;
+				}
+			}
+		}
+
+		u32 active = 0;
+		u32 parked = 0;
+		for (u32 i = 0; i < upgrade_session_count; i++)
+		{
+			Session* session = upgrade_sessions[i];
+			Subscription found;
+			if (!outbox_drain(session->socket, &deadline))
+			{
+				// one logged in can still come back with its token, the session sees the hang up itself
+				shutdown(session->socket, SHUT_RDWR);
+				if (session->auth_status != AUTH_SUCC) { continue; }
+				record[0] = UPGRADE_DETACHED;
+				session_serialize(session, record + 1);
+				upgrade_send(channel, record, DEFAULT_SOCKET);
+				parked++;
+				continue;
+			}
+			u8* cursor = record + 1;
+			record[0]  = UPGRADE_ACTIVE;
+			cursor    += session_serialize(session, cursor);
+			*cursor    = subscription_find(session->socket, &found);
+			cursor[1]  = found.key;
+			cursor[2]  = found.window;
+			write_u64(cursor + 3,  found.mode);
+			write_u32(cursor + 11, found.first);
+			write_u32(cursor + 15, found.count);
+			upgrade_send(channel, record, session->socket);
+			active++;
+		}
+
+		pthread_mutex_lock(&session_mutex);
+		for (u32 slot = 0; slot < SESSION_DETACHED_MAX; slot++)
+		{
+			if (!sessions[slot]) { continue; }
+			record[0] = UPGRADE_DETACHED;
+			session_serialize(sessions[slot], record + 1);
+			upgrade_send(channel, record, DEFAULT_SOCKET);
+			parked++;
+		}
+
+		// the new process answers once every descriptor is its own
+		record[0] = UPGRADE_DONE;
+		upgrade_send(channel, record, DEFAULT_SOCKET);
+		if (recv(channel, record, UPGRADE_RECORD_LEN, 0) > 0)
+		{
+			LOG("Upgrade handed over %u queued, %u active and %u detached sessions\n", 
+				queued, active, parked);
+			exit(0);
+		}
+
+		// the new binary died or hung part way, it is stopped so only this process serves the clients
+		WARN("Upgrade not acknowledged, carrying on\n");
+		if (peer >= 0)
+		{
+			syscall(__NR_pidfd_send_signal, peer, SIGKILL, 0, 0);
+			close(peer);
+		}
+		close(channel);
+		pthread_mutex_unlock(&session_mutex);
+		for (u8 s = 0; s < shard_count; s++)
+		{
+			pthread_mutex_unlock(&shards[s].lock);
+		}
+		pthread_mutex_unlock(&subscription_mutex);
+		pthread_mutex_lock(&upgrade_mutex);
+		upgrade_session_count = 0;
+		__atomic_store_n(&upgrade_parked, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&upgrade_mutex);
+		upgrading = 0;
+	}
+}
+
+void upgrade_park(Session* session)
+{
+	// the caller's socket stays open, the process exits under it once the new one holds a copy,
+	// a hand-off that is called off lets everyone carry on from where they stopped
+	const struct timespec sleep_amount = {0, UPGRADE_POLL * 1000000};
+	pthread_mutex_lock(&upgrade_mutex);
+	if (session)
+	{
+		upgrade_sessions[upgrade_session_count++] = session;
+	}
+	pthread_mutex_unlock(&upgrade_mutex);
+	__atomic_add_fetch(&upgrade_parked, 1, __ATOMIC_RELEASE);
+	while (upgrading)
+	{
+		if (scheduler) { coroutine_park(); }
+		else           { nanosleep(&sleep_amount, 0); }
+	}
+}
+
+i32 upgrade_receive()
+{
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, UPGRADE_SOCKET, sizeof(address.sun_path) - 1);
+	i32 channel = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (channel < 0 || connect(channel, (struct sockaddr*) &address, sizeof(address)) < 0)
+	{
+		WARN("No running server to upgrade\n");
+		return DEFAULT_SOCKET;
+	}
+
+	// descriptors are only taken from a server run by the same user
+	struct ucred credentials;
+	socklen_t credentials_size = sizeof(credentials);
+	if (getsockopt(channel, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) < 0 ||
+		credentials.uid != geteuid())
+	{
+		WARN("Upgrade socket belongs to another user\n");
+		close(channel);
+		return DEFAULT_SOCKET;
+	}
+
+	u8 record[UPGRADE_RECORD_LEN] = {0};
+	write_u32(record, UPGRADE_VERSION);
+	send(channel, record, 4, MSG_NOSIGNAL);
+
+	i32 listener = DEFAULT_SOCKET;
+	u32 counts[UPGRADE_DONE] = {0};
+	while (1)
+	{
+		i32 fd;
+		if (upgrade_recv(channel, record, &fd) <= 0)
+		{
+			WARN("Upgrade cut short, keeping what arrived\n");
+			break;
+		}
+		if (record[0] == UPGRADE_DONE)
+		{
+			send(channel, record, 1, MSG_NOSIGNAL);
+			break;
+		}
+		if (record[0] < UPGRADE_DONE) { counts[record[0]]++; }
+
+		if (record[0] == UPGRADE_LISTENER && record[1])
+		{
+			local_sock = fd;
+		}
+		else if (record[0] == UPGRADE_LISTENER)
+		{
+			listener = fd;
+		}
+		else if (record[0] == UPGRADE_QUEUED)
+		{
+			if (!queue_push(shard_assign(), fd, record[1] < QUEUE_CLASSES ? record[1] : QUEUE_CLASS_ANONYMOUS))
+			{
+				admission_reject(fd, REJECT_FULL);
+			}
+		}
+		else if (record[0] == UPGRADE_ACTIVE || record[0] == UPGRADE_DETACHED)
+		{
+			Session* session = session_new(fd);
+			u8* cursor = record + 1 + session_deserialize(session, record + 1);
+
+			// claims are per process, so the account is taken again here
+			if (session->auth_status == AUTH_SUCC)
+			{
+				session->authentication_id = auth_lookup(session->username);
+				if (session->authentication_id == LEADERBOARD_NIL)
+				{
+					WARN("Handed over account %s no longer exists\n", session->username);
+					session->auth_status = AUTH_FAIL;
+				}
+			}
+			if (record[0] == UPGRADE_DETACHED)
+			{
+				// the slot marker takes the claim straight from free
+				if (session->auth_status == AUTH_SUCC) { session_detach(session); }
+				else { session_free(session); }
+				continue;
+			}
+			if (session->auth_status == AUTH_SUCC && !auth_claim(session->authentication_id, fd))
+			{
+				session->auth_status = AUTH_FAIL;
+			}
+			if (*cursor)
+			{
+				subscription_set(fd, cursor[1], cursor[2], read_u64(cursor + 3), 
+					read_u32(cursor + 11), read_u32(cursor + 15));
+			}
+			adopted[adopted_count++] = session;
+		}
+	}
+	close(channel);
+
+	LOG("Upgraded with %u queued, %u active and %u detached sessions\n", 
+		counts[UPGRADE_QUEUED], counts[UPGRADE_ACTIVE], counts[UPGRADE_DETACHED]);
+	return listener;
+}
+
+i32 upgrade_send(i32 channel, u8* record, i32 fd)
+{
+	// one record per packet, with at most one descriptor riding along
+	struct iovec  vector = { record, UPGRADE_RECORD_LEN };
+	struct msghdr header = {0};
+	union
+	{
+		struct cmsghdr align;
+		u8             buffer[CMSG_SPACE(sizeof(i32))];
+	} control;
+	header.msg_iov    = &vector;
+	header.msg_iovlen = 1;
+	if (fd != DEFAULT_SOCKET)
+	{
+		header.msg_control    = control.buffer;
+		header.msg_controllen = sizeof(control.buffer);
+		struct cmsghdr* message = CMSG_FIRSTHDR(&header);
+		message->cmsg_level = SOL_SOCKET;
+		message->cmsg_type  = SCM_RIGHTS;
+		message->cmsg_len   = CMSG_LEN(sizeof(i32));
+		memcpy(CMSG_DATA(message), &fd, sizeof(i32));
+	}
+	return sendmsg(channel, &header, MSG_NOSIGNAL);
+}
+
+i32 upgrade_recv(i32 channel, u8* record, i32* fd)
+{
+	struct iovec  vector = { record, UPGRADE_RECORD_LEN };
+	struct msghdr header = {0};
+	union
+	{
+		struct cmsghdr align;
+		u8             buffer[CMSG_SPACE(sizeof(i32))];
+	} control;
+	header.msg_iov        = &vector;
+	header.msg_iovlen     = 1;
+	header.msg_control    = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+
+	*fd = DEFAULT_SOCKET;
+	i32 received = recvmsg(channel, &header, 0);
+	struct cmsghdr* message = CMSG_FIRSTHDR(&header);
+	if (received > 0 && message && message->cmsg_type == SCM_RIGHTS)
+	{
+		memcpy(fd, CMSG_DATA(message), sizeof(i32));
+	}
+	return received;
+}
+
+// cluster
+u8 cluster_start(u8 size)
+{
+	// backends are forked before any thread exists, each keeps one end of its own channel
+	signal(SIGCHLD, SIG_IGN);
+	for (u8 i = 0; i < size; i++)
+	{
+		i32   pair[2];
+		pid_t pid = -1;
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == 0)
+		{
+			pid = fork();
+		}
+		if (pid < 0)
+		{
+			// the ones already started go down with the gateway
+			ERROR("Backend %u could not be started.\n", i);
+		}
+		if (!pid)
+		{
+			close(pair[0]);
+			for (u8 j = 0; j < i; j++)
+			{
+				close(backends[j].channel);
+			}
+			close(listen_sock);
+			listen_sock = DEFAULT_SOCKET;
+			if (local_sock != DEFAULT_SOCKET)
+			{
+				close(local_sock);
+				local_sock = DEFAULT_SOCKET;
+			}
+			prctl(PR_SET_PDEATHSIG, SIGINT);
+			signal(SIGCHLD, SIG_DFL);
+			cluster_index   = i;
+			cluster_channel = pair[1];
+			LOG("Backend %u started\n", i);
+			return 1;
+		}
+		close(pair[1]);
+		backends[i].channel = pair[0];
+		backends[i].pid     = pid;
+	}
+	LOG("Gateway in front of %u backends\n", size);
+	cluster_gateway();
+	return 0;
+}
+
+void cluster_gateway()
+{
+	// the gateway holds the one queue, its idle thread keeps telling clients their place in it,
+	// the verifiers only check premium passwords for it, and its accounts say which backend holds each
+	signal(SIGINT, cluster_exit);
+	auth_start();
+	pthread_create(&idle_manager, 0, idle_polling_handler, 0);
+	pthread_create(&auth_manager, 0, auth_watch_handler, 0);
+
+	struct pollfd fds[CLUSTER_MAX + 2];
+	u8 record[UPGRADE_RECORD_LEN];
+	while (1)
+	{
+		fds[0].fd     = listen_sock;
+		fds[0].events = POLLIN;
+		fds[1].fd     = local_sock;
+		fds[1].events = POLLIN;
+		for (u8 i = 0; i < cluster_size; i++)
+		{
+			fds[i + 2].fd     = backends[i].channel;
+			fds[i + 2].events = POLLIN;
+		}
+		if (poll(fds, cluster_size + 2, CLUSTER_REPORT) < 0) { continue; }
+
+		// a client on the unix socket is placed like any other, its backend gets the same descriptor
+		for (u8 l = 0; l < 2; l++)
+		{
+			if (!(fds[l].revents & POLLIN)) { continue; }
+			i32 client_sock = accept(fds[l].fd, 0, 0);
+			if (client_sock >= 0)
+			{
+				LOG("Client connected: %d\n", client_sock);
+				outbox_reset(client_sock);
+				admission_admit(&shards[0], client_sock);
+			}
+		}
+
+		for (u8 i = 0; i < cluster_size; i++)
+		{
+			if (!fds[i + 2].revents) { continue; }
+			i32 fd;
+			if (upgrade_recv(backends[i].channel, record, &fd) <= 0)
+			{
+				// its clients went with it, the others carry on
+				WARN("Backend %u is gone\n", i);
+				close(backends[i].channel);
+				backends[i].channel = DEFAULT_SOCKET;
+				for (u32 id = 0; id < __atomic_load_n(&auth_owner_count, __ATOMIC_ACQUIRE); id++)
+				{
+					auth_release(id, i, 0);
+				}
+				continue;
+			}
+			if (fd != DEFAULT_SOCKET)
+			{
+				close(fd);
+			}
+
+			if (record[0] == CLUSTER_LOAD)
+			{
+				backends[i].room     = read_u32(record + 1);
+				backends[i].received = read_u64(record + 5);
+			}
+			else if (record[0] == CLUSTER_RESULT)
+			{
+				// results go back out in the order they arrived, so every leaderboard sees the same history
+				for (u8 j = 0; j < cluster_size; j++)
+				{
+					if (backends[j].channel == DEFAULT_SOCKET) { continue; }
+					upgrade_send(backends[j].channel, record, DEFAULT_SOCKET);
+				}
+				cluster_ordered++;
+			}
+			else if (record[0] == CLUSTER_CLAIM)
+			{
+				// an account is held by one backend at a time, the gateway's owner cells say which
+				u32 id = auth_lookup(record + 9);
+				record[9] = id != LEADERBOARD_NIL && (*auth_owner(id) == i || auth_claim(id, i));
+				upgrade_send(backends[i].channel, record, DEFAULT_SOCKET);
+			}
+			else if (record[0] == CLUSTER_RELEASE)
+			{
+				u32 id = auth_lookup(record + 9);
+				if (id != LEADERBOARD_NIL)
+				{
+					auth_release(id, i, 0);
+				}
+			}
+		}
+		cluster_dispatch();
+	}
+}
+
+void cluster_dispatch()
+{
+	// whoever the queue serves next goes to the backend with the most room, nobody is served out of turn
+	u8 record[UPGRADE_RECORD_LEN] = {0};
+	record[0] = CLUSTER_CLIENT;
+	i32 held[CLUSTER_HELD];
+	u8  held_count = 0;
+	while (held_count < CLUSTER_HELD)
+	{
+		// room is as last reported, less what was sent since that the backend hadn't seen yet
+		i32 best      = -1;
+		i64 best_room = 0;
+		i64 rooms[CLUSTER_MAX];
+		for (u8 i = 0; i < cluster_size; i++)
+		{
+			rooms[i] = backends[i].channel == DEFAULT_SOCKET ? 0 :
+				(i64) backends[i].room - (i64) (backends[i].sent - backends[i].received);
+			if (rooms[i] > best_room)
+			{
+				best      = i;
+				best_room = rooms[i];
+			}
+		}
+		if (best < 0) { break; }
+
+		i32 client_sock = queue_pop(&shards[0]);
+		if (client_sock == DEFAULT_SOCKET) { break; }
+
+		// a client coming back with a token belongs to the backend that holds its session
+		u8  first[LEN_TYPE_RESUME + 1];
+		i32 target = best;
+		if (recv(client_sock, first, sizeof(first), MSG_PEEK | MSG_DONTWAIT) == sizeof(first) &&
+			!memcmp(first, MESSAGE_TYPE_RESUME, LEN_TYPE_RESUME) && first[LEN_TYPE_RESUME] < cluster_size)
+		{
+			target = first[LEN_TYPE_RESUME];
+		}
+		if (backends[target].channel == DEFAULT_SOCKET)
+		{
+			// its session went down with that backend, it logs in again wherever there is room
+			target = best;
+		}
+		if (rooms[target] <= 0)
+		{
+			// it keeps its place until that backend has room, the ones behind it still go out
+			held[held_count++] = client_sock;
+			continue;
+		}
+
+		// queue positions still waiting to go out are dropped, the backend starts afresh
+		outbox_flush(client_sock);
+		outbox_reset(client_sock);
+		record[1] = queue_class(client_sock);
+		if (upgrade_send(backends[target].channel, record, client_sock) < 0)
+		{
+			queue_requeue(&shards[0], client_sock);
+			break;
+		}
+		close(client_sock);
+		backends[target].sent++;
+		DEBUG("Client %d placed on backend %d\n", client_sock, target);
+	}
+
+	// back in front in the order they were popped
+	while (held_count)
+	{
+		queue_requeue(&shards[0], held[--held_count]);
+	}
+}
+
+void cluster_backend()
+{
+	// connections and everyone's results arrive on the channel, room goes back the other way
+	u8 record[UPGRADE_RECORD_LEN];
+	struct timespec reported = {0};
+	while (1)
+	{
+		struct pollfd channel = { cluster_channel, POLLIN, 0 };
+		poll(&channel, 1, CLUSTER_REPORT);
+		if (channel.revents)
+		{
+			i32 fd;
+			if (upgrade_recv(cluster_channel, record, &fd) <= 0)
+			{
+				WARN("Gateway is gone\n");
+				exit_handle();
+			}
+			if (record[0] == CLUSTER_CLIENT && fd != DEFAULT_SOCKET)
+			{
+				LOG("Client connected: %d\n", fd);
+				outbox_reset(fd);
+				Shard* shard = shard_assign();
+				if (!queue_push(shard, fd, record[1] < QUEUE_CLASSES ? record[1] : QUEUE_CLASS_ANONYMOUS))
+				{
+					// the gateway only places what there is room for, this is just the backstop
+					admission_reject(fd, REJECT_FULL);
+				}
+				cluster_received++;
+				reported.tv_sec = 0;
+			}
+			else if (record[0] == CLUSTER_RESULT)
+			{
+				GameResult result;
+				cluster_unpack(record, &result);
+				LeaderboardSet* set = registry_acquire(result.mode, 1);
+				pthread_mutex_lock(&set->lock);
+				result_apply(set, &result);
+				pthread_mutex_unlock(&set->lock);
+				registry_release(set);
+			}
+			else if (record[0] == CLUSTER_CLAIM)
+			{
+				// the answer goes to the verifier waiting on it
+				ClusterClaim* claim = (ClusterClaim*) read_u64(record + 1);
+				pthread_mutex_lock(&cluster_reply_mutex);
+				claim->granted  = record[9];
+				claim->answered = 1;
+				pthread_cond_broadcast(&cluster_reply_cond);
+				pthread_mutex_unlock(&cluster_reply_mutex);
+			}
+			else if (fd != DEFAULT_SOCKET)
+			{
+				close(fd);
+			}
+		}
+
+		// at least every report interval, and straight after taking a connection
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec - reported.tv_sec) * 1000 + (now.tv_nsec - reported.tv_nsec) / 1000000 >= CLUSTER_REPORT)
+		{
+			cluster_report();
+			reported = now;
+		}
+	}
+}
+
+void cluster_report()
+{
+	// room is what the pool can grow to, less the sessions being served and the connections waiting
+	u64 taken = 0;
+	for (u8 s = 0; s < shard_count; s++)
+	{
+		taken += queue_length(&shards[s]) + __atomic_load_n(&shards[s].busy, __ATOMIC_RELAXED);
+	}
+	u64 capacity = (u64) pool_params.max * SESSION_COROUTINES;
+	u8  record[UPGRADE_RECORD_LEN] = {0};
+	record[0] = CLUSTER_LOAD;
+	write_u32(record + 1, capacity > taken ? capacity - taken : 0);
+	write_u64(record + 5, cluster_received);
+	upgrade_send(cluster_channel, record, DEFAULT_SOCKET);
+}
+
+u8 cluster_claim(u32 id, i32 owner, u8* username)
+{
+	// the local claim and the message are taken in one order with releases, so the gateway never
+	// sees an account given back before the claim it undoes
+	ClusterClaim claim = {0};
+	u8 record[UPGRADE_RECORD_LEN] = {0};
+	record[0] = CLUSTER_CLAIM;
+	write_u64(record + 1, (u64) &claim);
+	memcpy(record + 9, username, DEFAULT_NAME_LENGTH);
+	pthread_mutex_lock(&cluster_mutex);
+	u8 claimed = auth_claim(id, owner);
+	u8 sent    = claimed && upgrade_send(cluster_channel, record, DEFAULT_SOCKET) >= 0;
+	pthread_mutex_unlock(&cluster_mutex);
+	if (sent)
+	{
+		pthread_mutex_lock(&cluster_reply_mutex);
+		while (!claim.answered)
+		{
+			pthread_cond_wait(&cluster_reply_cond, &cluster_reply_mutex);
+		}
+		pthread_mutex_unlock(&cluster_reply_mutex);
+	}
+
+	// another backend has it, the gateway never counted this claim so nothing is sent back
+	if (claimed && !claim.granted)
+	{
+		i32 expected = owner;
+		__atomic_compare_exchange_n(auth_owner(id), &expected, DEFAULT_SOCKET, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+	return claim.granted;
+}
+
+void cluster_release(u8* username)
+{
+	// the caller holds the cluster mutex
+	u8 record[UPGRADE_RECORD_LEN] = {0};
+	record[0] = CLUSTER_RELEASE;
+	memcpy(record + 9, username, DEFAULT_NAME_LENGTH);
+	upgrade_send(cluster_channel, record, DEFAULT_SOCKET);
+}
+
+void cluster_pack(u8* record, GameResult* result)
+{
+	u8* cursor = record;
+	*cursor = CLUSTER_RESULT;											cursor++;
+	write_u64(cursor, result->mode);									cursor += 8;
+	memcpy(cursor, result->username, DEFAULT_NAME_LENGTH);				cursor += DEFAULT_NAME_LENGTH;
+	*cursor = result->kind;												cursor++;
+	*cursor = result->rated;											cursor++;
+	write_u64(cursor, result->dt.tv_sec);								cursor += 8;
+	write_u64(cursor, result->dt.tv_nsec);
+}
+
+void cluster_unpack(u8* record, GameResult* result)
+{
+	u8* cursor = record + 1;
+	result->mode = read_u64(cursor);									cursor += 8;
+	memcpy(result->username, cursor, DEFAULT_NAME_LENGTH);				cursor += DEFAULT_NAME_LENGTH;
+	result->kind  = *cursor;											cursor++;
+	result->rated = *cursor;											cursor++;
+	result->dt.tv_sec  = read_u64(cursor);								cursor += 8;
+	result->dt.tv_nsec = read_u64(cursor);
+}
+
+void cluster_metrics()
+{
+	// only the gateway sees the whole cluster
+	if (!cluster_size || cluster_channel != DEFAULT_SOCKET) { return; }
+	LOG("Cluster:  %llu results ordered\n", (unsigned long long) cluster_ordered);
+	for (u8 i = 0; i < cluster_size; i++)
+	{
+		LOG("Backend %u: pid %d, %s, room for %u, %llu connections placed\n", i, backends[i].pid,
+			backends[i].channel == DEFAULT_SOCKET ? "gone" : "up", backends[i].room,
+			(unsigned long long) backends[i].sent);
+	}
+}
+
+void cluster_exit()
+{
+	// backends also get told by their parent death signal, this just doesn't wait for it
+	printf("\n");
+	for (u8 i = 0; i < cluster_size; i++)
+	{
+		if (backends[i].pid <= 0) { continue; }
+		kill(backends[i].pid, SIGINT);
+	}
+	shutdown(listen_sock, SHUT_RDWR);
+	close(listen_sock);
+	if (local_sock != DEFAULT_SOCKET)
+	{
+		close(local_sock);
+		unlink((char*) local_path);
+	}
+	exit(0);
+}
+
+// authentication
+void auth_init()
+{
+	// an unreadable file still leaves a usable, empty database
+	database = auth_load(0);
+	if (!database)
+	{
+		database = calloc(1, sizeof(AuthDatabase));
+		database->secrets = malloc(1);
+		database->lookup_capacity = DEFAULT_NUM_ACCOUNTS * 2;
+		database->lookup = malloc(sizeof(u32) * database->lookup_capacity);
+		for (u32 i = 0; i < database->lookup_capacity; i++)
+		{
+			database->lookup[i] = LEADERBOARD_NIL;
+		}
+	}
+}
+
+void auth_start()
+{
+	// hashing is cpu bound, one verifier per core keeps logins from queueing behind each other
+	i64 verifier_cores  = sysconf(_SC_NPROCESSORS_ONLN);
+	auth_verifier_count = (verifier_cores < 1) ? 1 : (verifier_cores > AUTH_VERIFIERS_MAX) ? AUTH_VERIFIERS_MAX : verifier_cores;
+	for (u8 i = 0; i < auth_verifier_count; i++)
+	{
+		pthread_create(&auth_verifiers[i], 0, auth_verify_handler, 0);
+	}
+}
+
+u32 auth_owner_new()
+{
+	// owner cells live outside any database, so claims survive a reload, LEADERBOARD_NIL once they run out
+	u32 chunk_index = auth_owner_count >> AUTH_OWNER_SHIFT;
+	if (chunk_index >= AUTH_OWNER_CHUNKS) { return LEADERBOARD_NIL; }
+	if (!auth_owners[chunk_index])
+	{
+		i32* chunk = malloc(sizeof(i32) * (AUTH_OWNER_MASK + 1));
+		if (!chunk) { return LEADERBOARD_NIL; }
+		for (u32 i = 0; i <= AUTH_OWNER_MASK; i++)
+		{
+			chunk[i] = DEFAULT_SOCKET;
+		}
+		auth_owners[chunk_index] = chunk;
+	}
+	return auth_owner_count++;
+}
+
+i32* auth_owner(u32 id)
+{
+	return &auth_owners[id >> AUTH_OWNER_SHIFT][id & AUTH_OWNER_MASK];
+}
+
+u8 auth_parse_line(u8* line, u8* end, AuthAccount* account, AuthChunk* chunk)
+{
+	for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+	{
+		account->username[i] = 0;
+	}
+
+	// username, whitespace, password
+	u8 length = 0;
+	while (line < end && *line != ' ' && *line != '\t' && *line != '\r')
+	{
+		if (length < DEFAULT_NAME_LENGTH - 1) { account->username[length++] = *line; }
+		line++;
+	}
+	while (line < end && (*line == ' ' || *line == '\t')) { line++; }
+
+	// a crypt(3) hash, or a plaintext password for older files
+	u8* secret = chunk->secrets + chunk->secrets_length;
+	account->secret = chunk->secrets_length;
+	length = 0;
+	while (line < end && *line != ' ' && *line != '\t' && *line != '\r')
+	{
+		if (length < AUTH_SECRET_MAX - 1) { secret[length++] = *line; }
+		line++;
+	}
+	secret[length] = 0;
+	chunk->secrets_length += length + 1;
+
+	// optional flags after the password
+	account->premium = 0;
+	while (line < end && (*line == ' ' || *line == '\t')) { line++; }
+	if (end - line >= 7 && !memcmp(line, "premium", 7) && (end - line == 7 || line[7] == ' ' || line[7] == '\t' || line[7] == '\r'))
+	{
+		account->premium = 1;
+	}
+
+	account->hash = hash_name(account->username);
+	return account->username[0] != 0;
+}
+
+void* auth_parse_handler(void* void_chunk)
+{
+	AuthChunk* chunk = (AuthChunk*) void_chunk;
+
+	// size for the worst case, a line per newline plus an unterminated last one
+	u32 lines = 1;
+	for (u8* i = chunk->start; i < chunk->end; i++)
+	{
+		lines += (*i == '\n');
+	}
+	chunk->accounts       = malloc(sizeof(AuthAccount) * lines);
+	chunk->count          = 0;
+	chunk->secrets        = malloc((chunk->end - chunk->start) + lines);
+	chunk->secrets_length = 0;
+
+	u8* line = chunk->start;
+	while (line < chunk->end)
+	{
+		u8* line_end = memchr(line, '\n', chunk->end - line);
+		if (!line_end) { line_end = chunk->end; }
+		u32 secrets_length = chunk->secrets_length;
+		if (auth_parse_line(line, line_end, &chunk->accounts[chunk->count], chunk)) { chunk->count++; }
+		else { chunk->secrets_length = secrets_length; }
+		line = line_end + 1;
+	}
+	return 0;
+}
+
+u32 auth_find(AuthDatabase* db, u8* username, u32 hash)
+{
+	// logins compare names exactly, unlike leaderboard ordering
+	u32 mask = db->lookup_capacity - 1;
+	for (u32 slot = hash & mask; db->lookup[slot] != LEADERBOARD_NIL; slot = (slot + 1) & mask)
+	{
+		AuthAccount* account = &db->accounts[db->lookup[slot]];
+		if (account->hash == hash && !strncmp((char*) account->username, (char*) username, DEFAULT_NAME_LENGTH))
+		{
+			return db->lookup[slot];
+		}
+	}
+	return LEADERBOARD_NIL;
+}
+
+AuthDatabase* auth_load(AuthDatabase* old)
+{
+	// map the whole file, nothing is copied until it is parsed
+	i32 fd = open(AUTH_FILE, O_RDONLY);
+	if (fd < 0) { WARN("Unable to open " AUTH_FILE "\n"); return 0; }
+
+	struct stat info;
+	if (fstat(fd, &info) < 0) { close(fd); return 0; }
+	size_t size = info.st_size;
+	u8* file = size ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+	close(fd);
+	if (file == MAP_FAILED) { WARN("Unable to map " AUTH_FILE "\n"); return 0; }
+
+	// skip first line (header names)
+	u8* end   = file + size;
+	u8* start = size ? memchr(file, '\n', size) : 0;
+	start = start ? start + 1 : end;
+
+	// parse in chunks split on line boundaries, one per core for large files
+	i64 cores   = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 threads = (cores < 1) ? 1 : (cores > AUTH_THREADS_MAX) ? AUTH_THREADS_MAX : cores;
+	if (end - start < AUTH_PARALLEL_MIN) { threads = 1; }
+
+	AuthChunk chunks[AUTH_THREADS_MAX];
+	pthread_t workers[AUTH_THREADS_MAX];
+	u8* chunk_start = start;
+	for (u32 t = 0; t < threads; t++)
+	{
+		u8* chunk_end = start + (end - start) * (t + 1) / threads;
+		if (chunk_end < chunk_start) { chunk_end = chunk_start; }
+		if (chunk_end < end)
+		{
+			u8* newline = memchr(chunk_end, '\n', end - chunk_end);
+			chunk_end = newline ? newline + 1 : end;
+		}
+
+		chunks[t].start = chunk_start;
+		chunks[t].end   = chunk_end;
+		if (threads > 1)
+		{
+			pthread_create(&workers[t], 0, auth_parse_handler, &chunks[t]);
+		}
+		else
+		{
+			auth_parse_handler(&chunks[t]);
+		}
+		chunk_start = chunk_end;
+	}
+
+	u32 total = 0;
+	for (u32 t = 0; t < threads; t++)
+	{
+		if (threads > 1) { pthread_join(workers[t], 0); }
+		total += chunks[t].count;
+	}
+	if (size) { munmap(file, size); }
+
+	// stitch the chunks back together in file order
+	u64 secrets_length = 0;
+	for (u32 t = 0; t < threads; t++)
+	{
+		secrets_length += chunks[t].secrets_length;
+	}
+
+	AuthDatabase* db = malloc(sizeof(AuthDatabase));
+	db->accounts = malloc(sizeof(AuthAccount) * (total ? total : 1));
+	db->secrets  = malloc(secrets_length ? secrets_length : 1);
+	db->count    = 0;
+	secrets_length = 0;
+	for (u32 t = 0; t < threads; t++)
+	{
+		memcpy(db->accounts + db->count, chunks[t].accounts, sizeof(AuthAccount) * chunks[t].count);
+		memcpy(db->secrets + secrets_length, chunks[t].secrets, chunks[t].secrets_length);
+		for (u32 i = 0; i < chunks[t].count; i++)
+		{
+			db->accounts[db->count + i].secret += secrets_length;
+		}
+		db->count      += chunks[t].count;
+		secrets_length += chunks[t].secrets_length;
+		free(chunks[t].accounts);
+		free(chunks[t].secrets);
+	}
+
+	// index, keeping it at most half full
+	db->lookup_capacity = DEFAULT_NUM_ACCOUNTS * 2;
+	while (db->lookup_capacity < total * 2) { db->lookup_capacity *= 2; }
+	db->lookup = malloc(sizeof(u32) * db->lookup_capacity);
+	for (u32 i = 0; i < db->lookup_capacity; i++)
+	{
+		db->lookup[i] = LEADERBOARD_NIL;
+	}
+
+	u32 mask      = db->lookup_capacity - 1;
+	u32 count     = 0;
+	u32 plaintext = 0;
+	u32 owners    = auth_owner_count;
+	for (u32 i = 0; i < total; i++)
+	{
+		AuthAccount* account = &db->accounts[i];
+		if (auth_find(db, account->username, account->hash) != LEADERBOARD_NIL)
+		{
+			// the first entry for a name wins
+			WARN("Duplicate account ignored: %s\n", account->username);
+			continue;
+		}
+
+		// accounts carried over from the old database keep their owner
+		u32 old_id = old ? auth_find(old, account->username, account->hash) : LEADERBOARD_NIL;
+		account->owner = (old_id != LEADERBOARD_NIL) ? old->accounts[old_id].owner : auth_owner_new();
+		if (account->owner == LEADERBOARD_NIL)
+		{
+			// cells of removed accounts are never reused, so enough reloads run them out,
+			// the ones handed out here go back and the live database stays
+			WARN("Out of account owner cells, " AUTH_FILE " not loaded\n");
+			auth_owner_count = owners;
+			auth_free(db);
+			return 0;
+		}
+
+		plaintext += (db->secrets[account->secret] != '$');
+		db->accounts[count] = *account;
+		u32 slot = account->hash & mask;
+		while (db->lookup[slot] != LEADERBOARD_NIL) { slot = (slot + 1) & mask; }
+		db->lookup[slot] = count;
+		count++;
+	}
+	db->count = count;
+
+	LOG("Loaded %u accounts on %u threads\n", db->count, threads);
+	if (plaintext)
+	{
+		WARN("%u accounts still have plaintext passwords, see --hash\n", plaintext);
+	}
+	return db;
+}
+
+AuthDatabase* auth_enter(u32* slot)
+{
+	// readers announce themselves before looking at the database
+	*slot = __atomic_load_n(&auth_generation, __ATOMIC_SEQ_CST) & 1;
+	__atomic_add_fetch(&auth_readers[*slot], 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&database, __ATOMIC_SEQ_CST);
+}
+
+void auth_exit(u32 slot)
+{
+	__atomic_sub_fetch(&auth_readers[slot], 1, __ATOMIC_RELEASE);
+}
+
+void auth_synchronize()
+{
+	// flip twice, a reader that saw the old database is on one of the two counters
+	const struct timespec sleep_amount = {0, AUTH_GRACE_POLL};
+	for (u8 round = 0; round < 2; round++)
+	{
+		u32 slot = __atomic_fetch_add(&auth_generation, 1, __ATOMIC_SEQ_CST) & 1;
+		while (__atomic_load_n(&auth_readers[slot], __ATOMIC_ACQUIRE))
+		{
+			nanosleep(&sleep_amount, 0);
+		}
+	}
+}
+
+void auth_free(AuthDatabase* db)
+{
+	free(db->accounts);
+	free(db->secrets);
+	free(db->lookup);
+	free(db);
+}
+
+void auth_reload()
+{
+	// build beside the live database, logins carry on against the old one
+	struct timespec start, end, dt;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	AuthDatabase* fresh = auth_load(database);
+	if (!fresh) { return; }
+
+	AuthDatabase* old = __atomic_exchange_n(&database, fresh, __ATOMIC_SEQ_CST);
+	auth_synchronize();
+	auth_free(old);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	time_diff(start, end, &dt);
+	LOG("Accounts reloaded in %ld.%03lds\n", (long) dt.tv_sec, dt.tv_nsec / 1000000);
+}
+
+void* auth_watch_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	// watch the directory, editors often replace the file rather than write it
+	i32 watch = inotify_init();
+	if (watch < 0 || inotify_add_watch(watch, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		WARN("Unable to watch " AUTH_FILE ", hot reload disabled\n");
+		return 0;
+	}
+
+	u8 events[AUTH_WATCH_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1)
+	{
+		ssize_t length = read(watch, events, sizeof(events));
+		if (length <= 0) { continue; }
+
+		u8 changed = 0;
+		for (u8* i = events; i < events + length; i += sizeof(struct inotify_event) + ((struct inotify_event*) i)->len)
+		{
+			struct inotify_event* event = (struct inotify_event*) i;
+			if (event->len && !strcmp(event->name, AUTH_FILE)) { changed = 1; }
+		}
+		if (changed) { auth_reload(); }
+	}
+}
+
+u8 auth_compare(u8* a, u8* b, u32 length)
+{
+	// constant time, a mismatch never returns early
+	u8 difference = 0;
+	for (u32 i = 0; i < length; i++)
+	{
+		difference |= a[i] ^ b[i];
+	}
+	return !difference;
+}
+
+u8 auth_check(u8* username, u8* password, i32 owner, u32* id)
+{
+	// copy the secret out, the database may be swapped while the hash runs
+	u8  secret[AUTH_SECRET_MAX] = {0};
+	u32 slot;
+	AuthDatabase* db = auth_enter(&slot);
+	u32 found = auth_find(db, username, hash_name(username));
+	if (found != LEADERBOARD_NIL)
+	{
+		strncpy((char*) secret, (char*) db->secrets + db->accounts[found].secret, AUTH_SECRET_MAX - 1);
+		*id = db->accounts[found].owner;
+	}
+	auth_exit(slot);
+	if (found == LEADERBOARD_NIL) { return AUTH_FAIL; }
+
+	// salted hashes go through the kdf, plaintext is compared as is
+	u8 matched;
+	if (secret[0] == '$')
+	{
+		struct crypt_data* data = calloc(1, sizeof(struct crypt_data));
+		char* hashed = crypt_rn((char*) password, (char*) secret, data, sizeof(struct crypt_data));
+		matched = hashed && strlen(hashed) == strlen((char*) secret) && 
+			auth_compare((u8*) hashed, secret, strlen((char*) secret));
+		free(data);
+	}
+	else
+	{
+		u8 padded[AUTH_SECRET_MAX] = {0};
+		strncpy((char*) padded, (char*) password, DEFAULT_NAME_LENGTH);
+		matched = auth_compare(padded, secret, AUTH_SECRET_MAX);
+	}
+	if (!matched) { return AUTH_FAIL; }
+
+	// the queue only asks about the password, the account is claimed once the client is served
+	if (owner == DEFAULT_SOCKET) { return AUTH_SUCC; }
+
+	// claim the account for this session, racing logins for the same name see it taken,
+	// in a cluster the gateway also keeps it from being held on another backend
+	if (cluster_channel != DEFAULT_SOCKET ? cluster_claim(*id, owner, username) : auth_claim(*id, owner))
+	{
+		return AUTH_SUCC;
+	}
+
+	// unless it is only held by a detached session
+	i32 holder = __atomic_load_n(auth_owner(*id), __ATOMIC_ACQUIRE);
+	return session_take(*id, holder, owner) ? AUTH_SUCC : AUTH_USED;
+}
+
+u8 auth_claim(u32 id, i32 owner)
+{
+	i32 expected = DEFAULT_SOCKET;
+	return __atomic_compare_exchange_n(auth_owner(id), &expected, owner, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+u32 auth_lookup(u8* username)
+{
+	// owner cell of an account, LEADERBOARD_NIL once it is gone from the file
+	u32 slot;
+	u32 id = LEADERBOARD_NIL;
+	AuthDatabase* db = auth_enter(&slot);
+	u32 found = auth_find(db, username, hash_name(username));
+	if (found != LEADERBOARD_NIL)
+	{
+		id = db->accounts[found].owner;
+	}
+	auth_exit(slot);
+	return id;
+}
+
+u8 auth_premium(u8* username)
+{
+	u32 slot;
+	u8  premium = 0;
+	AuthDatabase* db = auth_enter(&slot);
+	u32 found = auth_find(db, username, hash_name(username));
+	if (found != LEADERBOARD_NIL)
+	{
+		premium = db->accounts[found].premium;
+	}
+	auth_exit(slot);
+	return premium;
+}
+
+void auth_hash(u8* password)
+{
+	char setting[CRYPT_GENSALT_OUTPUT_SIZE];
+	struct crypt_data data = {0};
+	if (!crypt_gensalt_rn(AUTH_HASH_PREFIX, AUTH_HASH_COST, 0, 0, setting, sizeof(setting)) ||
+		!crypt_rn((char*) password, setting, &data, sizeof(data)))
+	{
+		printf("Unable to hash password\n");
+		return;
+	}
+	printf("%s\n", data.output);
+}
+
+u32 auth_source(i32 socket)
+{
+	// logins are capped per address, ports don't count
+	struct sockaddr_storage address;
+	socklen_t address_size = sizeof(address);
+	if (getpeername(socket, (struct sockaddr*) &address, &address_size) < 0) { return 0; }
+	if (address.ss_family == AF_INET)
+	{
+		return ((struct sockaddr_in*) &address)->sin_addr.s_addr;
+	}
+	if (address.ss_family == AF_UNIX)
+	{
+		// local clients have no address, the user they run as stands in for one
+		struct ucred credentials;
+		socklen_t credentials_size = sizeof(credentials);
+		if (getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) < 0) { return 0; }
+		return ~credentials.uid;
+	}
+
+	u32 hash = 2166136261u;
+	u8* bytes = (u8*) &((struct sockaddr_in6*) &address)->sin6_addr;
+	for (u8 i = 0; i < 16; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void auth_complete(AuthJob* job, u8 status)
+{
+	u64 value = 1;
+	__atomic_store_n(&job->status, status, __ATOMIC_RELEASE);
+	write(job->event, &value, sizeof(value));
+}
+
+void auth_submit(AuthJob* job)
+{
+	#define aq auth_queue
+
+	pthread_mutex_lock(&auth_queue_mutex);
+
+	// count what this source already has in flight, the table is only as big as the pipeline
+	u32 free_slot = LEADERBOARD_NIL;
+	u32 slot      = 0;
+	for (; slot < AUTH_QUEUE_MAX + AUTH_VERIFIERS_MAX; slot++)
+	{
+		if (aq.pending[slot] && aq.sources[slot] == job->source) { break; }
+		if (!aq.pending[slot] && free_slot == LEADERBOARD_NIL) { free_slot = slot; }
+	}
+	if (slot == AUTH_QUEUE_MAX + AUTH_VERIFIERS_MAX) { slot = free_slot; }
+
+	// a full pipeline or a greedy source is turned away straight away
+	if (aq.count == AUTH_QUEUE_MAX || slot == LEADERBOARD_NIL || aq.pending[slot] >= AUTH_SOURCE_MAX)
+	{
+		pthread_mutex_unlock(&auth_queue_mutex);
+		WARN("Login rejected, too many in flight\n");
+		auth_complete(job, AUTH_FAIL);
+		return;
+	}
+
+	aq.sources[slot] = job->source;
+	aq.pending[slot]++;
+	aq.jobs[(aq.head + aq.count) % AUTH_QUEUE_MAX] = job;
+	aq.count++;
+	pthread_cond_signal(&auth_queue_cond);
+	pthread_mutex_unlock(&auth_queue_mutex);
+
+	#undef aq
+}
+
+void* auth_verify_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	#define aq auth_queue
+
+	while (1)
+	{
+		pthread_mutex_lock(&auth_queue_mutex);
+		while (!aq.count)
+		{
+			pthread_cond_wait(&auth_queue_cond, &auth_queue_mutex);
+		}
+		AuthJob* job = aq.jobs[aq.head];
+		aq.head = (aq.head + 1) % AUTH_QUEUE_MAX;
+		aq.count--;
+		pthread_mutex_unlock(&auth_queue_mutex);
+
+		// the slow part, workers carry on with their sessions meanwhile
+		u8 status = auth_check(job->username, job->password, job->owner, &job->id);
+
+		pthread_mutex_lock(&auth_queue_mutex);
+		for (u32 slot = 0; slot < AUTH_QUEUE_MAX + AUTH_VERIFIERS_MAX; slot++)
+		{
+			if (aq.pending[slot] && aq.sources[slot] == job->source)
+			{
+				aq.pending[slot]--;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&auth_queue_mutex);
+
+		auth_complete(job, status);
+	}
+
+	#undef aq
+}
+
+void auth_release(u32 id, i32 owner, u8* username)
+{
+	// only the owning session can give the account back, a backend tells the gateway in claim order
+	i32 expected = owner;
+	if (cluster_channel == DEFAULT_SOCKET)
+	{
+		__atomic_compare_exchange_n(auth_owner(id), &expected, DEFAULT_SOCKET, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+		return;
+	}
+	pthread_mutex_lock(&cluster_mutex);
+	if (__atomic_compare_exchange_n(auth_owner(id), &expected, DEFAULT_SOCKET, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+		cluster_release(username);
+	}
+	pthread_mutex_unlock(&cluster_mutex);
+}
+
+// hashing
+u32 hash_name(u8* name)
+{
+	// fnv-1a
+	u32 hash = 2166136261u;
+	for (u8 i = 0; i < DEFAULT_NAME_LENGTH && name[i]; i++)
+	{
+		hash ^= name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+i32 name_compare(u8* a, u8* b)
+{
+	// alphabetical first, ignoring case
+	for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+	{
+		u8 a_char = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 32 : a[i];
+		u8 b_char = (b[i] >= 'a' && b[i] <= 'z') ? b[i] - 32 : b[i];
+		if (a_char != b_char) { return (a_char < b_char) ? -1 : 1; }
+		if (!a_char) { break; }
+	}
+
+	// then exact, so that two names are only equal if they are the same name
+	for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+	{
+		if (a[i] != b[i]) { return (a[i] < b[i]) ? -1 : 1; }
+		if (!a[i]) { break; }
+	}
+	return 0;
+}
+
+// leaderboard
+#define NODE(id)	lb->nodes[(id) * LEADERBOARD_SORT_KEYS + key]
+#define SIZE(id)	(((id) == LEADERBOARD_NIL) ? 0 : NODE(id).size)
+
+void leaderboard_init(Leaderboard* lb)
+{
+	// zero everything out, storage is only allocated once it is needed
+	lb->entries  		= 0;
+	lb->nodes    		= 0;
+	lb->lookup   		= 0;
+	lb->count    		= 0;
+	lb->capacity 		= 0;
+	lb->lookup_capacity = 0;
+	lb->seed     		= DEFAULT_RANDOM_SEED;
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		lb->roots[key]       = LEADERBOARD_NIL;
+		lb->dirty_first[key] = LEADERBOARD_NIL;
+		lb->dirty_last[key]  = 0;
+	}
+}
+
+void leaderboard_free(Leaderboard* lb)
+{
+	free(lb->entries);
+	free(lb->nodes);
+	free(lb->lookup);
+	leaderboard_init(lb);
+}
+
+i32 leaderboard_compare(u8 key, LeaderboardEntry* a, LeaderboardEntry* b)
+{
+	// negative when a ranks above b
+	switch (key)
+	{
+		case LEADERBOARD_SORT_TIME:
+			if (a->seconds != b->seconds) { return (a->seconds < b->seconds) ? -1 : 1; }
+			if (a->nano    != b->nano)    { return (a->nano    < b->nano)    ? -1 : 1; }
+			if (a->won     != b->won)     { return (a->won     > b->won)     ? -1 : 1; }
+			break;
+		case LEADERBOARD_SORT_RATE:
+		{
+			// cross multiply rather than divide
+			u64 a_rate = (u64) a->won * b->played;
+			u64 b_rate = (u64) b->won * a->played;
+			if (a_rate != b_rate)         { return (a_rate > b_rate) ? -1 : 1; }
+			if (a->won != b->won)         { return (a->won > b->won) ? -1 : 1; }
+			break;
+		}
+		case LEADERBOARD_SORT_WON:
+			if (a->won    != b->won)      { return (a->won    > b->won)    ? -1 : 1; }
+			if (a->played != b->played)   { return (a->played < b->played) ? -1 : 1; }
+			break;
+		case LEADERBOARD_SORT_PLAYED:
+			if (a->played != b->played)   { return (a->played > b->played) ? -1 : 1; }
+			break;
+		case LEADERBOARD_SORT_RATING:
+			if (a->rating.rating != b->rating.rating) { return (a->rating.rating > b->rating.rating) ? -1 : 1; }
+			break;
+	}
+	return name_compare(a->username, b->username);
+}
+
+u8 leaderboard_indexed(LeaderboardEntry* entry, u8 key)
+{
+	// only champions have a time worth ranking, and expired entries rank nowhere
+	return entry->played && (key != LEADERBOARD_SORT_TIME || entry->won);
+}
+
+void rank_update(Leaderboard* lb, u8 key, u32 id)
+{
+	NODE(id).size = 1 + SIZE(NODE(id).left) + SIZE(NODE(id).right);
+}
+
+void rank_split(Leaderboard* lb, u8 key, u32 tree, LeaderboardEntry* probe, u32* left, u32* right)
+{
+	// left receives everything ranked above the probe
+	if (tree == LEADERBOARD_NIL)
+	{
+		*left  = LEADERBOARD_NIL;
+		*right = LEADERBOARD_NIL;
+		return;
+	}
+
+	if (leaderboard_compare(key, &lb->entries[tree], probe) < 0)
+	{
+		rank_split(lb, key, NODE(tree).right, probe, &NODE(tree).right, right);
+		*left = tree;
+	}
+	else
+	{
+		rank_split(lb, key, NODE(tree).left, probe, left, &NODE(tree).left);
+		*right = tree;
+	}
+	rank_update(lb, key, tree);
+}
+
+u32 rank_merge(Leaderboard* lb, u8 key, u32 left, u32 right)
+{
+	if (left  == LEADERBOARD_NIL) { return right; }
+	if (right == LEADERBOARD_NIL) { return left;  }
+
+	if (lb->entries[left].priority > lb->entries[right].priority)
+	{
+		NODE(left).right = rank_merge(lb, key, NODE(left).right, right);
+		rank_update(lb, key, left);
+		return left;
+	}
+	else
+	{
+		NODE(right).left = rank_merge(lb, key, left, NODE(right).left);
+		rank_update(lb, key, right);
+		return right;
+	}
+}
+
+u32 rank_insert(Leaderboard* lb, u8 key, u32 tree, u32 id)
+{
+	if (tree == LEADERBOARD_NIL)
+	{
+		NODE(id).left  = LEADERBOARD_NIL;
+		NODE(id).right = LEADERBOARD_NIL;
+		NODE(id).size  = 1;
+		return id;
+	}
+
+	if (lb->entries[id].priority > lb->entries[tree].priority)
+	{
+		rank_split(lb, key, tree, &lb->entries[id], &NODE(id).left, &NODE(id).right);
+		rank_update(lb, key, id);
+		return id;
+	}
+
+	if (leaderboard_compare(key, &lb->entries[id], &lb->entries[tree]) < 0)
+	{
+		NODE(tree).left = rank_insert(lb, key, NODE(tree).left, id);
+	}
+	else
+	{
+		NODE(tree).right = rank_insert(lb, key, NODE(tree).right, id);
+	}
+	rank_update(lb, key, tree);
+	return tree;
+}
+
+u32 rank_remove(Leaderboard* lb, u8 key, u32 tree, u32 id)
+{
+	if (tree == id)
+	{
+		return rank_merge(lb, key, NODE(tree).left, NODE(tree).right);
+	}
+
+	if (leaderboard_compare(key, &lb->entries[id], &lb->entries[tree]) < 0)
+	{
+		NODE(tree).left = rank_remove(lb, key, NODE(tree).left, id);
+	}
+	else
+	{
+		NODE(tree).right = rank_remove(lb, key, NODE(tree).right, id);
+	}
+	rank_update(lb, key, tree);
+	return tree;
+}
+
+u32 rank_of(Leaderboard* lb, u8 key, u32 id)
+{
+	// zero based, walks a single path from the root
+	u32 rank = 0;
+	u32 tree = lb->roots[key];
+	while (tree != LEADERBOARD_NIL)
+	{
+		i32 order = leaderboard_compare(key, &lb->entries[id], &lb->entries[tree]);
+		if (order < 0)
+		{
+			tree = NODE(tree).left;
+		}
+		else if (order > 0)
+		{
+			rank += SIZE(NODE(tree).left) + 1;
+			tree  = NODE(tree).right;
+		}
+		else
+		{
+			return rank + SIZE(NODE(tree).left);
+		}
+	}
+	return LEADERBOARD_NIL;
+}
+
+u32 rank_bound(Leaderboard* lb, u8 key, LeaderboardEntry* probe)
+{
+	// number of entries ranked at or above the probe
+	u32 rank = 0;
+	u32 tree = lb->roots[key];
+	while (tree != LEADERBOARD_NIL)
+	{
+		if (leaderboard_compare(key, &lb->entries[tree], probe) <= 0)
+		{
+			rank += SIZE(NODE(tree).left) + 1;
+			tree  = NODE(tree).right;
+		}
+		else
+		{
+			tree = NODE(tree).left;
+		}
+	}
+	return rank;
+}
+
+u32 rank_walk(Leaderboard* lb, u8 key, u32 tree, u32 first, u32 count, u32* ids)
+{
+	// in order, skipping whole subtrees that sit before first
+	u32 found = 0;
+	while (tree != LEADERBOARD_NIL && found < count)
+	{
+		u32 left_size = SIZE(NODE(tree).left);
+		if (first < left_size)
+		{
+			found += rank_walk(lb, key, NODE(tree).left, first, count - found, ids + found);
+			first  = 0;
+		}
+		else
+		{
+			first -= left_size;
+		}
+
+		if (found < count && first == 0)
+		{
+			ids[found] = tree;
+			found++;
+		}
+		else if (first > 0)
+		{
+			first--;
+		}
+		tree = NODE(tree).right;
+	}
+	return found;
+}
+
+#undef NODE
+#undef SIZE
+
+void leaderboard_link(Leaderboard* lb, u32 id)
+{
+	if (!lb->nodes) { return; }
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		if (leaderboard_indexed(&lb->entries[id], key))
+		{
+			lb->roots[key] = rank_insert(lb, key, lb->roots[key], id);
+		}
+	}
+}
+
+void leaderboard_unlink(Leaderboard* lb, u32 id)
+{
+	if (!lb->nodes) { return; }
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		if (leaderboard_indexed(&lb->entries[id], key))
+		{
+			lb->roots[key] = rank_remove(lb, key, lb->roots[key], id);
+		}
+	}
+}
+
+void leaderboard_ranks(Leaderboard* lb, u32 id, u32* ranks)
+{
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		ranks[key] = (lb->nodes && leaderboard_indexed(&lb->entries[id], key)) ? 
+			rank_of(lb, key, id) : LEADERBOARD_NIL;
+	}
+}
+
+void leaderboard_touch(Leaderboard* lb, u8 key, u32 first, u32 last)
+{
+	if (first < lb->dirty_first[key]) { lb->dirty_first[key] = first; }
+	if (last  > lb->dirty_last[key])  { lb->dirty_last[key]  = last;  }
+}
+
+void leaderboard_moved(Leaderboard* lb, u32 id, u32* before)
+{
+	if (!lb->nodes) { return; }
+
+	// everything between the old and new rank shifted by one
+	u32 after[LEADERBOARD_SORT_KEYS];
+	leaderboard_ranks(lb, id, after);
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		if (after[key] == LEADERBOARD_NIL)
+		{
+			// dropped out of this index, everyone below moved up
+			if (before[key] != LEADERBOARD_NIL)
+			{
+				u32 size = leaderboard_size(lb, key);
+				leaderboard_touch(lb, key, before[key], (size > before[key]) ? size : before[key]);
+			}
+			continue;
+		}
+		if (before[key] == LEADERBOARD_NIL)
+		{
+			// new to this index, everyone below moved down
+			leaderboard_touch(lb, key, after[key], leaderboard_size(lb, key) - 1);
+		}
+		else if (before[key] < after[key])
+		{
+			leaderboard_touch(lb, key, before[key], after[key]);
+		}
+		else
+		{
+			leaderboard_touch(lb, key, after[key], before[key]);
+		}
+	}
+}
+
+u32 leaderboard_find(Leaderboard* lb, u8* username)
+{
+	// small boards are cheaper to scan than to hash
+	if (!lb->lookup)
+	{
+		for (u32 id = 0; id < lb->count; id++)
+		{
+			if (!name_compare(lb->entries[id].username, username)) { return id; }
+		}
+		return LEADERBOARD_NIL;
+	}
+
+	u32 mask = lb->lookup_capacity - 1;
+	for (u32 slot = hash_name(username) & mask; ; slot = (slot + 1) & mask)
+	{
+		u32 id = lb->lookup[slot];
+		if (id == LEADERBOARD_NIL) { return LEADERBOARD_NIL; }
+		if (!name_compare(lb->entries[id].username, username)) { return id; }
+	}
+}
+
+void leaderboard_lookup_insert(Leaderboard* lb, u32 id)
+{
+	u32 mask = lb->lookup_capacity - 1;
+	u32 slot = hash_name(lb->entries[id].username) & mask;
+	while (lb->lookup[slot] != LEADERBOARD_NIL)
+	{
+		slot = (slot + 1) & mask;
+	}
+	lb->lookup[slot] = id;
+}
+
+u32 leaderboard_insert(Leaderboard* lb, u8* username)
+{
+	// grow storage
+	if (lb->count == lb->capacity)
+	{
+		lb->capacity = lb->capacity ? lb->capacity * 2 : 4;
+		lb->entries  = realloc(lb->entries, sizeof(LeaderboardEntry) * lb->capacity);
+		if (lb->nodes)
+		{
+			lb->nodes = realloc(lb->nodes, sizeof(RankNode) * LEADERBOARD_SORT_KEYS * lb->capacity);
+		}
+	}
+
+	// grow lookup once past small, keeping it at most half full
+	if (lb->count + 1 > LEADERBOARD_SMALL && (lb->count + 1) * 2 > lb->lookup_capacity)
+	{
+		free(lb->lookup);
+		lb->lookup_capacity = lb->lookup_capacity ? lb->lookup_capacity * 2 : LEADERBOARD_LOOKUP_INIT;
+		lb->lookup = malloc(sizeof(u32) * lb->lookup_capacity);
+		for (u32 i = 0; i < lb->lookup_capacity; i++)
+		{
+			lb->lookup[i] = LEADERBOARD_NIL;
+		}
+		for (u32 i = 0; i < lb->count; i++)
+		{
+			leaderboard_lookup_insert(lb, i);
+		}
+	}
+
+	// new entry
+	u32 id = lb->count;
+	LeaderboardEntry* entry = &lb->entries[id];
+	for (u8 i = 0; i < DEFAULT_NAME_LENGTH; i++)
+	{
+		entry->username[i] = username[i];
+		if (!username[i])
+		{
+			for (; i < DEFAULT_NAME_LENGTH; i++) { entry->username[i] = 0; }
+			break;
+		}
+	}
+	entry->seconds = 0;
+	entry->nano    = 0;
+	entry->won     = 0;
+	entry->played  = 0;
+	entry->rating  = rating_initial();
+
+	// xorshift, only needs to be well spread
+	lb->seed ^= lb->seed << 13;
+	lb->seed ^= lb->seed >> 17;
+	lb->seed ^= lb->seed << 5;
+	entry->priority = lb->seed;
+
+	lb->count++;
+	if (lb->lookup)
+	{
+		leaderboard_lookup_insert(lb, id);
+	}
+	return id;
+}
+
+u32 leaderboard_played(Leaderboard* lb, u8* username)
+{
+	u32 before[LEADERBOARD_SORT_KEYS];
+	u32 id = leaderboard_find(lb, username);
+	if (id == LEADERBOARD_NIL)
+	{
+		DEBUG("New leaderboard entry\n");
+		id = leaderboard_insert(lb, username);
+		for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+		{
+			before[key] = LEADERBOARD_NIL;
+		}
+	}
+	else
+	{
+		leaderboard_ranks(lb, id, before);
+		leaderboard_unlink(lb, id);
+	}
+
+	lb->entries[id].played++;
+	DEBUG("Games played -> %u\n", lb->entries[id].played);
+	leaderboard_link(lb, id);
+	leaderboard_moved(lb, id, before);
+	return id;
+}
+
+u32 leaderboard_won(Leaderboard* lb, u8* username, struct timespec dt)
+{
+	u32 before[LEADERBOARD_SORT_KEYS];
+	u32 id = leaderboard_find(lb, username);
+	if (id == LEADERBOARD_NIL)
+	{
+		// the game's start went with a board that was evicted or rotated meanwhile, it still counts as played
+		id = leaderboard_insert(lb, username);
+		lb->entries[id].played = 1;
+		for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+		{
+			before[key] = LEADERBOARD_NIL;
+		}
+	}
+	else
+	{
+		leaderboard_ranks(lb, id, before);
+		leaderboard_unlink(lb, id);
+	}
+
+	LeaderboardEntry* entry = &lb->entries[id];
+
+	entry->won++;
+	DEBUG("Games won -> %u\n", entry->won);
+
+	// now compare results
+	if (entry->won == 1 || dt.tv_sec < entry->seconds || 
+		(dt.tv_sec == entry->seconds && dt.tv_nsec < entry->nano))
+	{
+		DEBUG("Win time was better than leaderboard!\n");
+		entry->seconds = (i64) dt.tv_sec;
+		entry->nano    = (i64) dt.tv_nsec;
+	}
+	else
+	{
+		DEBUG("Win time was worse than leaderboard ...\n");
+	}
+
+	leaderboard_link(lb, id);
+	leaderboard_moved(lb, id, before);
+	return id;
+}
+
+void leaderboard_set(Leaderboard* lb, u32 id, i64 seconds, i64 nano, u32 won, u32 played)
+{
+	u32 before[LEADERBOARD_SORT_KEYS];
+	LeaderboardEntry* entry = &lb->entries[id];
+	leaderboard_ranks(lb, id, before);
+	leaderboard_unlink(lb, id);
+
+	entry->seconds = seconds;
+	entry->nano    = nano;
+	entry->won     = won;
+	entry->played  = played;
+
+	leaderboard_link(lb, id);
+	leaderboard_moved(lb, id, before);
+}
+
+void leaderboard_rate(Leaderboard* lb, u32 id, Rating rating)
+{
+	u32 before[LEADERBOARD_SORT_KEYS];
+	leaderboard_ranks(lb, id, before);
+	leaderboard_unlink(lb, id);
+
+	lb->entries[id].rating = rating;
+
+	leaderboard_link(lb, id);
+	leaderboard_moved(lb, id, before);
+}
+
+u32 leaderboard_collect(Leaderboard* lb, u8 key, u32 first, u32 count, u32* ids)
+{
+	return rank_walk(lb, key, lb->roots[key], first, count, ids);
+}
+
+u32 leaderboard_size(Leaderboard* lb, u8 key)
+{
+	return (lb->roots[key] == LEADERBOARD_NIL) ? 0 : lb->nodes[lb->roots[key] * LEADERBOARD_SORT_KEYS + key].size;
+}
+
+u8 leaderboard_expand(Leaderboard* lb)
+{
+	// build the rank indices, a board is only indexed while someone reads it
+	if (lb->nodes) { return 0; }
+
+	lb->nodes = malloc(sizeof(RankNode) * LEADERBOARD_SORT_KEYS * (lb->capacity ? lb->capacity : 1));
+	for (u32 id = 0; id < lb->count; id++)
+	{
+		leaderboard_link(lb, id);
+	}
+
+	// readers that were watching need a fresh copy
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		u32 size = leaderboard_size(lb, key);
+		if (size) { leaderboard_touch(lb, key, 0, size - 1); }
+	}
+	return 1;
+}
+
+void leaderboard_compact(Leaderboard* lb)
+{
+	// drop the indices, the results and lookup are kept with storage trimmed to fit
+	free(lb->nodes);
+	lb->nodes = 0;
+	if (lb->count && lb->count < lb->capacity)
+	{
+		lb->capacity = lb->count;
+		lb->entries  = realloc(lb->entries, sizeof(LeaderboardEntry) * lb->capacity);
+	}
+	for (u8 key = 0; key < LEADERBOARD_SORT_KEYS; key++)
+	{
+		lb->roots[key]       = LEADERBOARD_NIL;
+		lb->dirty_first[key] = LEADERBOARD_NIL;
+		lb->dirty_last[key]  = 0;
+	}
+}
+
+u8 leaderboard_query(Leaderboard* lb, u8* request, u8* username, u8 frames[][DEFAULT_MSG_LEN])
+{
+	u8* request_pointer = request + LEN_TYPE_LEAD_Q;
+	u8  kind   = request_pointer[0];
+	u8  key    = request_pointer[1];
+	u8  window = request_pointer[2];
+	u32 count  = ((u32) request_pointer[3] << 8) | request_pointer[4];
+	request_pointer += LEADERBOARD_QUERY_HEADER - LEN_TYPE_LEAD_Q;
+
+	if (key >= LEADERBOARD_SORT_KEYS) { return 0; }
+	if (count == 0) 					{ count = 1; }
+	if (count > LEADERBOARD_QUERY_MAX) 	{ count = LEADERBOARD_QUERY_MAX; }
+
+	// optional username for rank queries
+	u8 target[DEFAULT_NAME_LENGTH] = {0};
+	if ((kind == LEADERBOARD_QUERY_RANK || kind == LEADERBOARD_QUERY_AROUND) && 
+		parse_field(&request_pointer, target, MESSAGE_DATA_USERNAME, LEN_DATA_USERNAME, DEFAULT_NAME_LENGTH - 1))
+	{
+		username = target;
+	}
+
+	// resolve the window
+	u32 total = leaderboard_size(lb, key);
+	u32 first = 0;
+	switch (kind)
+	{
+		case LEADERBOARD_QUERY_PAGE:
+		{
+			first = read_u32(request_pointer);
+			break;
+		}
+		case LEADERBOARD_QUERY_RANK:
+		case LEADERBOARD_QUERY_AROUND:
+		{
+			u32 id = leaderboard_find(lb, username);
+			if (id == LEADERBOARD_NIL || !leaderboard_indexed(&lb->entries[id], key)) { return 0; }
+
+			first = rank_of(lb, key, id);
+			if (kind == LEADERBOARD_QUERY_RANK)
+			{
+				count = 1;
+			}
+			else
+			{
+				// centre on the user, sliding the window back in at the bottom
+				first = (first > count / 2) ? first - count / 2 : 0;
+				if (first + count > total)
+				{
+					first = (total > count) ? total - count : 0;
+				}
+			}
+			break;
+		}
+		case LEADERBOARD_QUERY_CURSOR:
+		{
+			// the cursor carries the values the last entry was ranked with
+			u32 id = read_u32(request_pointer);
+			if (id >= lb->count) { return 0; }
+
+			LeaderboardEntry probe = lb->entries[id];
+			probe.seconds = read_u32(request_pointer + 4);
+			probe.nano    = read_u32(request_pointer + 8);
+			probe.won     = read_u32(request_pointer + 12);
+			probe.played  = read_u32(request_pointer + 16);
+			u64 bits      = read_u64(request_pointer + 20);
+			memcpy(&probe.rating.rating, &bits, sizeof(bits));
+			first = rank_bound(lb, key, &probe);
+			break;
+		}
+		default:
+			return 0;
+	}
+	if (first >= total) { return 0; }
+
+	// gather
+	u32 ids[LEADERBOARD_QUERY_MAX];
+	count = leaderboard_collect(lb, key, first, count, ids);
+
+	// serialize, a frame at a time
+	u8 frame_count = 0;
+	for (u32 i = 0; i < count; i += LEADERBOARD_FRAME_ENTRIES)
+	{
+		u8* frame = frames[frame_count];
+		u8  in_frame = (count - i < LEADERBOARD_FRAME_ENTRIES) ? count - i : LEADERBOARD_FRAME_ENTRIES;
+		u8  last = (i + in_frame == count);
+
+		for (u8 j = 0; j < LEN_TYPE_LEAD_S; j++)
+		{
+			frame[j] = MESSAGE_TYPE_LEAD_S[j];
+		}
+		frame[LEN_TYPE_LEAD_S + 0] = kind;
+		frame[LEN_TYPE_LEAD_S + 1] = key;
+		frame[LEN_TYPE_LEAD_S + 2] = window;
+		frame[LEN_TYPE_LEAD_S + 3] = last ? 0 : LEADERBOARD_FLAG_MORE;
+		frame[LEN_TYPE_LEAD_S + 4] = frame_count;
+		write_u32(frame + LEN_TYPE_LEAD_S + 5, total);
+		write_u32(frame + LEN_TYPE_LEAD_S + 9, first + i);
+		frame[LEN_TYPE_LEAD_S + 13] = in_frame;
+		for (u8 j = 0; j < GAME_MODE_LEN; j++)
+		{
+			frame[LEN_TYPE_LEAD_S + 14 + j] = request[LEN_TYPE_LEAD_Q + 5 + j];
+		}
+
+		u8* frame_pointer = frame + LEADERBOARD_FRAME_HEADER;
+		for (u8 j = 0; j < in_frame; j++)
+		{
+			LeaderboardEntry* entry = &lb->entries[ids[i + j]];
+			for (u8 k = 0; k < DEFAULT_NAME_LENGTH; k++)
+			{
+				frame_pointer[k] = entry->username[k];
+			}
+			frame_pointer += DEFAULT_NAME_LENGTH;
+			write_u32(frame_pointer + 0,  (u32) entry->seconds);
+			write_u32(frame_pointer + 4,  (u32) entry->nano);
+			write_u32(frame_pointer + 8,  entry->won);
+			write_u32(frame_pointer + 12, entry->played);
+			write_u32(frame_pointer + 16, (u32) lround(fmax(entry->rating.rating, 0)));
+			frame_pointer += 20;
+		}
+
+		// the cursor resumes after the last entry sent
+		if (last)
+		{
+			LeaderboardEntry* entry = &lb->entries[ids[count - 1]];
+			write_u32(frame_pointer + 0,  ids[count - 1]);
+			write_u32(frame_pointer + 4,  (u32) entry->seconds);
+			write_u32(frame_pointer + 8,  (u32) entry->nano);
+			write_u32(frame_pointer + 12, entry->won);
+			write_u32(frame_pointer + 16, entry->played);
+			u64 bits;
+			memcpy(&bits, &entry->rating.rating, sizeof(bits));
+			write_u64(frame_pointer + 20, bits);
+			frame_pointer += LEADERBOARD_CURSOR_LEN;
+		}
+		*frame_pointer = END_OF_TRANSMISSION;
+		frame_count++;
+	}
+
+	return frame_count;
+}
+
+// leaderboard windows
+void window_init(LeaderboardWindow* window, u16 bucket_count, i64 bucket_width)
+{
+	leaderboard_init(&window->board);
+	window->bucket_count = bucket_count;
+	window->bucket_width = bucket_width;
+	window->buckets      = 0;
+	window->epoch        = bucket_count ? time(0) / bucket_width : 0;
+}
+
+void window_free(LeaderboardWindow* window)
+{
+	leaderboard_free(&window->board);
+	if (window->buckets)
+	{
+		for (u16 i = 0; i < window->bucket_count; i++)
+		{
+			leaderboard_free(&window->buckets[i]);
+		}
+		free(window->buckets);
+		window->buckets = 0;
+	}
+}
+
+LeaderboardEntry* window_result(LeaderboardWindow* window, u8* username)
+{
+	// each bucket is an unindexed tally of the results within it, made on first result
+	if (!window->buckets)
+	{
+		window->buckets = malloc(sizeof(Leaderboard) * window->bucket_count);
+		for (u16 i = 0; i < window->bucket_count; i++)
+		{
+			leaderboard_init(&window->buckets[i]);
+		}
+	}
+
+	Leaderboard* bucket = &window->buckets[window->epoch % window->bucket_count];
+	u32 id = leaderboard_find(bucket, username);
+	if (id == LEADERBOARD_NIL)
+	{
+		id = leaderboard_insert(bucket, username);
+	}
+	return &bucket->entries[id];
+}
+
+void window_played(LeaderboardWindow* window, u8* username)
+{
+	if (window->bucket_count)
+	{
+		window_result(window, username)->played++;
+	}
+	leaderboard_played(&window->board, username);
+}
+
+void window_won(LeaderboardWindow* window, u8* username, struct timespec dt)
+{
+	if (window->bucket_count)
+	{
+		LeaderboardEntry* result = window_result(window, username);
+		result->won++;
+		if (result->won == 1 || dt.tv_sec < result->seconds || 
+			(dt.tv_sec == result->seconds && dt.tv_nsec < result->nano))
+		{
+			result->seconds = (i64) dt.tv_sec;
+			result->nano    = (i64) dt.tv_nsec;
+		}
+	}
+	leaderboard_won(&window->board, username, dt);
+}
+
+void window_rotate(LeaderboardWindow* window, pthread_mutex_t* lock)
+{
+	// swap a fresh bucket in as the current one, ingestion carries on straight away
+	pthread_mutex_lock(lock);
+	window->epoch++;
+	if (!window->buckets)
+	{
+		pthread_mutex_unlock(lock);
+		return;
+	}
+	Leaderboard expired = window->buckets[window->epoch % window->bucket_count];
+	leaderboard_init(&window->buckets[window->epoch % window->bucket_count]);
+	pthread_mutex_unlock(lock);
+
+	DEBUG("Expiring %u results from a leaderboard window\n", expired.count);
+
+	// back the expired results out of the aggregate, a batch per lock
+	for (u32 i = 0; i < expired.count; i += WINDOW_EXPIRE_BATCH)
+	{
+		pthread_mutex_lock(lock);
+		for (u32 j = i; j < expired.count && j < i + WINDOW_EXPIRE_BATCH; j++)
+		{
+			LeaderboardEntry* result = &expired.entries[j];
+			u32 id = leaderboard_find(&window->board, result->username);
+			if (id == LEADERBOARD_NIL) { continue; }
+
+			LeaderboardEntry* entry = &window->board.entries[id];
+			u32 played  = (entry->played > result->played) ? entry->played - result->played : 0;
+			u32 won     = (entry->won    > result->won)    ? entry->won    - result->won    : 0;
+			i64 seconds = entry->seconds;
+			i64 nano    = entry->nano;
+
+			// the best time only needs rebuilding if it came from this bucket
+			if (!won)
+			{
+				seconds = 0;
+				nano    = 0;
+			}
+			else if (result->won && result->seconds == seconds && result->nano == nano)
+			{
+				u8 found = 0;
+				for (u16 b = 0; b < window->bucket_count; b++)
+				{
+					Leaderboard* bucket = &window->buckets[b];
+					u32 bucket_id = leaderboard_find(bucket, result->username);
+					if (bucket_id == LEADERBOARD_NIL || !bucket->entries[bucket_id].won) { continue; }
+
+					LeaderboardEntry* other = &bucket->entries[bucket_id];
+					if (!found || other->seconds < seconds || (other->seconds == seconds && other->nano < nano))
+					{
+						seconds = other->seconds;
+						nano    = other->nano;
+						found   = 1;
+					}
+				}
+			}
+
+			leaderboard_set(&window->board, id, seconds, nano, won, played);
+		}
+		pthread_mutex_unlock(lock);
+	}
+
+	leaderboard_free(&expired);
+}
+
+void* leaderboard_rotate_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	while (1)
+	{
+		// every set shares the same bucket boundaries, the default one is always there
+		u32 set_count;
+		LeaderboardSet** sets = registry_collect(&set_count);
+
+		// sleep until the closest bucket boundary
+		i64 now  = time(0);
+		i64 next = 0;
+		for (u32 s = 0; s < set_count; s++)
+		{
+			for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+			{
+				#define w sets[s]->windows[i]
+				if (!w.bucket_count) { continue; }
+
+				i64 boundary = (w.epoch + 1) * w.bucket_width;
+				if (!next || boundary < next) { next = boundary; }
+				#undef w
+			}
+		}
+		for (u32 s = 0; s < set_count; s++)
+		{
+			registry_release(sets[s]);
+		}
+		free(sets);
+		if (next > now) { sleep(next - now); }
+
+		// rotate out every bucket that has fallen out of its window, a set at a time
+		now  = time(0);
+		sets = registry_collect(&set_count);
+		for (u32 s = 0; s < set_count; s++)
+		{
+			for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+			{
+				#define w sets[s]->windows[i]
+				if (!w.bucket_count) { continue; }
+
+				// after a long gap, a single lap clears everything
+				i64 target = now / w.bucket_width;
+				if (target - w.epoch > w.bucket_count)
+				{
+					pthread_mutex_lock(&sets[s]->lock);
+					w.epoch = target - w.bucket_count;
+					pthread_mutex_unlock(&sets[s]->lock);
+				}
+				while (w.epoch < target)
+				{
+					window_rotate(&w, &sets[s]->lock);
+				}
+				#undef w
+			}
+			registry_release(sets[s]);
+		}
+		free(sets);
+	}
+}
+
+// leaderboard registry
+u32 registry_slot(u64 mode)
+{
+	// fibonacci hashing spreads the packed mode fields
+	return (u32) ((mode * 0x9e3779b97f4a7c15ull) >> 32) & (registry.capacity - 1);
+}
+
+void registry_place(LeaderboardSet* set)
+{
+	u32 mask = registry.capacity - 1;
+	u32 slot = registry_slot(set->mode);
+	while (registry.sets[slot])
+	{
+		slot = (slot + 1) & mask;
+	}
+	registry.sets[slot] = set;
+}
+
+void registry_remove(u32 slot)
+{
+	// shift the rest of the probe chain back, no tombstones needed
+	u32 mask = registry.capacity - 1;
+	u32 next = (slot + 1) & mask;
+	registry.sets[slot] = 0;
+	while (registry.sets[next])
+	{
+		u32 home = registry_slot(registry.sets[next]->mode);
+		if (((next - home) & mask) >= ((next - slot) & mask))
+		{
+			registry.sets[slot] = registry.sets[next];
+			registry.sets[next] = 0;
+			slot = next;
+		}
+		next = (next + 1) & mask;
+	}
+}
+
+void registry_init()
+{
+	registry.count    = 0;
+	registry.clock    = 0;
+	registry.capacity = REGISTRY_INIT;
+	registry.sets     = calloc(registry.capacity, sizeof(LeaderboardSet*));
+
+	// the default mode is never evicted
+	registry_release(registry_acquire(GAME_MODE_DEFAULT, 1));
+}
+
+LeaderboardSet* registry_acquire(u64 mode, u8 create)
+{
+	pthread_mutex_lock(&registry_mutex);
+
+	u32 mask = registry.capacity - 1;
+	u32 slot = registry_slot(mode);
+	while (registry.sets[slot] && registry.sets[slot]->mode != mode)
+	{
+		slot = (slot + 1) & mask;
+	}
+
+	LeaderboardSet* set = registry.sets[slot];
+	if (!set && create)
+	{
+		// grow, keeping the table at most half full
+		if ((registry.count + 1) * 2 > registry.capacity)
+		{
+			LeaderboardSet** old = registry.sets;
+			u32 old_capacity     = registry.capacity;
+			registry.capacity   *= 2;
+			registry.sets        = calloc(registry.capacity, sizeof(LeaderboardSet*));
+			for (u32 i = 0; i < old_capacity; i++)
+			{
+				if (old[i]) { registry_place(old[i]); }
+			}
+			free(old);
+		}
+
+		// all time never expires
+		set = malloc(sizeof(LeaderboardSet));
+		set->mode    = mode;
+		set->refs    = 0;
+		set->indexed = 0;
+		set->history          = 0;
+		set->history_count    = 0;
+		set->history_capacity = 0;
+		pthread_mutex_init(&set->lock, 0);
+		window_init(&set->windows[LEADERBOARD_WINDOW_ALL],    0,                     0);
+		window_init(&set->windows[LEADERBOARD_WINDOW_DAILY],  WINDOW_DAILY_BUCKETS,  WINDOW_DAILY_WIDTH);
+		window_init(&set->windows[LEADERBOARD_WINDOW_WEEKLY], WINDOW_WEEKLY_BUCKETS, WINDOW_WEEKLY_WIDTH);
+		registry_place(set);
+		registry.count++;
+		DEBUG("New leaderboard set for mode %016llx\n", (unsigned long long) mode);
+	}
+
+	if (set)
+	{
+		set->refs++;
+		set->last_used = ++registry.clock;
+	}
+
+	pthread_mutex_unlock(&registry_mutex);
+	return set;
+}
+
+LeaderboardSet** registry_collect(u32* count)
+{
+	// hold every set so none disappear while the caller walks them
+	pthread_mutex_lock(&registry_mutex);
+	LeaderboardSet** sets = malloc(sizeof(LeaderboardSet*) * (registry.count ? registry.count : 1));
+	*count = 0;
+	for (u32 i = 0; i < registry.capacity; i++)
+	{
+		if (!registry.sets[i]) { continue; }
+		registry.sets[i]->refs++;
+		sets[*count] = registry.sets[i];
+		(*count)++;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+	return sets;
+}
+
+void registry_release(LeaderboardSet* set)
+{
+	pthread_mutex_lock(&registry_mutex);
+	set->refs--;
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+Leaderboard* registry_board(LeaderboardSet* set, u8 window)
+{
+	return (set && window < LEADERBOARD_WINDOWS) ? &set->windows[window].board : 0;
+}
+
+void registry_expand(LeaderboardSet* set)
+{
+	// called under the set lock, reads keep a set indexed and recently used
+	if (!set->indexed)
+	{
+		for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+		{
+			leaderboard_expand(&set->windows[i].board);
+		}
+	}
+
+	pthread_mutex_lock(&registry_mutex);
+	set->indexed   = 1;
+	set->last_used = ++registry.clock;
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_trim()
+{
+	// only the most recently read sets stay indexed, the rest drop back to plain results
+	while (1)
+	{
+		pthread_mutex_lock(&registry_mutex);
+		LeaderboardSet* victim = 0;
+		u32 indexed = 0;
+		for (u32 i = 0; i < registry.capacity; i++)
+		{
+			LeaderboardSet* set = registry.sets[i];
+			if (!set || !set->indexed) { continue; }
+
+			indexed++;
+			if (!victim || set->last_used < victim->last_used) { victim = set; }
+		}
+		if (indexed <= REGISTRY_HOT)
+		{
+			pthread_mutex_unlock(&registry_mutex);
+			break;
+		}
+		victim->refs++;
+		pthread_mutex_unlock(&registry_mutex);
+
+		pthread_mutex_lock(&victim->lock);
+		for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+		{
+			leaderboard_compact(&victim->windows[i].board);
+		}
+		pthread_mutex_lock(&registry_mutex);
+		victim->indexed = 0;
+		pthread_mutex_unlock(&registry_mutex);
+		pthread_mutex_unlock(&victim->lock);
+		registry_release(victim);
+	}
+
+	// past the limit, the least recently used sets nobody holds are dropped entirely
+	pthread_mutex_lock(&registry_mutex);
+	while (registry.count > REGISTRY_MAX)
+	{
+		u32 victim = LEADERBOARD_NIL;
+		for (u32 i = 0; i < registry.capacity; i++)
+		{
+			LeaderboardSet* set = registry.sets[i];
+			if (!set || set->refs || set->mode == GAME_MODE_DEFAULT) { continue; }
+			if (victim == LEADERBOARD_NIL || set->last_used < registry.sets[victim]->last_used) { victim = i; }
+		}
+		if (victim == LEADERBOARD_NIL) { break; }
+
+		LeaderboardSet* set = registry.sets[victim];
+		DEBUG("Evicting leaderboard set for mode %016llx\n", (unsigned long long) set->mode);
+		registry_remove(victim);
+		registry.count--;
+		for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+		{
+			window_free(&set->windows[i]);
+		}
+		pthread_mutex_destroy(&set->lock);
+		free(set->history);
+		free(set);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+// ratings
+void rating_signal()
+{
+	// only wakes the rating manager, the work happens there
+	sem_post(&rating_semaphore);
+}
+
+void rating_load()
+{
+	RatingParams params;
+	params.player.rating     = RATING_CENTRE;
+	params.player.deviation  = 350.0;
+	params.player.volatility = 0.06;
+	params.tau               = 0.5;
+	params.board_base        = RATING_CENTRE;
+	params.board_density     = 200.0;
+	params.board_size        = 100.0;
+	params.board_deviation   = 50.0;
+
+	// optional overrides, one "name value" pair per line
+	FILE* file = fopen(RATING_FILE, "r");
+	if (file)
+	{
+		char name[32];
+		f64  value;
+		while (fscanf(file, "%31s %lf", name, &value) == 2)
+		{
+			if      (!strcmp(name, "rating"))          { params.player.rating     = value; }
+			else if (!strcmp(name, "deviation"))       { params.player.deviation  = value; }
+			else if (!strcmp(name, "volatility"))      { params.player.volatility = value; }
+			else if (!strcmp(name, "tau"))             { params.tau               = value; }
+			else if (!strcmp(name, "board_base"))      { params.board_base        = value; }
+			else if (!strcmp(name, "board_density"))   { params.board_density     = value; }
+			else if (!strcmp(name, "board_size"))      { params.board_size        = value; }
+			else if (!strcmp(name, "board_deviation")) { params.board_deviation   = value; }
+			else { WARN("Unknown rating parameter: %s\n", name); }
+		}
+		fclose(file);
+	}
+
+	pthread_mutex_lock(&rating_mutex);
+	rating_params = params;
+	pthread_mutex_unlock(&rating_mutex);
+}
+
+Rating rating_initial()
+{
+	pthread_mutex_lock(&rating_mutex);
+	Rating rating = rating_params.player;
+	pthread_mutex_unlock(&rating_mutex);
+	return rating;
+}
+
+void rating_board(u64 mode, RatingParams* params, Rating* board)
+{
+	// the board is the opponent, denser and larger boards play stronger
+	f64 rows  = (mode >> 56) & 0xff;
+	f64 cols  = (mode >> 48) & 0xff;
+	f64 mines = (mode >> 32) & 0xffff;
+	f64 tiles = (rows * cols > 0) ? rows * cols : 1;
+
+	board->rating = params->board_base + 
+		params->board_density * (mines / tiles - (f64) NUM_MINES / NUM_TILES) * 10 + 
+		params->board_size    * log2(tiles / NUM_TILES);
+	board->deviation  = params->board_deviation;
+	board->volatility = 0;
+}
+
+f64 rating_volatility(f64 x, f64 delta, f64 phi, f64 v, f64 a, f64 tau)
+{
+	f64 ex = exp(x);
+	f64 d  = phi * phi + v + ex;
+	return (ex * (delta * delta - phi * phi - v - ex)) / (2 * d * d) - (x - a) / (tau * tau);
+}
+
+void rating_update(Rating* player, Rating* board, f64 score, RatingParams* params)
+{
+	// glicko-2, every game is a rating period of its own against the board
+	f64 mu    = (player->rating - RATING_CENTRE) / RATING_SCALE;
+	f64 phi   = player->deviation / RATING_SCALE;
+	f64 sigma = player->volatility;
+	f64 mu_j  = (board->rating - RATING_CENTRE) / RATING_SCALE;
+	f64 phi_j = board->deviation / RATING_SCALE;
+
+	f64 g     = 1 / sqrt(1 + 3 * phi_j * phi_j / (M_PI * M_PI));
+	f64 e     = 1 / (1 + exp(-g * (mu - mu_j)));
+	f64 v     = 1 / (g * g * e * (1 - e));
+	f64 delta = v * g * (score - e);
+
+	// new volatility, illinois iteration
+	f64 tau = params->tau;
+	f64 a   = log(sigma * sigma);
+	f64 A   = a;
+	f64 B;
+	if (delta * delta > phi * phi + v)
+	{
+		B = log(delta * delta - phi * phi - v);
+	}
+	else
+	{
+		u32 k = 1;
+		while (rating_volatility(a - k * tau, delta, phi, v, a, tau) < 0 && k < RATING_ITERATIONS) { k++; }
+		B = a - k * tau;
+	}
+
+	f64 f_a = rating_volatility(A, delta, phi, v, a, tau);
+	f64 f_b = rating_volatility(B, delta, phi, v, a, tau);
+	for (u32 i = 0; i < RATING_ITERATIONS && fabs(B - A) > RATING_EPSILON; i++)
+	{
+		f64 C   = A + (A - B) * f_a / (f_b - f_a);
+		f64 f_c = rating_volatility(C, delta, phi, v, a, tau);
+		if (f_c * f_b <= 0)
+		{
+			A   = B;
+			f_a = f_b;
+		}
+		else
+		{
+			f_a /= 2;
+		}
+		B   = C;
+		f_b = f_c;
+	}
+	sigma = exp(A / 2);
+
+	// new deviation and rating
+	f64 phi_star = sqrt(phi * phi + sigma * sigma);
+	phi = 1 / sqrt(1 / (phi_star * phi_star) + 1 / v);
+	mu  = mu + phi * phi * g * (score - e);
+
+	player->rating     = mu  * RATING_SCALE + RATING_CENTRE;
+	player->deviation  = phi * RATING_SCALE;
+	player->volatility = sigma;
+}
+
+void rating_spread(LeaderboardSet* set, u8* username)
+{
+	// the all time rating is the current estimate, the other windows show it, callers have already rated all time
+	Leaderboard* all = &set->windows[LEADERBOARD_WINDOW_ALL].board;
+	u32 id = leaderboard_find(all, username);
+	if (id == LEADERBOARD_NIL) { return; }
+
+	for (u8 i = 0; i < LEADERBOARD_WINDOWS; i++)
+	{
+		Leaderboard* lb = &set->windows[i].board;
+		if (lb == all) { continue; }
+		u32 window_id = leaderboard_find(lb, username);
+		if (window_id != LEADERBOARD_NIL)
+		{
+			leaderboard_rate(lb, window_id, all->entries[id].rating);
+		}
+	}
+}
+
+void rating_result(LeaderboardSet* set, u8* username, u8 score)
+{
+	// called under the set lock, the history is kept for recomputes
+	Leaderboard* all = &set->windows[LEADERBOARD_WINDOW_ALL].board;
+	u32 id = leaderboard_find(all, username);
+	if (id == LEADERBOARD_NIL) { return; }
+
+	if (set->history_count == set->history_capacity)
+	{
+		set->history_capacity = set->history_capacity ? set->history_capacity * 2 : 16;
+		set->history = realloc(set->history, sizeof(GameRecord) * set->history_capacity);
+	}
+	set->history[set->history_count].id    = id;
+	set->history[set->history_count].score = score;
+	set->history_count++;
+
+	pthread_mutex_lock(&rating_mutex);
+	RatingParams params = rating_params;
+	pthread_mutex_unlock(&rating_mutex);
+
+	Rating board;
+	Rating rating = all->entries[id].rating;
+	rating_board(set->mode, &params, &board);
+	rating_update(&rating, &board, score, &params);
+	leaderboard_rate(all, id, rating);
+	rating_spread(set, username);
+	DEBUG("Rating -> %.1f (%.1f)\n", rating.rating, rating.deviation);
+}
+
+void* rating_replay_handler(void* void_job)
+{
+	// players never meet, so each one replays independently
+	RatingJob* job = (RatingJob*) void_job;
+	for (u32 id = job->first; id < job->last; id++)
+	{
+		Rating rating = job->params.player;
+		for (u32 i = job->offsets[id]; i < job->offsets[id + 1]; i++)
+		{
+			rating_update(&rating, &job->board, job->scores[i], &job->params);
+		}
+		job->ratings[id] = rating;
+	}
+	return 0;
+}
+
+u64 rating_recompute(LeaderboardSet* set, RatingParams* params, u32 threads)
+{
+	// snapshot the history, games keep arriving while the replay runs
+	pthread_mutex_lock(&set->lock);
+	u32 count   = set->history_count;
+	u32 players = set->windows[LEADERBOARD_WINDOW_ALL].board.count;
+	GameRecord* history = malloc(sizeof(GameRecord) * (count ? count : 1));
+	memcpy(history, set->history, sizeof(GameRecord) * count);
+	pthread_mutex_unlock(&set->lock);
+
+	// group by player with a counting sort, keeping each player's games in order
+	u32* offsets = calloc(players + 1, sizeof(u32));
+	u32* cursors = malloc(sizeof(u32) * (players ? players : 1));
+	u8*  scores  = malloc(count ? count : 1);
+	for (u32 i = 0; i < count; i++)
+	{
+		offsets[history[i].id + 1]++;
+	}
+	for (u32 id = 0; id < players; id++)
+	{
+		offsets[id + 1] += offsets[id];
+		cursors[id]      = offsets[id];
+	}
+	for (u32 i = 0; i < count; i++)
+	{
+		scores[cursors[history[i].id]++] = history[i].score;
+	}
+	free(cursors);
+	free(history);
+
+	// split the players into runs of roughly equal games, one per thread
+	Rating*   ratings = malloc(sizeof(Rating) * (players ? players : 1));
+	RatingJob jobs[RATING_THREADS_MAX];
+	pthread_t workers[RATING_THREADS_MAX];
+	if (count < RATING_PARALLEL_MIN) { threads = 1; }
+
+	u32 first = 0;
+	for (u32 t = 0; t < threads; t++)
+	{
+		u64 target = (u64) count * (t + 1) / threads;
+		u32 last   = first;
+		while (last < players && (t + 1 == threads || offsets[last] < target)) { last++; }
+
+		jobs[t].scores  = scores;
+		jobs[t].offsets = offsets;
+		jobs[t].ratings = ratings;
+		jobs[t].first   = first;
+		jobs[t].last    = last;
+		jobs[t].params  = *params;
+		rating_board(set->mode, params, &jobs[t].board);
+		if (threads > 1)
+		{
+			pthread_create(&workers[t], 0, rating_replay_handler, &jobs[t]);
+		}
+		else
+		{
+			rating_replay_handler(&jobs[t]);
+		}
+		first = last;
+	}
+	for (u32 t = 0; threads > 1 && t < threads; t++)
+	{
+		pthread_join(workers[t], 0);
+	}
+	free(scores);
+	free(offsets);
+
+	// install, catching up on anything played in the meantime
+	pthread_mutex_lock(&set->lock);
+	Leaderboard* all = &set->windows[LEADERBOARD_WINDOW_ALL].board;
+	if (all->count > players)
+	{
+		ratings = realloc(ratings, sizeof(Rating) * all->count);
+		for (u32 id = players; id < all->count; id++)
+		{
+			ratings[id] = params->player;
+		}
+	}
+	for (u32 i = count; i < set->history_count; i++)
+	{
+		rating_update(&ratings[set->history[i].id], &jobs[0].board, set->history[i].score, params);
+	}
+	for (u32 id = 0; id < all->count; id++)
+	{
+		leaderboard_rate(all, id, ratings[id]);
+		rating_spread(set, all->entries[id].username);
+	}
+	count = set->history_count;
+	pthread_mutex_unlock(&set->lock);
+
+	free(ratings);
+	return count;
+}
+
+void* rating_handler()
+{
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, 0);
+
+	i64 cores   = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 threads = (cores < 1) ? 1 : (cores > RATING_THREADS_MAX) ? RATING_THREADS_MAX : cores;
+
+	while (1)
+	{
+		// SIGHUP reloads the parameters and replays every game with them
+		if (sem_wait(&rating_semaphore)) { continue; }
+		rating_load();
+
+		pthread_mutex_lock(&rating_mutex);
+		RatingParams params = rating_params;
+		pthread_mutex_unlock(&rating_mutex);
+
+		struct timespec start, end, dt;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		u64 games = 0;
+		u32 set_count;
+		LeaderboardSet** sets = registry_collect(&set_count);
+		for (u32 i = 0; i < set_count; i++)
+		{
+			games += rating_recompute(sets[i], &params, threads);
+			registry_release(sets[i]);
+		}
+		free(sets);
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		time_diff(start, end, &dt);
+		LOG("Ratings recomputed from %llu games on %u threads in %ld.%03lds\n", 
+			(unsigned long long) games, threads, (long) dt.tv_sec, dt.tv_nsec / 1000000);
+	}
+}
+
+// boards
+u8 board_get(u8* board, u16 tile)
+{
+	// two tiles a byte, even tiles in the low nibble
+	return (board[tile >> 1] >> ((tile & 1) << 2)) & 0x0f;
+}
+
+void board_set(u8* board, u16 tile, u8 value)
+{
+	u8 shift = (tile & 1) << 2;
+	board[tile >> 1] = (board[tile >> 1] & ~(0x0f << shift)) | ((value & 0x0f) << shift);
+}
+
+void board_pack(u8* board, u8* tiles, u16 count)
+{
+	u16 i = 0;
+	#ifdef __SSE2__
+	// 32 tiles at a time, each pair of bytes folds into one
+	const __m128i low = _mm_set1_epi16(0x000f);
+	const __m128i high = _mm_set1_epi16(0x00f0);
+	for (; i + 32 <= count; i += 32)
+	{
+		__m128i a = _mm_loadu_si128((__m128i*) (tiles + i));
+		__m128i b = _mm_loadu_si128((__m128i*) (tiles + i + 16));
+		a = _mm_or_si128(_mm_and_si128(a, low), _mm_and_si128(_mm_srli_epi16(a, 4), high));
+		b = _mm_or_si128(_mm_and_si128(b, low), _mm_and_si128(_mm_srli_epi16(b, 4), high));
+		_mm_storeu_si128((__m128i*) (board + (i >> 1)), _mm_packus_epi16(a, b));
+	}
+	#endif
+	for (; i + 1 < count; i += 2)
+	{
+		board[i >> 1] = (tiles[i] & 0x0f) | (tiles[i + 1] << 4);
+	}
+	if (i < count)
+	{
+		board[i >> 1] = (board[i >> 1] & 0xf0) | (tiles[i] & 0x0f);
+	}
+}
+
+void board_unpack(u8* board, u8* tiles, u16 count)
+{
+	u16 i = 0;
+	#ifdef __SSE2__
+	// 16 packed bytes spread back out to 32 tiles
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	for (; i + 32 <= count; i += 32)
+	{
+		__m128i packed = _mm_loadu_si128((__m128i*) (board + (i >> 1)));
+		__m128i even   = _mm_and_si128(packed, mask);
+		__m128i odd    = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		_mm_storeu_si128((__m128i*) (tiles + i),      _mm_unpacklo_epi8(even, odd));
+		_mm_storeu_si128((__m128i*) (tiles + i + 16), _mm_unpackhi_epi8(even, odd));
+	}
+	#endif
+	for (; i < count; i++)
+	{
+		tiles[i] = board_get(board, i);
 	}
 }
 